@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#include "fs.h"
+#include "timing.h"
+
+// throughput and compression ratio of every data compression mode
+// for text, media-like and random data, through the fs library
+//
+// usage: test-compression dir [megabytes] [blocksize]
+
+static void gen_text(std::string & data, size_t size)
+{
+	static const char * words[] = {
+		"the", "ldbfs", "block", "key", "inode", "leveldb", "of", "and",
+		"write", "read", "directory", "file", "compaction", "to", "a", "in"
+	};
+	while (data.size() < size) {
+		data += words[rand() % 16];
+		data += (rand() % 12) ? ' ' : '\n';
+	}
+	data.resize(size);
+}
+
+static void gen_media(std::string & data, size_t size)
+{
+	// entropy coded payload with small periodic frame headers
+	data.resize(size);
+	for (size_t i = 0; i < size; ++i) {
+		if (i % 4096 < 16) {
+			data[i] = (char)(i % 4096);
+		} else {
+			data[i] = (char)(rand() % 256);
+		}
+	}
+}
+
+static void gen_random(std::string & data, size_t size)
+{
+	data.resize(size);
+	for (size_t i = 0; i < size; ++i) {
+		data[i] = (char)(rand() % 256);
+	}
+}
+
+static uint64_t table_size(const std::string & dir)
+{
+	uint64_t size = 0;
+	boost::filesystem::recursive_directory_iterator it(dir), end;
+	for (; it != end; ++it) {
+		std::string ext = it->path().extension().string();
+		if (ext == ".sst" || ext == ".ldb") {
+			size += boost::filesystem::file_size(it->path());
+		}
+	}
+	return size;
+}
+
+int main(int argc, char ** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s dir [megabytes] [blocksize]\n", argv[0]);
+		return -1;
+	}
+
+	std::string root = argv[1];
+	size_t total = ((argc > 2) ? atoi(argv[2]) : 256) * 1024L * 1024L;
+	int blocksize = (argc > 3) ? atoi(argv[3]) : 128*1024;
+	int parts = 2;
+
+	const char * kinds[] = { "text", "media", "random" };
+	const char * modes[] = { "none", "snappy", "lz4", "adaptive" };
+
+	boost::log::core::get()->set_logging_enabled(false);
+
+	printf("%-8s %-10s %12s %12s %8s\n", "data", "mode", "write MB/s", "read MB/s", "ratio");
+
+	for (int k = 0; k < 3; ++k) {
+		std::string data;
+		switch (k) {
+		case 0: gen_text(data, 4*1024*1024); break;
+		case 1: gen_media(data, 4*1024*1024); break;
+		case 2: gen_random(data, 4*1024*1024); break;
+		}
+
+		for (int m = 0; m < 4; ++m) {
+			std::string dir = root + "/" + kinds[k] + "-" + modes[m];
+			boost::filesystem::remove_all(dir);
+			boost::filesystem::create_directories(dir);
+
+			FS fs(dir);
+			fs.data_compression = FS::compression_type(modes[m]);
+			fs.mkfs(blocksize, parts);
+
+			entry_ptr f(new fentry("data", &fs));
+			fs.root->add_child(f);
+
+			uint64_t t1 = now_ns();
+			for (size_t off = 0; off < total; off += data.size()) {
+				batch_t batch;
+				f->write_buf(batch, data.c_str(), data.size(), off);
+				fs.write(batch, false);
+				if (off % (32*1024*1024) == 0) {
+					fs.flush_buckets();
+				}
+			}
+			fs.flush_buckets();
+			uint64_t t2 = now_ns();
+
+			std::string buf(data.size(), 0);
+			for (size_t off = 0; off < total; off += buf.size()) {
+				f->read_buf(&buf[0], buf.size(), off);
+			}
+			uint64_t t3 = now_ns();
+
+			// compression only happens when memtables become tables
+			for (int i = 1; i <= parts; ++i) {
+				fs.buckets[i].db->CompactRange(0, 0);
+			}
+
+			uint64_t stored = 0;
+			for (int i = 0; i < parts; ++i) {
+				char buf[1024];
+				snprintf(buf, sizeof(buf), "/fentry-%04d", i);
+				stored += table_size(dir + buf);
+			}
+
+			printf("%-8s %-10s %12.1f %12.1f %8.2f\n",
+			       kinds[k], modes[m],
+			       total / ((t2 - t1) / 1e9) / 1024 / 1024,
+			       total / ((t3 - t2) / 1e9) / 1024 / 1024,
+			       stored ? (double)total / stored : 0.0);
+		}
+	}
+
+	return 0;
+}
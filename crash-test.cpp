@@ -0,0 +1,800 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include "messages.pb.h"
+#include "fs.h"
+
+// crash consistency harness: a forked child runs random namespace and
+// data ops against the fs library and dies at a random fsync, a second
+// child mounts what is left and checks it against the ops log
+//
+// usage: test-crash dir [--iterations n] [--ops n] [--seed n]
+//          [--mode process|power] [--blocksize n] [--parts n]
+//          [--meta-parts n] [--flat-dirs] [--inode64] [--journal]
+//          [--flush-ops n] [--recovery 1,16,64] [--flush-mb n]
+//          [--extent-size n]
+//
+// every fsync/fdatasync of the process is a crash point, leveldb and
+// vlog included. process: the child exits, written data stays. power:
+// files are also cut to their size at the last sync of the inode;
+// renames and unlinks count as durable, writes of other threads racing
+// the cut are not caught.
+//
+// iteration 0 runs without a crash and counts the sync points, the
+// others crash at a random one. checked after mount:
+//   dangling     directory entry whose record is missing
+//   missing      completed create/mkdir/rename not there
+//   unexpected   completed unlink/rmdir/rename undone
+//   lost_synced  file after FS::sync with a different size
+//   bad_content  stored bytes that were never written there
+//   past_eof     blocks beyond the stored size
+// orphans, records not reachable from root, are counted only.
+// paths of the op in flight at the crash are not checked.
+//
+// writes append, or rewrite the same bytes at an unaligned offset inside
+// the file; a rewrite may only leave the content as it was. with
+// --extent-size they are long enough to make and split extents
+//
+// --recovery: per size, write that many MB without FS::sync, flushing
+// buckets every --flush-mb, exit and time the mount
+
+struct options
+{
+	std::string dir;
+	int iterations;
+	int ops;
+	unsigned int seed;
+	bool power;
+	int blocksize;
+	int parts;
+	int meta_parts;
+	bool flat_dirs;
+	bool inode64;
+	bool journal;
+	int flush_ops;
+	int flush_mb;
+	int extent_size;
+};
+
+static options opt;
+
+// state of the crashing child, set after fork
+static int sync_count;
+static int crash_at; // sync point, 0: never
+static std::string crash_dir;
+static int oracle_fd = -1;
+static FS * crash_fs;
+static boost::mutex synced_mutex;
+static std::map<ino_t, off_t> synced; // power mode, size at the last sync
+
+static void record(const char * line)
+{
+	if (write(oracle_fd, line, strlen(line)) < 0) {
+		_exit(2);
+	}
+}
+
+static void cut_unsynced()
+{
+	boost::unique_lock<boost::mutex> scoped_lock(synced_mutex);
+	boost::filesystem::recursive_directory_iterator it(crash_dir), end;
+	for (; it != end; ++it) {
+		struct stat st;
+		std::string path = it->path().string();
+		if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+		std::map<ino_t, off_t>::iterator s = synced.find(st.st_ino);
+		off_t keep = (s == synced.end()) ? 0 : s->second;
+		if (st.st_size > keep && ::truncate(path.c_str(), keep) != 0) {
+			_exit(2);
+		}
+	}
+}
+
+// lost by design with the process, stats only
+static unsigned long long dirty_bytes()
+{
+	unsigned long long dirty = 0;
+	if (crash_fs) {
+		for (int i = 0; i < crash_fs->buckets_count(); ++i) {
+			dirty += crash_fs->buckets[i].dirty;
+		}
+	}
+	return dirty;
+}
+
+static void crash(int n)
+{
+	char line[128];
+	snprintf(line, sizeof(line), "! crash %d %llu\n", n, dirty_bytes());
+	record(line);
+	if (opt.power) {
+		cut_unsynced();
+	}
+	_exit(99);
+}
+
+static int sync_point(int fd, long call)
+{
+	int n = __sync_add_and_fetch(&sync_count, 1);
+	if (n == crash_at) {
+		crash(n);
+	}
+	int r = syscall(call, fd);
+	struct stat st;
+	if (r == 0 && opt.power && fstat(fd, &st) == 0) {
+		boost::unique_lock<boost::mutex> scoped_lock(synced_mutex);
+		synced[st.st_ino] = st.st_size;
+	}
+	return r;
+}
+
+// take the libc ones, the leveldb library calls resolve here
+extern "C" int fsync(int fd)
+{
+	return sync_point(fd, SYS_fsync);
+}
+
+extern "C" int fdatasync(int fd)
+{
+	return sync_point(fd, SYS_fdatasync);
+}
+
+// expected namespace, replayed from the ops log by the checker
+struct node
+{
+	bool dir;
+	int id;       // content pattern of a file
+	size_t size;  // written, an upper bound after a crash
+	bool frozen;  // FS::sync returned, never written again
+};
+
+typedef std::map<std::string, node> model_t;
+
+struct op
+{
+	std::string kind;
+	std::string a;
+	std::string b; // rename target, "-" otherwise
+	long off;
+	long len;
+};
+
+static char pattern(int id, size_t off)
+{
+	return (char)(id * 131 + off * 7 + (off >> 12));
+}
+
+static void apply(model_t & m, const op & o, int & next_id)
+{
+	if (o.kind == "mkdir") {
+		node n = { true, 0, 0, false };
+		m[o.a] = n;
+	} else if (o.kind == "create") {
+		node n = { false, next_id++, 0, false };
+		m[o.a] = n;
+	} else if (o.kind == "write") {
+		m[o.a].size = std::max(m[o.a].size, (size_t)(o.off + o.len));
+	} else if (o.kind == "sync") {
+		m[o.a].frozen = true;
+	} else if (o.kind == "rename") {
+		node n = m[o.a];
+		m.erase(o.a);
+		m[o.b] = n;
+	} else if (o.kind == "unlink" || o.kind == "rmdir") {
+		m.erase(o.a);
+	}
+}
+
+static std::string pick(const std::vector<std::string> & v, unsigned int & seed)
+{
+	return v[rand_r(&seed) % v.size()];
+}
+
+static std::string child_path(const std::string & dir, const char * prefix, int i)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+	return (dir.empty()) ? buf : dir + "/" + buf;
+}
+
+static op next_op(const model_t & m, int i, unsigned int & seed)
+{
+	std::vector<std::string> dirs(1, std::string()), files, writable, empty;
+	for (model_t::const_iterator it = m.begin(); it != m.end(); ++it) {
+		if (it->second.dir) {
+			dirs.push_back(it->first);
+			model_t::const_iterator next = it;
+			++next;
+			if (next == m.end() || next->first.compare(0, it->first.size() + 1, it->first + "/") != 0) {
+				empty.push_back(it->first);
+			}
+		} else {
+			files.push_back(it->first);
+			if (!it->second.frozen) {
+				writable.push_back(it->first);
+			}
+		}
+	}
+
+	op o;
+	o.b = "-";
+	o.off = o.len = 0;
+	int r = rand_r(&seed) % 100;
+	if (r < 8) {
+		o.kind = "mkdir";
+		o.a = child_path(pick(dirs, seed), "d", i);
+	} else if (r < 65 && r >= 35 && !writable.empty()) {
+		o.kind = "write";
+		o.a = pick(writable, seed);
+		size_t size = m.find(o.a)->second.size;
+		o.off = (size > 0 && rand_r(&seed) % 3 == 0) ? rand_r(&seed) % size : size;
+		o.len = 1 + rand_r(&seed) % std::max(3 * opt.blocksize, 2 * opt.extent_size);
+	} else if (r < 75 && r >= 65 && !writable.empty()) {
+		o.kind = "sync";
+		o.a = pick(writable, seed);
+	} else if (r < 88 && r >= 75 && !files.empty()) {
+		o.kind = "rename";
+		o.a = pick(files, seed);
+		o.b = (rand_r(&seed) % 4 == 0) ? pick(files, seed) : child_path(pick(dirs, seed), "r", i);
+		if (o.b == o.a) {
+			o.b = child_path(pick(dirs, seed), "r", i);
+		}
+	} else if (r < 98 && r >= 88 && !files.empty()) {
+		o.kind = "unlink";
+		o.a = pick(files, seed);
+	} else if (r >= 98 && !empty.empty()) {
+		o.kind = "rmdir";
+		o.a = pick(empty, seed);
+	} else {
+		o.kind = "create";
+		o.a = child_path(pick(dirs, seed), "f", i);
+	}
+	return o;
+}
+
+static int run_op(FS & fs, const op & o, const model_t & m)
+{
+	if (o.kind == "mkdir") {
+		return fs.mkdir(o.a);
+	} else if (o.kind == "create") {
+		entry_ptr e;
+		return fs.create(o.a, e);
+	} else if (o.kind == "rename") {
+		return fs.rename(o.a, o.b);
+	} else if (o.kind == "unlink") {
+		return fs.unlink(o.a);
+	} else if (o.kind == "rmdir") {
+		return fs.rmdir(o.a);
+	}
+
+	entry_ptr e = fs.find(o.a);
+	if (!e) {
+		return -ENOENT;
+	}
+	if (o.kind == "sync") {
+		return (fs.sync(e)) ? 0 : -EIO;
+	}
+	std::string data(o.len, 0);
+	int id = m.find(o.a)->second.id;
+	for (long k = 0; k < o.len; ++k) {
+		data[k] = pattern(id, o.off + k);
+	}
+	batch_t batch;
+	int r = e->write_buf(batch, data.c_str(), data.size(), o.off);
+	if (r < 0) {
+		return r;
+	}
+	return (fs.write(batch, false)) ? 0 : -EIO;
+}
+
+static void record_op(const op & o)
+{
+	char line[1024];
+	snprintf(line, sizeof(line), "+ %s %s %s %ld %ld\n",
+	         o.kind.c_str(), o.a.c_str(), o.b.c_str(), o.off, o.len);
+	record(line);
+}
+
+static void record_rc(int rc)
+{
+	char line[32];
+	snprintf(line, sizeof(line), "= %d\n", rc);
+	record(line);
+}
+
+static FS * start(const std::string & dir, int crash_point)
+{
+	oracle_fd = ::open((dir + ".ops").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (oracle_fd < 0) {
+		_exit(2);
+	}
+	crash_dir = dir;
+
+	FS * fs = new FS(dir);
+	fs->meta_parts = opt.meta_parts;
+	fs->flat_dirs = opt.flat_dirs;
+	fs->inode64 = opt.inode64;
+	fs->journaled = opt.journal;
+	fs->extent_size = opt.extent_size;
+	fs->mkfs(opt.blocksize, opt.parts);
+	// mkfs itself is not crash safe, count from here
+	crash_fs = fs;
+	sync_count = 0;
+	crash_at = crash_point;
+	return fs;
+}
+
+static void finish()
+{
+	char line[128];
+	snprintf(line, sizeof(line), "! done %d %llu\n", sync_count, dirty_bytes());
+	record(line);
+	// no umount, what is still dirty is lost as in a crash
+	_exit(0);
+}
+
+static void workload(const std::string & dir, int crash_point)
+{
+	FS & fs = *start(dir, crash_point);
+	model_t m;
+	int next_id = 0;
+	unsigned int seed = opt.seed;
+	for (int i = 0; i < opt.ops; ++i) {
+		op o = next_op(m, i, seed);
+		record_op(o);
+		int rc = run_op(fs, o, m);
+		record_rc(rc);
+		if (rc == 0) {
+			apply(m, o, next_id);
+		}
+		// stands in for the per part flush threads
+		if (opt.flush_ops > 0 && (i + 1) % opt.flush_ops == 0) {
+			fs.flush_buckets();
+		}
+	}
+	finish();
+}
+
+// --recovery: mb files of 1MB, nothing synced
+static void fill(const std::string & dir, int mb)
+{
+	FS & fs = *start(dir, 0);
+	model_t m;
+	int next_id = 0;
+	size_t written = 0;
+	for (int f = 0; f < mb; ++f) {
+		op o;
+		o.kind = "create";
+		o.a = child_path("", "f", f);
+		o.b = "-";
+		o.off = o.len = 0;
+		record_op(o);
+		record_rc(run_op(fs, o, m));
+		apply(m, o, next_id);
+
+		o.kind = "write";
+		o.len = opt.blocksize;
+		for (o.off = 0; o.off < 1024 * 1024; o.off += o.len) {
+			record_op(o);
+			record_rc(run_op(fs, o, m));
+			apply(m, o, next_id);
+			written += o.len;
+			if (opt.flush_mb > 0 && written % (opt.flush_mb * 1024L * 1024L) == 0) {
+				fs.flush_buckets();
+			}
+		}
+	}
+	finish();
+}
+
+struct report
+{
+	int completed;
+	int crash_sync; // 0: no crash
+	unsigned long long dirty;
+	int syncs;      // clean run
+	double mount_ms;
+	int files;
+	int dirs;
+	int dangling;
+	int missing;
+	int unexpected;
+	int lost_synced;
+	int bad_content;
+	int past_eof;
+	int orphans;
+
+	int errors() const {
+		return dangling + missing + unexpected + lost_synced + bad_content + past_eof;
+	}
+};
+
+struct found
+{
+	bool dir;
+	std::string ino;
+	entry_ptr e;
+};
+
+static void read_ops(const std::string & dir, model_t & m, std::set<std::string> & uncertain, report & r)
+{
+	FILE * f = fopen((dir + ".ops").c_str(), "r");
+	if (!f) {
+		return;
+	}
+	char line[1024], kind[32], a[512], b[512];
+	op o;
+	bool open = false;
+	int next_id = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '+' && sscanf(line, "+ %31s %511s %511s %ld %ld", kind, a, b, &o.off, &o.len) == 5) {
+			o.kind = kind;
+			o.a = a;
+			o.b = b;
+			open = true;
+		} else if (line[0] == '=' && open) {
+			if (atoi(line + 2) == 0) {
+				apply(m, o, next_id);
+			}
+			open = false;
+			r.completed ++;
+		} else if (line[0] == '!') {
+			sscanf(line, "! crash %d %llu", &r.crash_sync, &r.dirty);
+			sscanf(line, "! done %d %llu", &r.syncs, &r.dirty);
+		}
+	}
+	fclose(f);
+
+	if (open) {
+		if (o.kind == "write") {
+			apply(m, o, next_id); // size bound
+		} else if (o.kind != "sync") {
+			uncertain.insert(o.a);
+			uncertain.insert(o.b);
+		}
+	}
+}
+
+// children of a stored directory record, either format
+static bool stored_children(entry * d, std::vector<std::pair<std::string, std::pair<uint32_t, std::string> > > & r)
+{
+	std::string value;
+	if (!d->read_value(value)) {
+		return false;
+	}
+	dir_record rec(value.data(), value.size());
+	if (rec.valid()) {
+		for (uint32_t i = 0; i < rec.count(); ++i) {
+			dir_record::child c = rec.at(i);
+			if (c.name) {
+				r.push_back(std::make_pair(std::string(c.name, c.name_len),
+					std::make_pair(c.mode, std::string((const char*)c.ino, sizeof(uuid_t)))));
+			}
+		}
+		return true;
+	}
+	proto::entry e;
+	if (!e.ParseFromString(value)) {
+		return false;
+	}
+	for (int i = 0; i < e.children_size(); ++i) {
+		const proto::entry_child & c = e.children(i);
+		r.push_back(std::make_pair(c.name(), std::make_pair(c.mode(), c.ino())));
+	}
+	return true;
+}
+
+static void walk(FS & fs, entry * d, const std::string & path, std::map<std::string, found> & seen, report & r)
+{
+	std::vector<std::pair<std::string, std::pair<uint32_t, std::string> > > children;
+	if (!stored_children(d, children)) {
+		fprintf(stderr, "cannot read directory /%s\n", path.c_str());
+		r.dangling ++;
+		return;
+	}
+	for (size_t i = 0; i < children.size(); ++i) {
+		const std::string & name = children[i].first;
+		uint32_t mode = children[i].second.first;
+		const std::string & ino = children[i].second.second;
+		std::string p = (path.empty()) ? name : path + "/" + name;
+		if (ino.size() != sizeof(uuid_t) || !(S_ISDIR(mode) || S_ISREG(mode))) {
+			continue;
+		}
+
+		entry_ptr c((S_ISDIR(mode)) ? (entry*)new dentry(name, &fs) : (entry*)new fentry(name, &fs));
+		memcpy(c->inode, ino.data(), sizeof(c->inode));
+		if (!c->read()) {
+			fprintf(stderr, "dangling /%s\n", p.c_str());
+			r.dangling ++;
+			continue;
+		}
+		found f = { S_ISDIR(mode), ino, c };
+		seen[p] = f;
+		if (f.dir) {
+			r.dirs ++;
+			walk(fs, c.get(), p, seen, r);
+		} else {
+			r.files ++;
+		}
+	}
+}
+
+static void check_file(const std::string & path, const node & n, const found & f, report & r)
+{
+	size_t size = f.e->st.size;
+	if (n.frozen && size != n.size) {
+		fprintf(stderr, "synced /%s: size %lu, expected %lu\n", path.c_str(),
+		        (unsigned long)size, (unsigned long)n.size);
+		r.lost_synced ++;
+	}
+	if (size > n.size) {
+		fprintf(stderr, "/%s: size %lu, written %lu\n", path.c_str(),
+		        (unsigned long)size, (unsigned long)n.size);
+		r.bad_content ++;
+		return;
+	}
+	std::string buf(size, 0);
+	if (size > 0 && f.e->read_buf(&buf[0], size, 0) != (int)size) {
+		r.bad_content ++;
+		return;
+	}
+	for (size_t k = 0; k < size; ++k) {
+		if (buf[k] != pattern(n.id, k)) {
+			fprintf(stderr, "/%s: bad byte at %lu\n", path.c_str(), (unsigned long)k);
+			r.bad_content ++;
+			return;
+		}
+	}
+}
+
+// stored records and blocks of all parts against the reachable tree
+static void scan_parts(FS & fs, const std::map<std::string, found> & seen, report & r)
+{
+	std::map<std::string, size_t> sizes; // reachable inodes
+	sizes[std::string((char*)fs.root->inode, sizeof(uuid_t))] = 0;
+	for (std::map<std::string, found>::const_iterator it = seen.begin(); it != seen.end(); ++it) {
+		sizes[it->second.ino] = (it->second.dir) ? 0 : it->second.e->st.size;
+	}
+
+	std::set<std::string> past_eof;
+	for (int i = 0; i < fs.buckets_count(); ++i) {
+		leveldb::Iterator * it = fs.buckets[i].db->NewIterator(leveldb::ReadOptions());
+		for (it->SeekToFirst(); it->Valid(); it->Next()) {
+			uuid_t zero;
+			memset(zero, 0, sizeof(zero));
+			block_key key('m', zero);
+			if (!key.decode(it->key().data(), it->key().size(), fs.buckets[i].compact)
+			    || (key.type != 'f' && key.type != 'd'))
+			{
+				continue;
+			}
+			std::string ino((char*)key.inode, sizeof(uuid_t));
+			std::map<std::string, size_t>::iterator s = sizes.find(ino);
+			if (s == sizes.end()) {
+				r.orphans += (key.meta) ? 1 : 0;
+			} else if (!key.meta && key.type == 'f' &&
+			           (size_t)ntohl(key.blockno) * fs.blocksize >= s->second)
+			{
+				past_eof.insert(ino);
+			}
+		}
+		delete it;
+	}
+	r.past_eof = past_eof.size();
+}
+
+static void verify(const std::string & dir, int iteration, int mb)
+{
+	report r;
+	memset(&r, 0, sizeof(r));
+	model_t m;
+	std::set<std::string> uncertain;
+	read_ops(dir, m, uncertain, r);
+
+	FS fs(dir);
+	uint64_t t1 = now_ns();
+	fs.mount();
+	r.mount_ms = (now_ns() - t1) / 1e6;
+
+	std::map<std::string, found> seen;
+	walk(fs, fs.root.get(), "", seen, r);
+
+	for (model_t::iterator it = m.begin(); it != m.end(); ++it) {
+		if (uncertain.count(it->first)) {
+			continue;
+		}
+		std::map<std::string, found>::iterator f = seen.find(it->first);
+		if (f == seen.end() || f->second.dir != it->second.dir) {
+			fprintf(stderr, "missing /%s\n", it->first.c_str());
+			r.missing ++;
+		} else if (!it->second.dir) {
+			check_file(it->first, it->second, f->second, r);
+		}
+	}
+	for (std::map<std::string, found>::iterator it = seen.begin(); it != seen.end(); ++it) {
+		if (!m.count(it->first) && !uncertain.count(it->first)) {
+			fprintf(stderr, "unexpected /%s\n", it->first.c_str());
+			r.unexpected ++;
+		}
+	}
+	scan_parts(fs, seen, r);
+
+	printf("{\"iteration\": %d, \"mode\": \"%s\", \"parts\": %d, \"meta_parts\": %d, "
+	       "\"journal\": %s, \"recovery_mb\": %d, \"crash_sync\": %d, \"syncs\": %d, \"completed_ops\": %d, "
+	       "\"dirty_bytes\": %llu, \"mount_ms\": %.2f, \"files\": %d, \"dirs\": %d, "
+	       "\"dangling\": %d, \"missing\": %d, \"unexpected\": %d, \"lost_synced\": %d, "
+	       "\"bad_content\": %d, \"past_eof\": %d, \"orphans\": %d, \"ok\": %s}\n",
+	       iteration, (opt.power) ? "power" : "process", opt.parts, opt.meta_parts,
+	       (opt.journal) ? "true" : "false", mb, r.crash_sync, r.syncs, r.completed, r.dirty, r.mount_ms, r.files, r.dirs,
+	       r.dangling, r.missing, r.unexpected, r.lost_synced,
+	       r.bad_content, r.past_eof, r.orphans, (r.errors()) ? "false" : "true");
+	fflush(stdout);
+	fs.umount();
+	_exit((r.errors()) ? 1 : 0);
+}
+
+// syncs: sync points of a run without a crash
+static bool iteration(int i, int crash_point, int mb, int & syncs)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "/iter-%04d", i);
+	std::string dir = opt.dir + buf;
+	boost::filesystem::remove_all(dir);
+	boost::filesystem::create_directories(dir);
+
+	int status;
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (mb > 0) {
+			fill(dir, mb);
+		} else {
+			workload(dir, crash_point);
+		}
+	}
+	waitpid(pid, &status, 0);
+
+	pid = fork();
+	if (pid == 0) {
+		verify(dir, i, mb);
+	}
+	waitpid(pid, &status, 0);
+
+	model_t m;
+	std::set<std::string> uncertain;
+	report r;
+	memset(&r, 0, sizeof(r));
+	read_ops(dir, m, uncertain, r);
+	syncs = r.syncs;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "iteration %d failed, kept %s\n", i, dir.c_str());
+		return false;
+	}
+	boost::filesystem::remove_all(dir);
+	boost::filesystem::remove(dir + ".ops");
+	return true;
+}
+
+static std::vector<int> split_sizes(const char * list)
+{
+	std::vector<int> r;
+	std::vector<std::string> v;
+	boost::algorithm::split(v, list, boost::algorithm::is_any_of(","));
+	for (size_t i = 0; i < v.size(); ++i) {
+		int n = atoi(v[i].c_str());
+		if (n > 0) {
+			r.push_back(n);
+		}
+	}
+	return r;
+}
+
+int main(int argc, char ** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s dir [--iterations n] [--ops n] [--seed n] "
+		        "[--mode process|power] [--blocksize n] [--parts n] [--meta-parts n] "
+		        "[--flat-dirs] [--inode64] [--journal] [--flush-ops n] [--recovery list] "
+		        "[--flush-mb n] [--extent-size n]\n",
+		        argv[0]);
+		return -1;
+	}
+
+	opt.dir = argv[1];
+	opt.iterations = 20;
+	opt.ops = 200;
+	opt.seed = 1;
+	opt.power = false;
+	opt.blocksize = 4096;
+	opt.parts = 2;
+	opt.meta_parts = 1;
+	opt.flat_dirs = false;
+	opt.inode64 = false;
+	opt.journal = false;
+	opt.flush_ops = 16;
+	opt.flush_mb = 4;
+	opt.extent_size = 0;
+	std::vector<int> recovery;
+
+	for (int i = 2; i < argc; ++i) {
+		const char * v = (i + 1 < argc) ? argv[i+1] : "0";
+		if (!strcmp(argv[i], "--iterations")) {
+			opt.iterations = atoi(v);
+		} else if (!strcmp(argv[i], "--ops")) {
+			opt.ops = atoi(v);
+		} else if (!strcmp(argv[i], "--seed")) {
+			opt.seed = atoi(v);
+		} else if (!strcmp(argv[i], "--mode")) {
+			opt.power = !strcmp(v, "power");
+		} else if (!strcmp(argv[i], "--blocksize")) {
+			opt.blocksize = atoi(v);
+		} else if (!strcmp(argv[i], "--parts")) {
+			opt.parts = atoi(v);
+		} else if (!strcmp(argv[i], "--meta-parts")) {
+			opt.meta_parts = atoi(v);
+		} else if (!strcmp(argv[i], "--flat-dirs")) {
+			opt.flat_dirs = true;
+		} else if (!strcmp(argv[i], "--inode64")) {
+			opt.inode64 = true;
+		} else if (!strcmp(argv[i], "--journal")) {
+			opt.journal = true;
+		} else if (!strcmp(argv[i], "--flush-ops")) {
+			opt.flush_ops = atoi(v);
+		} else if (!strcmp(argv[i], "--recovery")) {
+			recovery = split_sizes(v);
+		} else if (!strcmp(argv[i], "--flush-mb")) {
+			opt.flush_mb = atoi(v);
+		} else if (!strcmp(argv[i], "--extent-size")) {
+			opt.extent_size = atoi(v);
+		}
+	}
+
+	if (opt.iterations <= 0 || opt.ops <= 0 || opt.blocksize <= 0 ||
+	    opt.parts <= 0 || opt.meta_parts <= 0)
+	{
+		fprintf(stderr, "invalid iterations, ops, blocksize or parts\n");
+		return -1;
+	}
+	if (opt.extent_size < 0 || (opt.extent_size > 0 &&
+	    (opt.extent_size < 2 * opt.blocksize || opt.extent_size % opt.blocksize != 0)))
+	{
+		fprintf(stderr, "extent size must be a multiple of blocksize, at least two blocks\n");
+		return -1;
+	}
+
+	boost::log::core::get()->set_logging_enabled(false);
+
+	int failed = 0;
+	int runs = 0;
+	int syncs = 0;
+	if (!recovery.empty()) {
+		for (size_t i = 0; i < recovery.size(); ++i, ++runs) {
+			failed += (iteration(i, 0, recovery[i], syncs)) ? 0 : 1;
+		}
+	} else {
+		failed += (iteration(0, 0, 0, syncs)) ? 0 : 1;
+		int total = syncs;
+		unsigned int seed = opt.seed;
+		for (runs = 1; runs < opt.iterations && total > 0; ++runs) {
+			failed += (iteration(runs, 1 + rand_r(&seed) % total, 0, syncs)) ? 0 : 1;
+		}
+	}
+
+	printf("{\"iterations\": %d, \"failed\": %d}\n", runs, failed);
+	return (failed) ? 1 : 0;
+}
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <time.h>
 
+#include <algorithm>
 #include <boost/log/trivial.hpp>
 
 #include "messages.pb.h"
@@ -12,21 +13,52 @@
 
 #include "dentry.h"
 #include "fs.h"
+#include "pool.h"
 
 using namespace boost::log::trivial;
 
+void intrusive_ptr_add_ref(entry * e)
+{
+	e->refs.fetch_add(1, boost::memory_order_relaxed);
+}
+
+void intrusive_ptr_release(entry * e)
+{
+	if (e->refs.fetch_sub(1, boost::memory_order_release) == 1) {
+		boost::atomic_thread_fence(boost::memory_order_acquire);
+		delete e;
+	}
+}
+
+void * entry::operator new(size_t size)
+{
+	return node_alloc(size);
+}
+
+void entry::operator delete(void * p, size_t size)
+{
+	node_free(p, size);
+}
+
 entry::entry(const std::string & name, FS * fs):
 	fs(fs),
-	lg(fs->lg),
+	parent(0),
+	refs(0),
+	ino(0),
 	name(name)
 {
+	fs->nodes ++;
 	time_t now = time(0);
 	memset(&st, 0, sizeof(st));
-	st.st_atime = now;
-	st.st_ctime = now;
-	st.st_mtime = now;
-	st.st_blksize = 4096; // fixme
-	uuid_generate(inode);
+	st.atime = now;
+	st.ctime = now;
+	st.mtime = now;
+	if (fs->inode64) {
+		// numbered by FS::allocate_inode when created, read otherwise
+		memset(inode, 0, sizeof(inode));
+	} else {
+		uuid_generate(inode);
+	}
 }
 
 std::string entry::stringify(const std::string & key)
@@ -41,11 +73,19 @@ std::string entry::stringify(const std::string & key)
 	return r;
 }
 
-dentry::dentry(const std::string & name, FS * fs): entry(name, fs)
+entry::~entry()
+{
+	fs->nodes --;
+}
+
+dentry::dentry(const std::string & name, FS * fs):
+	entry(name, fs),
+	loaded(true), // new and empty, decode resets it for stored ones
+	in_lru(false),
+	referenced(false)
 {
-	st.st_mode = S_IFDIR | 0755;
-	st.st_nlink = 2;
-	st.st_size = 4096;
+	st.mode = S_IFDIR | 0755;
+	st.size = 4096;
 	if (name.empty()) {
 		memset(inode, 0, sizeof(inode));
 	}
@@ -54,20 +94,73 @@ dentry::dentry(const std::string & name, FS * fs): entry(name, fs)
 
 fentry::fentry(const std::string & name, FS * fs): entry(name, fs)
 {
-	st.st_mode = S_IFREG | 0666;
+	st.mode = S_IFREG | 0666;
 	type = 'f';
 }
 
-symlink_entry::symlink_entry(const std::string & name, FS * fs): dentry(name, fs)
+symlink_entry::symlink_entry(const std::string & name, FS * fs): entry(name, fs)
 {
-	st.st_mode = S_IFLNK | 0666;
+	st.mode = S_IFLNK | 0666;
 	type = 's';
 }
 
+virtual_entry::virtual_entry(const std::string & name, FS * fs, const std::string & text):
+	entry(name, fs),
+	text(text)
+{
+	st.mode = S_IFREG | 0444;
+	st.size = text.size();
+	type = 'v';
+}
+
+int virtual_entry::read_buf(char * buf, off_t size, size_t offset)
+{
+	if (offset >= text.size()) {
+		return 0;
+	}
+	size_t n = std::min((size_t)size, text.size() - offset);
+	memcpy(buf, text.data() + offset, n);
+	return n;
+}
+
 bool entry::read()
 {
 	std::string value;
+	if (!read_value(value)) {
+		return false;
+	}
+	return decode(value);
+}
+
+bool entry::decode(const std::string & value)
+{
+	proto::entry e;
+	if (!e.ParseFromString(value)) {
+		BOOST_LOG(fs->lg) <<  "cannot parse proto " << name;
+		return false;
+	}
+
+	if (e.has_ctime()) {
+		st.ctime = e.ctime();
+	}
+	if (e.has_atime()) {
+		st.atime = e.atime();
+	}
+	if (e.has_mtime()) {
+		st.mtime = e.mtime();
+	}
+	if (e.has_size()) {
+		st.size = e.size();
+	}
+	if (e.has_ino()) {
+		ino = e.ino();
+	}
 
+	return read_proto(e);
+}
+
+bool entry::read_value(std::string & value)
+{
 	block_key key(type, inode);
 
 	if (!fs->read(key, value)) {
@@ -77,94 +170,286 @@ bool entry::read()
 		return false;
 	}
 
-	proto::entry e;
-
-	BOOST_LOG(lg) << "read dentry " << name;
+	LOG_DEBUG(fs->lg) << "read dentry " << name;
+	return true;
+}
 
+bool entry::read_record(proto::entry & e)
+{
+	std::string value;
+	if (!read_value(value)) {
+		return false;
+	}
 	if (!e.ParseFromString(value)) {
-		BOOST_LOG(lg) <<  "cannot parse proto " << name;
+		BOOST_LOG(fs->lg) <<  "cannot parse proto " << name;
 		return false;
 	}
+	return true;
+}
 
-	if (e.has_ctime()) {
-		st.st_ctime = e.ctime();
+bool dentry::decode(const std::string & value)
+{
+	dir_record r(value.data(), value.size());
+	if (!r.valid()) {
+		return entry::decode(value); // protobuf record
 	}
-	if (e.has_atime()) {
-		st.st_atime = e.atime();
+
+	const dir_header & h = r.head();
+	st.ctime = h.ctime;
+	st.atime = h.atime;
+	st.mtime = h.mtime;
+	st.size = h.size;
+
+	// children are read by load
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	entries.clear();
+	record.clear();
+	loaded = false;
+	return true;
+}
+
+bool dentry::read_proto(const proto::entry & e)
+{
+	// children are read by load
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	entries.clear();
+	loaded = false;
+	return true;
+}
+
+bool dentry::load()
+{
+	if (loaded) {
+		return true;
 	}
-	if (e.has_mtime()) {
-		st.st_mtime = e.mtime();
+
+	std::string value;
+	value.swap(record);
+	bool ok = !value.empty() || read_value(value);
+	if (ok) {
+		dir_record r(value.data(), value.size());
+		if (r.valid()) {
+			ok = read_children(r);
+		} else {
+			proto::entry e;
+			ok = e.ParseFromString(value) && read_children(e);
+		}
 	}
-	if (e.has_size()) {
-		st.st_size = e.size();
+	if (!ok) {
+		entries.clear();
+		return false;
 	}
+	loaded = true;
+	return true;
+}
 
+bool dentry::evict()
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	if ((!loaded && entries.empty() && record.empty()) || this == fs->root.get()) {
+		return false;
+	}
+
+	// only the table holds the children and no child has its own children,
+	// a directory looked up in place holds some without being loaded
+	for (entries_t::iterator it = entries.begin(); it != entries.end(); ++it) {
+		if (it->second->refs != 1) {
+			return false;
+		}
+		dentry * d = dynamic_cast<dentry*>(it->second.get());
+		if (!d) {
+			continue;
+		}
+		// parent before child; a busy child is not evicted this time
+		boost::unique_lock<boost::mutex> child_lock(d->mutex, boost::try_to_lock);
+		if (!child_lock.owns_lock() || d->loaded || !d->entries.empty()) {
+			return false;
+		}
+	}
+
+	entries.clear();
+	record.clear();
+	loaded = false;
+	return true;
+}
+
+dentry::~dentry()
+{
+	fs->forget(this);
+}
+
+entry_ptr dentry::make_child(uint32_t mode, const std::string & name,
+                             const unsigned char * ino, const std::string & target)
+{
+	entry * d = 0;
+	// S_IFLNK shares bits with S_IFREG
+	if (S_ISDIR(mode)) {
+		LOG_DEBUG(fs->lg) << "addin dir to " << name;
+		d = new dentry(name, fs);
+	} else if (S_ISREG(mode)) {
+		LOG_DEBUG(fs->lg) << "addin file to " << name;
+		d = new fentry(name, fs);
+	} else if (S_ISLNK(mode)) {
+		LOG_DEBUG(fs->lg) << "addin symlink to " << name;
+		symlink_entry * s = new symlink_entry(name, fs);
+		s->target_name = target;
+		d = s;
+	}
+
+	entry_ptr child(d);
+	if (d) {
+		memcpy(d->inode, ino, sizeof(d->inode));
+		if (child->read()) {
+			child->parent = this;
+			entries[child->name] = child;
+		} else {
+			// TODO: make broken entry
+			BOOST_LOG(fs->lg) << "cannot read " << name;
+			child.reset();
+		}
+	}
+	return child;
+}
+
+bool dentry::read_children(const proto::entry & e)
+{
 	for (int i = 0; i < e.children_size(); ++i) {
 		const proto::entry_child & c = e.children(i);
-		std::string name = c.name();
-		entry * d = 0;
-		if (c.mode() & S_IFDIR) {
-			BOOST_LOG(lg) <<  "addin dir to " << name;
-			d = new dentry(name, fs);
-		} else if (c.mode() & S_IFREG) {
-			BOOST_LOG(lg) << "addin file to " << name;
-			d = new fentry(name, fs);
-		} else if (c.mode() & S_IFLNK) {
-			BOOST_LOG(lg) << "addin symlink to " << name;
-			d = new symlink_entry(name, fs);
-			d->target_name = c.target_name();
-		}
-
-		if (d) {
-			std::string inode = c.ino();
-			memcpy(d->inode, inode.c_str(), sizeof(d->inode)); //TODO: ugly
-			boost::shared_ptr<entry> child(d);
-			if (child->read()) {
-				child->parent = shared_from_this();
-				entries[name] = child;
-				//fprintf(l, "adding object to '%s' -> %s %lu\n",
-				//        this->name.c_str(),
-				//        stringify(d->key()).c_str(),
-				//        d->st.st_size);
-			} else {
-				// TODO: error
-				// TODO: make broken entry
-				BOOST_LOG(lg) << "cannot read " << name;
-				return false;
+		name_t n = name_t::find(c.name());
+		if (!n.empty() && entries.find(n) != entries.end()) {
+			continue;
+		}
+		std::string inode = c.ino();
+		if (inode.size() != sizeof(uuid_t)) {
+			return false;
+		}
+		if ((S_ISDIR(c.mode()) || S_ISREG(c.mode()) || S_ISLNK(c.mode()))
+		    && !make_child(c.mode(), c.name(), (const unsigned char *)inode.data(),
+		                   c.target_name()))
+		{
+			return false; // TODO: error
+		}
+	}
+
+	return true;
+}
+
+bool dentry::read_children(const dir_record & r)
+{
+	for (uint32_t i = 0; i < r.count(); ++i) {
+		dir_record::child c = r.at(i);
+		if (!c.name) {
+			return false;
+		}
+		std::string name(c.name, c.name_len);
+		name_t n = name_t::find(name);
+		if (!n.empty() && entries.find(n) != entries.end()) {
+			continue;
+		}
+		if ((S_ISDIR(c.mode) || S_ISREG(c.mode) || S_ISLNK(c.mode))
+		    && !make_child(c.mode, name, c.ino, std::string(c.target, c.target_len)))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool dentry::add_stored(const std::string & name, entry_ptr & r)
+{
+	// one read for all names looked up before the directory is loaded
+	if (record.empty() && !read_value(record)) {
+		return false;
+	}
+	dir_record rec(record.data(), record.size());
+	if (!rec.valid()) {
+		record.clear();
+		return false;
+	}
+
+	int i = rec.find(name.data(), name.size());
+	if (i >= 0) {
+		dir_record::child c = rec.at(i);
+		r = make_child(c.mode, name, c.ino, std::string(c.target, c.target_len));
+	}
+	return true;
+}
+
+bool dentry::write(batch_t & batch)
+{
+	if (!fs->flat_dirs) {
+		return entry::write(batch);
+	}
+
+	time_t now = time(0);
+
+	st.mtime = now;
+	st.atime = now;
+
+	dir_header h;
+	dir_record::init(h);
+	h.mode = st.mode;
+	h.uid = st.uid;
+	h.gid = st.gid;
+	h.size = st.size;
+	h.atime = st.atime;
+	h.mtime = st.mtime;
+	h.ctime = st.ctime;
+
+	std::string value;
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(mutex);
+		// a partial list would drop the children that were not read
+		if (!load()) {
+			BOOST_LOG(fs->lg) << "cannot read children of " << name << ", not written";
+			return false;
+		}
+		std::vector<dir_record::child> children;
+		children.reserve(entries.size());
+		for (entries_t::iterator it = entries.begin(); it != entries.end(); ++it) {
+			entry * e = it->second.get();
+			dir_record::child c;
+			memset(&c, 0, sizeof(c));
+			c.name = e->name.c_str();
+			c.name_len = e->name.size();
+			c.ino = e->inode;
+			c.mode = e->st.mode;
+			if (e->type == 's') {
+				const std::string & t = static_cast<symlink_entry*>(e)->target_name;
+				c.target = t.data();
+				c.target_len = t.size();
 			}
+			children.push_back(c);
 		}
+		dir_record::encode(value, h, children);
 	}
 
+	block_key key(type, inode);
+	batch.push_back(operation(key, operation::PUT, value));
 	return true;
 }
 
-void entry::write(batch_t & batch)
+bool entry::write(batch_t & batch)
 {
 	std::string value;
 
 	time_t now = time(0);
 
-	st.st_mtime = now;
-	st.st_atime = now;
+	st.mtime = now;
+	st.atime = now;
 	
 	proto::entry e;
-	e.set_mode(st.st_mode);
-	e.set_mtime(st.st_mtime);
-	e.set_ctime(st.st_ctime);
-	e.set_size(st.st_size);
-
-	for (entries_t::iterator it = entries.begin(); it != entries.end(); ++it) {
-		proto::entry_child * c = e.add_children();
-		c->set_mode(it->second->st.st_mode);
-		c->set_ino(it->second->inode, sizeof(it->second->inode));
-		c->set_name(it->second->name);
-		if (it->second->type == 's') {
-			c->set_target_name(it->second->target_name);
-		}
+	e.set_mode(st.mode);
+	e.set_mtime(st.mtime);
+	e.set_ctime(st.ctime);
+	e.set_size(st.size);
+	if (ino) {
+		e.set_ino(ino);
+	}
 
-//		fprintf(l, "adding to entry '%s' -> %u,  %s \n",
-//		        name.c_str(), it->second->st.st_mode,
-//		        stringify(it->second->key()).c_str());
+	if (!write_proto(e)) {
+		return false;
 	}
 
 	e.SerializeToString(&value); // TODO: check error
@@ -175,57 +460,162 @@ void entry::write(batch_t & batch)
 //	        name.c_str(), key.tostring().c_str());
 	
 	batch.push_back(operation(key, operation::PUT, value));
+	return true;
+}
+
+bool dentry::write_proto(proto::entry & e)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	// a partial list would drop the children that were not read
+	if (!load()) {
+		BOOST_LOG(fs->lg) << "cannot read children of " << name << ", not written";
+		return false;
+	}
+	for (entries_t::iterator it = entries.begin(); it != entries.end(); ++it) {
+		proto::entry_child * c = e.add_children();
+		c->set_mode(it->second->st.mode);
+		c->set_ino(it->second->inode, sizeof(it->second->inode));
+		c->set_name(it->second->name.c_str(), it->second->name.size());
+		if (it->second->type == 's') {
+			c->set_target_name(static_cast<symlink_entry*>(it->second.get())->target_name);
+		}
+
+//		fprintf(l, "adding to entry '%s' -> %u,  %s \n",
+//		        name.c_str(), it->second->st.st_mode,
+//		        stringify(it->second->key()).c_str());
+	}
+	return true;
 }
 
-boost::shared_ptr<entry> entry::find(const std::string & path)
+entry_ptr entry::find(const std::string & path)
 {
-	BOOST_LOG_SEV(lg, debug) << "find  " << path << " in " << name;
-	if (name == path) {
-		return shared_from_this();
+	LOG_DEBUG(fs->lg) << "find  " << path << " in " << name;
+	if (path.empty()) {
+		return entry_ptr(this);
 	}
 
+	// the last component is always a child, "a/a" is not "a"
 	size_t pos = path.find("/");
-	std::string subname = path.substr(0, pos);
+	entry_ptr e = child(path.substr(0, pos));
+	if (!e || pos == std::string::npos) {
+		return e;
+	}
+	return e->find(path.substr(pos+1));
+}
 
-	boost::shared_ptr<entry> e;
+entry_ptr dentry::child(const std::string & name)
+{
+	entry_ptr r;
 	{
 		boost::unique_lock<boost::mutex> scoped_lock(mutex);
-		entries_t::iterator it = entries.find(subname);
-		if (it == entries.end()) {
-			return boost::shared_ptr<entry>();
+		// a name nobody holds cannot be a child
+		name_t n = name_t::find(name);
+		entries_t::iterator it = (n.empty()) ? entries.end() : entries.find(n);
+		if (it != entries.end()) {
+			r = it->second;
+		} else if (!loaded && !add_stored(name, r)) {
+			// protobuf records are read whole
+			if (!load()) {
+				return r;
+			}
+			n = name_t::find(name);
+			it = (n.empty()) ? entries.end() : entries.find(n);
+			if (it != entries.end()) {
+				r = it->second;
+			}
 		}
-		e = it->second;		
 	}
-	return e->find(path.substr(pos+1));
+
+	fs->touch(this);
+	return r;
 }
 
-void entry::add_child(const boost::shared_ptr<entry> & e)
+bool dentry::add_child(const entry_ptr & e)
 {
 	boost::unique_lock<boost::mutex> scoped_lock(mutex);
-	e->parent = shared_from_this();
+	if (!load()) {
+		return false;
+	}
+	e->parent = this;
 	entries[e->name] = e;
+	return true;
 }
 
-void entry::remove_child(const std::string & name)
+bool dentry::remove_child(const std::string & name)
 {
 	boost::unique_lock<boost::mutex> scoped_lock(mutex);
-	entries.erase(name);
+	if (!load()) {
+		return false;
+	}
+	name_t n = name_t::find(name);
+	entries_t::iterator it = entries.find(n);
+	if (it != entries.end()) {
+		it->second->parent = 0;
+		entries.erase(it);
+	}
+	return true;
+}
+
+bool dentry::remove_child(const entry_ptr & e)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	if (!load()) {
+		return false;
+	}
+	entries_t::iterator it = entries.find(e->name);
+	if (it != entries.end() && it->second == e) {
+		e->parent = 0;
+		entries.erase(it);
+	}
+	return true;
+}
+
+bool dentry::empty(bool & r)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	if (!load()) {
+		return false;
+	}
+	r = entries.empty();
+	return true;
 }
 
-void entry::remove_child(const boost::shared_ptr<entry> & e)
+bool dentry::readable()
 {
 	boost::unique_lock<boost::mutex> scoped_lock(mutex);
-	entries.erase(e->name);
+	return load();
+}
+
+void dentry::list(listing_t & names)
+{
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(mutex);
+		load();
+		names.reserve(entries.size());
+		for (entries_t::iterator it = entries.begin(); it != entries.end(); ++it) {
+			names.push_back(it->first);
+		}
+	}
+	std::sort(names.begin(), names.end(), name_less());
 }
 
 void entry::fillstat(struct stat * s)
 {
-	memcpy(s, &st, sizeof(st));
+	memset(s, 0, sizeof(*s));
+	s->st_mode = st.mode;
+	s->st_nlink = (S_ISDIR(st.mode)) ? 2 : 1;
+	s->st_uid = st.uid;
+	s->st_gid = st.gid;
+	s->st_size = st.size;
+	s->st_atime = st.atime;
+	s->st_mtime = st.mtime;
+	s->st_ctime = st.ctime;
+	s->st_blksize = 4096; // fixme
 	s->st_blocks = (s->st_size + 511) / 512;
-	memcpy(&s->st_ino, inode, sizeof(s->st_ino)); 
+	s->st_ino = fs->inode_number(this);
 }
 
-void dentry::remove(batch_t & batch)
+void entry::remove(batch_t & batch)
 {
 	block_key key(type, inode);
 	batch.push_back(operation(key, operation::DELETE, std::string()));
@@ -8,19 +8,34 @@
 
 #include <string>
 #include <uuid/uuid.h>
-#include <boost/shared_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
 #include <boost/unordered_map.hpp>
-#include <boost/enable_shared_from_this.hpp>
+#include <boost/atomic.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/log/common.hpp>
 
 #include <list>
 
+#include <map>
+
+#include "names.h"
+#include "dirrecord.h"
+
+namespace proto {
+class entry;
+}
+
 struct dentry;
 struct entry;
 struct FS;
 
-typedef boost::unordered_map<std::string, boost::shared_ptr<entry> > entries_t;
+void intrusive_ptr_add_ref(entry * e);
+void intrusive_ptr_release(entry * e);
+
+typedef boost::intrusive_ptr<entry> entry_ptr;
+typedef boost::unordered_map<name_t, entry_ptr> entries_t; // interned, by pointer
+typedef std::map<int, int> extents_t; // start block -> blocks
+typedef std::vector<name_t> listing_t;
 
 #pragma pack (push, 1)
 struct block_key
@@ -39,6 +54,47 @@ struct block_key
 		}
 	}
 
+	// on-disk key. compact keys (inode64 filesystems) keep only the
+	// 8 significant inode bytes, superblock and dedup digests stay full
+	int encode(char * buf, bool compact) const {
+		if (!compact || type == 'm' || type == 'h' || type == 'r') {
+			memcpy(buf, this, size());
+			return size();
+		}
+		int n = 0;
+		buf[n++] = type;
+		memcpy(buf + n, inode, sizeof(uint64_t));
+		n += sizeof(uint64_t);
+		if (!meta) {
+			memcpy(buf + n, &blockno, sizeof(blockno));
+			n += sizeof(blockno);
+		}
+		return n;
+	}
+
+	// inverse of encode, false for keys of other layouts
+	bool decode(const char * buf, size_t len, bool compact) {
+		if (len == 0) {
+			return false;
+		}
+		type = buf[0];
+		size_t ino = (!compact || type == 'm' || type == 'h' || type == 'r')
+			? sizeof(inode) : sizeof(uint64_t);
+		memset(inode, 0, sizeof(inode));
+		blockno = 0;
+		if (len == 1 + ino) {
+			meta = true;
+			blockno = -1;
+		} else if (len == 1 + ino + sizeof(blockno)) {
+			meta = false;
+			memcpy(&blockno, buf + 1 + ino, sizeof(blockno));
+		} else {
+			return false;
+		}
+		memcpy(inode, buf + 1, ino);
+		return true;
+	}
+
 	std::string tostring() const {
 		std::string r;
 		r += type;
@@ -103,7 +159,9 @@ struct operation
 {
 	enum {
 		PUT = 0,
-		DELETE = 1
+		DELETE = 1,
+		ADDREF = 2, // dedup refcount, resolved by bucket::add_op
+		DECREF = 3
 	};
 
 	block_key key;
@@ -118,27 +176,57 @@ struct operation
 
 typedef std::vector<operation> batch_t;
 
-struct entry: public boost::enable_shared_from_this<entry> {
-	FS * fs;
-	boost::log::sources::severity_logger< >& lg;
+// data block value tags, used with adaptive compression, dedup or vlog
+enum {
+	BLOCK_RAW = 0,
+	BLOCK_SNAPPY = 1,
+	BLOCK_REF = 2, // home part (4 bytes) + digest (16 bytes) of a 'h' record
+	BLOCK_VLOG = 3 // vlog::pointer
+};
 
-	boost::mutex mutex;
-	struct stat st;
+// inode attributes, struct stat is filled on demand
+struct attrs
+{
+	uint64_t size;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t atime; // seconds, enough until 2106
+	uint32_t mtime;
+	uint32_t ctime;
+};
+
+// in-memory node. kept small for million-file trees: intrusive refcount,
+// raw parent pointer, interned name, packed attributes, slab allocated;
+// children only in dentry
+struct entry {
+	FS * fs;
+	entry * parent; // set while linked, the parent holds a reference to us
+	boost::atomic<int> refs;
+	char type;
 
 	// -> TODO: to separate struct (for hardlinks)
 	uuid_t inode;
-	char type;
-	std::string name;
-	std::string target_name; // for symlink
-	entries_t entries;
-	boost::shared_ptr<entry> parent;
+	uint64_t ino; // st_ino of uuid filesystems, 0: none stored, see FS::inode_number
+	name_t name;
+	attrs st;
+
+	boost::mutex mutex;
 
 	entry(const std::string & name, FS * fs);
-	virtual ~entry() {}
-	virtual bool read();
-	virtual void write(batch_t & batch);
+	virtual ~entry();
+	bool read();
+	bool read_value(std::string & value);
+	bool read_record(proto::entry & e);
+	// stored record -> attributes and type specific fields
+	virtual bool decode(const std::string & value);
+	// false and nothing in batch when the record cannot be made whole
+	virtual bool write(batch_t & batch);
 
-	boost::shared_ptr<entry> find(const std::string & path);
+	static void * operator new(size_t size);
+	static void operator delete(void * p, size_t size);
+
+	entry_ptr find(const std::string & path);
 
 	virtual void fillstat(struct stat * s);
 	virtual int write_buf(batch_t & batch,
@@ -154,17 +242,23 @@ struct entry: public boost::enable_shared_from_this<entry> {
 		return 0;
 	}
 
-	virtual void remove(batch_t & batch) {}
-	virtual void truncate(batch_t & batch, size_t new_size) {}
+	virtual void remove(batch_t & batch);
+	virtual bool truncate(batch_t & batch, size_t new_size) { return true; }
+
+	// type specific fields of the inode record
+	virtual bool write_proto(proto::entry & e) { return true; }
+	virtual bool read_proto(const proto::entry & e) { return true; }
 
-	void add_child(const boost::shared_ptr<entry> & e);
-	void remove_child(const std::string & name);
-	void remove_child(const boost::shared_ptr<entry> & e);
+	// directories only, other entries have no children to change
+	virtual entry_ptr child(const std::string & name) { return entry_ptr(); }
+	virtual bool add_child(const entry_ptr & e) { return false; }
+	virtual bool remove_child(const std::string & name) { return false; }
+	virtual bool remove_child(const entry_ptr & e) { return false; }
 
 	static std::string stringify(const std::string & key);
 
 	std::string tostring() {
-		std::string r = name + ";";
+		std::string r = name.str() + ";";
 		char buf[1024];
 		uuid_unparse(inode, buf);
 		r += buf;
@@ -173,26 +267,117 @@ struct entry: public boost::enable_shared_from_this<entry> {
 };
 
 struct fentry: public entry {
+	// large sequential writes, 'x' keys; guarded by mutex
+	extents_t extents;
+	// blocks of extents demoted by the running write or truncate, their
+	// puts are still in its batch where read_block cannot see them
+	std::map<int, std::string> demoted;
+
 	fentry(const std::string & name, FS * fs);
 	
 	int write_buf(batch_t & batch,
 	              const char * buf,
 	              off_t size,
 	              size_t offset);
+	int write_blocks(batch_t & batch,
+	                 const char * buf,
+	                 off_t size,
+	                 size_t offset);
+	int write_extents(batch_t & batch, const char * buf, int first, int count);
 
 	int read_buf(char * buf,
 	             off_t size, size_t offset);
 
 	void remove(batch_t & batch);
-	void truncate(batch_t & batch, size_t new_size);
+	bool truncate(batch_t & batch, size_t new_size);
 	void grow(batch_t & batch, size_t new_size);
+
+	// data block codec, values are tagged when fs compresses or dedups
+	void put_block(batch_t & batch, const block_key & key,
+	               const char * buf, size_t size);
+	bool get_block(const block_key & key, std::string & value);
+
+	std::string encode_block(const char * buf, size_t size, bool compress);
+	bool decode_block(const block_key & key, std::string & value);
+	std::string place_block(const block_key & key, const std::string & value);
+	bool put_ref(batch_t & batch, const block_key & key,
+	             const char * buf, size_t size);
+	void release_block(batch_t & batch, const block_key & key);
+	void release_block(batch_t & batch, const block_key & key,
+	                   const std::string & old);
+
+	// extents, callers hold mutex
+	extents_t::iterator find_extent(int block);
+	void drop_extent(batch_t & batch, int start);
+	// false and the extent kept when it cannot be read
+	bool demote_extent(batch_t & batch, int start, int skip_first, int skip_end);
+	bool split_extent(batch_t & batch, int block);
+	bool read_block(int block, std::string & value);
+
+	bool write_proto(proto::entry & e);
+	bool read_proto(const proto::entry & e);
+	std::string extent_stats();
 };
 
 struct dentry: public entry {
+	// children are read on first use and dropped again by FS::shrink,
+	// guarded by mutex
+	entries_t entries;
+	bool loaded;
+	// stored dir_record of an unloaded directory, kept by add_stored
+	// for the next names until load or evict
+	std::string record;
+
+	// FS::lru position, guarded by FS::lru_mutex; in_lru is also read
+	// without it by FS::touch
+	boost::atomic<bool> in_lru;
+	std::list<dentry*>::iterator lru_pos;
+	// looked up since FS::shrink passed it, set without any lock
+	boost::atomic<bool> referenced;
+
 	dentry(const std::string & name, FS * fs);
-	void remove(batch_t & batch);
+	~dentry();
+
+	bool load(); // callers hold mutex
+	bool evict();
+
+	bool decode(const std::string & value);
+	bool write(batch_t & batch);
+
+	entry_ptr child(const std::string & name);
+	// false when the children cannot be read, nothing changes then
+	bool add_child(const entry_ptr & e);
+	bool remove_child(const std::string & name);
+	bool remove_child(const entry_ptr & e);
+	bool empty(bool & r);
+	bool readable();
+	// sorted snapshot of the children names
+	void list(listing_t & names);
+
+	bool write_proto(proto::entry & e);
+	bool read_proto(const proto::entry & e);
+
+	// callers hold mutex. children already in the table are kept
+	bool read_children(const proto::entry & e);
+	bool read_children(const dir_record & r);
+	entry_ptr make_child(uint32_t mode, const std::string & name,
+	                     const unsigned char * ino, const std::string & target);
+	bool add_stored(const std::string & name, entry_ptr & r);
 };
 
-struct symlink_entry: public dentry {	
+struct symlink_entry: public entry {	
+	std::string target_name;
+
 	symlink_entry(const std::string & name, FS * fs);
 };
+
+// read-only generated file, not stored ('v')
+struct virtual_entry: public entry {
+	std::string text;
+
+	virtual_entry(const std::string & name, FS * fs, const std::string & text);
+
+	int read_buf(char * buf, off_t size, size_t offset);
+	bool write(batch_t & batch) { return true; }
+	void remove(batch_t & batch) {}
+};
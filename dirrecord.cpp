@@ -0,0 +1,124 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "dirrecord.h"
+
+static const char magic[4] = {'L', 'D', 'R', 1};
+
+static int compare(const char * a, size_t alen, const char * b, size_t blen)
+{
+	int r = memcmp(a, b, std::min(alen, blen));
+	if (r == 0) {
+		r = (alen < blen) ? -1 : (alen > blen);
+	}
+	return r;
+}
+
+struct child_less
+{
+	bool operator()(const dir_record::child & a, const dir_record::child & b) const {
+		return compare(a.name, a.name_len, b.name, b.name_len) < 0;
+	}
+};
+
+dir_record::dir_record(const char * data, size_t size):
+	header(0), slots(0), blob(0), blob_size(0)
+{
+	if (size < sizeof(dir_header) || memcmp(data, magic, sizeof(magic)) != 0) {
+		return;
+	}
+	const dir_header * h = (const dir_header *)data;
+	size_t table = sizeof(dir_header) + (size_t)h->count * sizeof(dir_slot);
+	if (size < table) {
+		return;
+	}
+	header = h;
+	slots = (const dir_slot *)(data + sizeof(dir_header));
+	blob = data + table;
+	blob_size = size - table;
+}
+
+dir_record::child dir_record::at(uint32_t i) const
+{
+	child c;
+	memset(&c, 0, sizeof(c));
+	const dir_slot & s = slots[i];
+	if ((size_t)s.name_off + s.name_len + s.target_len > blob_size) {
+		return c;
+	}
+	c.name = blob + s.name_off;
+	c.name_len = s.name_len;
+	c.ino = s.ino;
+	c.mode = s.mode;
+	c.target = c.name + s.name_len;
+	c.target_len = s.target_len;
+	return c;
+}
+
+int dir_record::find(const char * name, size_t len) const
+{
+	int lo = 0, hi = (int)count() - 1;
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		child c = at(mid);
+		if (!c.name) {
+			return -1;
+		}
+		int r = compare(c.name, c.name_len, name, len);
+		if (r == 0) {
+			return mid;
+		} else if (r < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return -1;
+}
+
+void dir_record::init(dir_header & head)
+{
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, magic, sizeof(magic));
+}
+
+void dir_record::encode(std::string & out, const dir_header & head,
+                        std::vector<child> & children)
+{
+	std::sort(children.begin(), children.end(), child_less());
+
+	size_t blob = 0;
+	for (size_t i = 0; i < children.size(); ++i) {
+		blob += children[i].name_len + children[i].target_len;
+	}
+
+	size_t table = sizeof(dir_header) + children.size() * sizeof(dir_slot);
+	out.resize(table + blob);
+	char * p = &out[0];
+
+	dir_header h = head;
+	h.count = children.size();
+	memcpy(p, &h, sizeof(h));
+
+	dir_slot * slots = (dir_slot *)(p + sizeof(dir_header));
+	char * names = p + table;
+	uint32_t off = 0;
+	for (size_t i = 0; i < children.size(); ++i) {
+		const child & c = children[i];
+		dir_slot s;
+		memcpy(s.ino, c.ino, sizeof(s.ino));
+		s.mode = c.mode;
+		s.name_off = off;
+		s.name_len = c.name_len;
+		s.target_len = c.target_len;
+		memcpy(&slots[i], &s, sizeof(s));
+
+		memcpy(names + off, c.name, c.name_len);
+		off += c.name_len;
+		if (c.target_len) {
+			memcpy(names + off, c.target, c.target_len);
+			off += c.target_len;
+		}
+	}
+}
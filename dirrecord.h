@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+// fixed layout directory record ('d' key with fsmeta::flat_dirs):
+//
+//   dir_header | dir_slot[count], sorted by name | names and symlink targets
+//
+// read in place, a name is found by binary search over the slots without
+// decoding the others. the magic cannot start a protobuf message, both
+// layouts live in one filesystem
+#pragma pack (push, 1)
+struct dir_header
+{
+	char magic[4];
+	uint32_t count;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	uint64_t atime;
+	uint64_t mtime;
+	uint64_t ctime;
+};
+
+struct dir_slot
+{
+	unsigned char ino[16];
+	uint32_t mode;
+	uint32_t name_off; // from the start of the blob, the target follows the name
+	uint16_t name_len;
+	uint16_t target_len;
+};
+#pragma pack (pop)
+
+class dir_record
+{
+public:
+	struct child
+	{
+		const char * name; // 0: broken slot
+		size_t name_len;
+		const unsigned char * ino;
+		uint32_t mode;
+		const char * target;
+		size_t target_len;
+	};
+
+	// does not copy, data must outlive the record
+	dir_record(const char * data, size_t size);
+
+	bool valid() const { return header != 0; }
+	const dir_header & head() const { return *header; }
+	uint32_t count() const { return header->count; }
+	child at(uint32_t i) const;
+	int find(const char * name, size_t len) const; // slot or -1
+
+	// sorts children
+	static void encode(std::string & out, const dir_header & head,
+	                   std::vector<child> & children);
+	static void init(dir_header & head);
+
+private:
+	const dir_header * header;
+	const dir_slot * slots;
+	const char * blob;
+	size_t blob_size;
+};
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "fs.h"
+#include "pool.h"
+#include "timing.h"
+
+// memory per in-memory entry: builds a tree of files without leveldb
+// and reports resident memory growth per entry
+//
+// usage: test-entries [entries] [files per dir]
+
+static size_t rss()
+{
+	long pages = 0, resident = 0;
+	FILE * f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char ** argv)
+{
+	size_t count = (argc > 1) ? atol(argv[1]) : 10000000;
+	size_t per_dir = (argc > 2) ? atol(argv[2]) : 1000;
+
+	boost::log::core::get()->set_logging_enabled(false);
+
+	FS fs("/nonexistent");
+	fs.root.reset(new dentry("", &fs));
+
+	printf("sizeof entry %d, dentry %d, fentry %d\n",
+	       (int)sizeof(entry), (int)sizeof(dentry), (int)sizeof(fentry));
+
+	size_t before = rss();
+	uint64_t t1 = now_ns();
+
+	entry_ptr dir;
+	char name[64];
+	for (size_t i = 0; i < count; ++i) {
+		if (i % per_dir == 0) {
+			snprintf(name, sizeof(name), "dir%08lu", (unsigned long)(i / per_dir));
+			dir.reset(new dentry(name, &fs));
+			fs.root->add_child(dir);
+		}
+		// names repeat across directories as in real trees
+		snprintf(name, sizeof(name), "file%06lu.c", (unsigned long)(i % per_dir));
+		entry_ptr f(new fentry(name, &fs));
+		dir->add_child(f);
+	}
+
+	uint64_t t2 = now_ns();
+	size_t after = rss();
+
+	size_t found = 0;
+	for (size_t i = 0; i < count; i += 97) {
+		char path[128];
+		snprintf(path, sizeof(path), "dir%08lu/file%06lu.c",
+		         (unsigned long)(i / per_dir), (unsigned long)(i % per_dir));
+		found += (fs.find(path)) ? 1 : 0;
+	}
+	uint64_t t3 = now_ns();
+
+	printf("entries %lu, per dir %lu\n", (unsigned long)count, (unsigned long)per_dir);
+	printf("rss growth %.1f MB, %.1f bytes per entry\n",
+	       (after - before) / 1024.0 / 1024.0, (double)(after - before) / count);
+	printf("node slabs %.1f MB, names %lu, %.1f MB\n",
+	       node_pool_bytes() / 1024.0 / 1024.0,
+	       (unsigned long)name_t::count(), name_t::bytes() / 1024.0 / 1024.0);
+	printf("build %.2f s, lookups %lu in %.2f s\n",
+	       (t2 - t1) / 1e9, (unsigned long)found, (t3 - t2) / 1e9);
+
+	return 0;
+}
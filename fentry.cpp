@@ -1,18 +1,457 @@
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+#include <time.h>
 #include <arpa/inet.h>
 
+#include <snappy.h>
+
 #include "leveldb/db.h"
 #include "leveldb/write_batch.h"
 
+#include "messages.pb.h"
+
 #include "dentry.h"
 #include "fs.h"
+#include "hash.h"
+#include "timing.h"
+
+static const size_t ref_size = 1 + 4 + 16;
+
+// bits per byte above which a block is considered already compressed
+static const double entropy_limit = 7.5;
+
+// shorter runs of whole blocks are not worth an extent
+static const size_t extent_min_blocks = 4;
+
+static double sample_entropy(const char * buf, size_t size)
+{
+	// 16 evenly spaced 256-byte chunks are enough to spot media/archives
+	const size_t chunk = 256;
+	const size_t chunks = 16;
+	size_t hist[256] = {0};
+	size_t total = 0;
+
+	size_t step = (size > chunk * chunks) ? size / chunks : chunk;
+	for (size_t off = 0; off < size && total < chunk * chunks; off += step) {
+		size_t n = std::min(chunk, size - off);
+		const unsigned char * p = (const unsigned char *)buf + off;
+		for (size_t i = 0; i < n; ++i) {
+			hist[p[i]] ++;
+		}
+		total += n;
+	}
+
+	double e = 0;
+	for (int i = 0; i < 256; ++i) {
+		if (hist[i]) {
+			double p = (double)hist[i] / total;
+			e -= p * log2(p);
+		}
+	}
+	return e;
+}
+
+std::string fentry::encode_block(const char * buf, size_t size, bool compress)
+{
+	if (!fs->tagged_blocks()) {
+		return std::string(buf, size);
+	}
+
+	std::string value;
+	if (compress && fs->data_compression == proto::fsmeta::ADAPTIVE &&
+	    size > 0 && sample_entropy(buf, size) < entropy_limit)
+	{
+		value.resize(1 + snappy::MaxCompressedLength(size));
+		size_t compressed;
+		snappy::RawCompress(buf, size, &value[1], &compressed);
+		// same rule as leveldb: keep only if it saves at least 1/8
+		if (compressed < size - size / 8) {
+			value[0] = BLOCK_SNAPPY;
+			value.resize(1 + compressed);
+			return value;
+		}
+	}
+
+	value.resize(1);
+	value[0] = BLOCK_RAW;
+	value.append(buf, size);
+	return value;
+}
+
+bool fentry::decode_block(const block_key & key, std::string & value)
+{
+	if (!fs->tagged_blocks() || value.empty()) {
+		return true;
+	}
+
+	switch (value[0]) {
+	case BLOCK_RAW:
+		value.erase(0, 1);
+		return true;
+	case BLOCK_SNAPPY: {
+		std::string raw;
+		if (!snappy::Uncompress(value.data() + 1, value.size() - 1, &raw)) {
+			BOOST_LOG(fs->lg) << "cannot uncompress block " << key.tostring();
+			value.clear();
+			return false;
+		}
+		value.swap(raw);
+		return true;
+	}
+	case BLOCK_VLOG: {
+		// payload in the log is an encoded block itself
+		vlog::pointer ptr;
+		if (!fs->vlogs || !vlog::decode(value, ptr) ||
+		    !fs->vlogs[fs->part(key) - 1].read(ptr, value))
+		{
+			BOOST_LOG(fs->lg) << "cannot read vlog block " << key.tostring();
+			value.clear();
+			return false;
+		}
+		return decode_block(key, value);
+	}
+	default:
+		BOOST_LOG(fs->lg) << "unknown block tag " << (int)value[0] << " " << key.tostring();
+		value.clear();
+		return false;
+	}
+}
+
+std::string fentry::place_block(const block_key & key, const std::string & value)
+{
+	if (fs->vlog_min_size == 0 || value.size() < fs->vlog_min_size) {
+		return value;
+	}
+
+	vlog::pointer ptr;
+	if (!fs->vlogs[fs->part(key) - 1].append(key, value, ptr)) {
+		BOOST_LOG(fs->lg) << "cannot append to vlog, storing inline " << key.tostring();
+		return value;
+	}
+	return vlog::encode(ptr);
+}
+
+static bool is_ref(const std::string & value)
+{
+	return value.size() == ref_size && value[0] == BLOCK_REF;
+}
+
+static block_key ref_key(char type, const std::string & value)
+{
+	block_key key(type, (unsigned char*)value.data() + 5, 0);
+	memcpy(&key.blockno, value.data() + 1, sizeof(key.blockno));
+	return key;
+}
+
+bool fentry::put_ref(batch_t & batch, const block_key & key,
+                     const char * buf, size_t size)
+{
+	unsigned char digest[16];
+
+	uint64_t t1 = now_ns();
+	hash128(buf, size, digest);
+	fs->hash_bytes += size;
+	fs->hash_ns += now_ns() - t1;
+
+	// dedup domain is the part of this inode
+	block_key ref('r', digest, 0);
+	ref.setblock(fs->part(key) - 1);
+
+	block_key data(ref);
+	data.type = 'h';
+
+	std::string value;
+	bool exists = fs->read(data, value);
+	if (exists) {
+		// the hash is not cryptographic, never trust it alone
+		if (!decode_block(data, value) || value.size() != size ||
+		    memcmp(value.data(), buf, size) != 0)
+		{
+			BOOST_LOG(fs->lg) << "hash collision, storing inline " << key.tostring();
+			return false;
+		}
+	}
+
+	fs->dedup_logical += size;
+
+	// bucket stores the block only if the last reference went away meanwhile,
+	// there is no point to compress or log it for that case
+	std::string stored = (exists)
+		? encode_block(buf, size, false)
+		: place_block(data, encode_block(buf, size, true));
+	batch.push_back(operation(ref, operation::ADDREF, stored));
+
+	std::string mapping(1, (char)BLOCK_REF);
+	mapping.append((char*)&ref.blockno, sizeof(ref.blockno));
+	mapping.append((char*)digest, sizeof(digest));
+	batch.push_back(operation(key, operation::PUT, mapping));
+	return true;
+}
+
+void fentry::release_block(batch_t & batch, const block_key & key,
+                           const std::string & old)
+{
+	vlog::pointer ptr;
+	if (is_ref(old)) {
+		batch.push_back(operation(ref_key('r', old), operation::DECREF, std::string()));
+	} else if (fs->vlogs && vlog::decode(old, ptr)) {
+		// only a gc hint, gc checks liveness itself
+		fs->vlogs[fs->part(key) - 1].discard(ptr);
+	}
+}
+
+void fentry::release_block(batch_t & batch, const block_key & key)
+{
+	std::string old;
+	if (fs->read(key, old)) {
+		release_block(batch, key, old);
+	}
+}
+
+void fentry::put_block(batch_t & batch, const block_key & key,
+                       const char * buf, size_t size)
+{
+	// old value is released after the new one is in place,
+	// rewriting the same content never drops a dedup block
+	std::string old;
+	bool had_old = (fs->dedup || fs->vlogs) && fs->read(key, old);
+
+	if (!fs->dedup || !put_ref(batch, key, buf, size)) {
+		batch.push_back(operation(key, operation::PUT,
+		                          place_block(key, encode_block(buf, size, true))));
+	}
+
+	if (had_old) {
+		release_block(batch, key, old);
+	}
+}
+
+bool fentry::get_block(const block_key & key, std::string & value)
+{
+	// second attempt covers a vlog segment collected under our feet
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		if (!fs->read(key, value)) {
+			return false;
+		}
+
+		if (fs->dedup && is_ref(value)) {
+			block_key data = ref_key('h', value);
+			if (!fs->read(data, value)) {
+				BOOST_LOG(fs->lg) << "missing dedup block for " << key.tostring();
+				return false;
+			}
+			if (decode_block(data, value)) {
+				return true;
+			}
+		} else if (decode_block(key, value)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+extents_t::iterator fentry::find_extent(int block)
+{
+	extents_t::iterator it = extents.upper_bound(block);
+	if (it == extents.begin()) {
+		return extents.end();
+	}
+	--it;
+	return (block < it->first + it->second) ? it : extents.end();
+}
+
+void fentry::drop_extent(batch_t & batch, int start)
+{
+	block_key key('x', inode, 0);
+	key.setblock(start);
+
+	if (fs->vlogs) {
+		release_block(batch, key);
+	}
+	batch.push_back(operation(key, operation::DELETE, std::string()));
+	extents.erase(start);
+}
+
+bool fentry::demote_extent(batch_t & batch, int start, int skip_first, int skip_end)
+{
+	int blocksize = fs->blocksize;
+	int count = extents[start];
+
+	block_key xkey('x', inode, 0);
+	xkey.setblock(start);
+
+	std::string value;
+	if (!get_block(xkey, value)) {
+		BOOST_LOG(fs->lg) << "cannot read extent " << xkey.tostring();
+		return false;
+	}
+	drop_extent(batch, start);
+
+	block_key key(type, inode, 0);
+	for (int i = 0; i < count; ++i) {
+		size_t off = (size_t)i * blocksize;
+		int block = start + i;
+		if (off >= value.size()) {
+			break;
+		}
+		if (block >= skip_first && block < skip_end) {
+			continue;
+		}
+		std::string & data = demoted[block];
+		data.assign(value, off, blocksize);
+		key.setblock(block);
+		put_block(batch, key, data.data(), data.size());
+	}
+	return true;
+}
+
+bool fentry::read_block(int block, std::string & value)
+{
+	std::map<int, std::string>::iterator d = demoted.find(block);
+	if (d != demoted.end()) {
+		value = d->second;
+		return true;
+	}
+
+	extents_t::iterator it = find_extent(block);
+	if (it == extents.end()) {
+		block_key key(type, inode, 0);
+		key.setblock(block);
+		return get_block(key, value);
+	}
+
+	int start = it->first;
+	block_key xkey('x', inode, 0);
+	xkey.setblock(start);
+	if (!get_block(xkey, value)) {
+		return false;
+	}
+
+	size_t off = (size_t)(block - start) * fs->blocksize;
+	value = value.substr(std::min(off, value.size()), fs->blocksize);
+	return true;
+}
+
+int fentry::write_extents(batch_t & batch, const char * buf, int first, int count)
+{
+	int blocksize = fs->blocksize;
+	int max_blocks = fs->extent_size / blocksize;
+	int end = first + count;
+
+	// replaced extents go away, partially covered ones become blocks
+	extents_t::iterator it = find_extent(first);
+	if (it == extents.end()) {
+		it = extents.lower_bound(first);
+	}
+	while (it != extents.end() && it->first < end) {
+		int start = it->first;
+		int blocks = it->second;
+		++it;
+		if (start >= first && start + blocks <= end) {
+			drop_extent(batch, start);
+		} else if (!demote_extent(batch, start, first, end)) {
+			return -EIO;
+		}
+	}
+
+	// fixed blocks exist only below the old size
+	int old_blocks = (st.size + blocksize - 1) / blocksize;
+	block_key key(type, inode, 0);
+	for (int block = first; block < std::min(end, old_blocks); ++block) {
+		key.setblock(block);
+		if (fs->vlogs) {
+			release_block(batch, key);
+		}
+		batch.push_back(operation(key, operation::DELETE, std::string()));
+	}
+
+	block_key xkey('x', inode, 0);
+	for (int start = first; start < end; start += max_blocks) {
+		int blocks = std::min(max_blocks, end - start);
+		const char * p = buf + (size_t)(start - first) * blocksize;
+		xkey.setblock(start);
+		batch.push_back(operation(xkey, operation::PUT,
+		                          place_block(xkey, encode_block(p, (size_t)blocks * blocksize, true))));
+		extents[start] = blocks;
+	}
+
+	return count * blocksize;
+}
 
 int fentry::write_buf(batch_t & batch,
                       const char * buf,
                       off_t size, size_t offset)
 {
+	int blocksize = fs->blocksize;
+	int write_size = 0;
+	bool extents_changed = false;
+
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+
+	// a failed demote leaves the batch unusable, the extents go back
+	extents_t saved;
+	if (!extents.empty()) {
+		saved = extents;
+	}
+
+	// whole blocks of a large write go to extents, the edges to blocks
+	size_t first = (offset + blocksize - 1) / blocksize;
+	size_t last = (offset + size) / blocksize;
+
+	if (fs->extent_size > 0 && last > first && last - first >= extent_min_blocks) {
+		size_t body = first * blocksize;
+		size_t body_end = last * blocksize;
+		int r = 0;
+
+		if (body > offset) {
+			r = write_blocks(batch, buf, body - offset, offset);
+			write_size += r;
+		}
+		if (r >= 0) {
+			r = write_extents(batch, buf + (body - offset), first, last - first);
+			write_size += r;
+		}
+		if (r >= 0 && offset + size > body_end) {
+			r = write_blocks(batch, buf + (body_end - offset),
+			                 offset + size - body_end, body_end);
+			write_size += r;
+		}
+		if (r < 0) {
+			write_size = r;
+		}
+		extents_changed = true;
+	} else {
+		size_t extents_before = extents.size();
+		write_size = write_blocks(batch, buf, size, offset);
+		extents_changed = extents.size() != extents_before;
+	}
+
+	demoted.clear();
+	if (write_size < 0) {
+		extents.swap(saved);
+		return write_size;
+	}
+
+	int filesize = std::max((long)st.size, (long)(offset+size));
+
+	if (st.size != filesize || extents_changed) {
+		st.size = filesize;
+		write(batch);
+	}
+
+//	fprintf(l, "written %s %d\n", name.c_str(), write_size);
+
+	return write_size;
+}
+
+int fentry::write_blocks(batch_t & batch,
+                         const char * buf,
+                         off_t size, size_t offset)
+{
 
 	int blocksize = fs->blocksize;
 
@@ -32,17 +471,20 @@ int fentry::write_buf(batch_t & batch,
 		key.setblock(cur_block);
 		
 		std::string value;
-		fs->read(key, value); // TODO: check status
-
-		value.resize(blocksize);
+		read_block(cur_block, value); // TODO: check status
 
-		char * dst = (char*)value.c_str() + r;
+		// keep the tail of the block past the written range
 		upto = std::min((long)(blocksize - r), (long)size);
-		memcpy(dst, p, upto);
-		value.resize(r+upto);
+		if (value.size() < r+upto) {
+			value.resize(r+upto);
+		}
+		memcpy(&value[r], p, upto);
 
 //		fprintf(l, "write(1)key %s\n", stringify(key).c_str());
-		batch.push_back(operation(key, operation::PUT, value));
+		if (!split_extent(batch, cur_block)) {
+			return -EIO;
+		}
+		put_block(batch, key, value.data(), value.size());
 		write_size += upto;
 
 		p +=  upto;
@@ -63,24 +505,44 @@ int fentry::write_buf(batch_t & batch,
 		}
 //		fprintf(l, "write key %s\n", stringify(key).c_str());
 
-		std::string value(p, upto);
-		batch.push_back(operation(key, operation::PUT, value));
+		if (upto < blocksize && cur_offset + upto < st.size) {
+			// short last block inside the file, keep what follows it
+			std::string value;
+			read_block(cur_block, value); // TODO: check status
+			if (value.size() < upto) {
+				value.resize(upto);
+			}
+			memcpy(&value[0], p, upto);
+			if (!split_extent(batch, cur_block)) {
+				return -EIO;
+			}
+			put_block(batch, key, value.data(), value.size());
+		} else {
+			if (!split_extent(batch, cur_block)) {
+				return -EIO;
+			}
+			put_block(batch, key, p, upto);
+		}
 		write_size += upto;
 		p += upto;
 		cur_block ++;
 		cur_offset = cur_block * blocksize;
 	}
 
-	int filesize = std::max((long)st.st_size, (long)(offset+size));
+	return write_size;
+}
 
-	if (st.st_size != filesize) {
-		st.st_size = filesize;
-		write(batch);
+bool fentry::split_extent(batch_t & batch, int block)
+{
+	if (extents.empty()) {
+		return true;
 	}
 
-//	fprintf(l, "written %s %d\n", name.c_str(), write_size);
-
-	return write_size;
+	extents_t::iterator it = find_extent(block);
+	if (it != extents.end()) {
+		return demote_extent(batch, it->first, block, block + 1);
+	}
+	return true;
 }
 
 int fentry::read_buf(char * buf,
@@ -95,32 +557,69 @@ int fentry::read_buf(char * buf,
 
 	block_key key(type, inode, 0);
 
-	st.st_atime = time(0);
+	// current extent, read once for all its blocks
+	std::string xvalue;
+	int xstart = -1;
+	int xcount = 0;
 
-//	fprintf(l, "read %s <- %lu, %lu %lu\n",
-//	        name.c_str(), st.st_size, size, offset);
+	st.atime = time(0);
 
-	while (cur_offset < st.st_size && cur_offset < offset+size) {
-		key.setblock(cur_block);
+	// once per read, block reads of files without extents stay lock free
+	bool has_extents;
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(mutex);
+		has_extents = !extents.empty();
+	}
+
+//	fprintf(l, "read %s <- %lu, %lu %lu\n",
+//	        name.c_str(), st.size, size, offset);
 
+	while (cur_offset < st.size && cur_offset < offset+size) {
 		std::string value;
-		bool status = fs->read(key, value); // TODO: check status
+		const char * data;
+		size_t len;
+
+		if (has_extents &&
+		    (cur_block < xstart || cur_block >= xstart + xcount))
+		{
+			boost::unique_lock<boost::mutex> scoped_lock(mutex);
+			extents_t::iterator it = find_extent(cur_block);
+			if (it != extents.end() && it->first != xstart) {
+				xstart = it->first;
+				xcount = it->second;
+				block_key xkey('x', inode, 0);
+				xkey.setblock(xstart);
+				scoped_lock.unlock();
+				get_block(xkey, xvalue); // TODO: check status
+			}
+		}
 
-		if (value.size() < blocksize) {
-			value.resize(blocksize);
+		if (cur_block >= xstart && cur_block < xstart + xcount) {
+			size_t off = std::min((size_t)(cur_block - xstart) * blocksize, xvalue.size());
+			data = xvalue.data() + off;
+			len = std::min((size_t)blocksize, xvalue.size() - off);
+		} else {
+			key.setblock(cur_block);
+			bool status = get_block(key, value); // TODO: check status
+			data = value.data();
+			len = value.size();
 		}
 
 		int r = cur_offset % blocksize;
 		int upto = std::min(
 			buf + size - p,
-			(long)value.size() - r);
+			(long)blocksize - r);
 
-		if (cur_offset + upto > st.st_size) {
-			upto = st.st_size - cur_offset;
+		if (cur_offset + upto > st.size) {
+			upto = st.size - cur_offset;
 		}
+
+		// holes and short blocks read as zeros
+		size_t avail = (len > r) ? std::min((size_t)upto, len - r) : 0;
 		
 		read_size += upto;
-		memcpy(p, value.c_str() + r, upto);
+		memcpy(p, data + r, avail);
+		memset(p + avail, 0, upto - avail);
 		p += upto;
 		cur_block ++;
 		cur_offset = cur_block * blocksize;
@@ -141,39 +640,75 @@ void fentry::remove(batch_t & batch)
 
 	block_key key(type, inode, 0);
 
-	while (cur_offset < st.st_size) {
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+
+	while (cur_offset < st.size) {
+		extents_t::iterator it = find_extent(cur_block);
+		if (it != extents.end()) {
+			cur_block = it->first + it->second;
+			cur_offset = cur_block * blocksize;
+			drop_extent(batch, it->first);
+			continue;
+		}
+
 		key.setblock(cur_block);
 
+		if (fs->dedup || fs->vlogs) {
+			release_block(batch, key);
+		}
 		batch.push_back(operation(key, operation::DELETE, std::string()));
 
 		cur_block ++;
 		cur_offset = cur_block * blocksize;
 	}
+
+	// the inode record too, it was left behind as an orphan
+	entry::remove(batch);
 }
 
 void fentry::grow(batch_t & batch, size_t new_size)
 {
 	int blocksize = fs->blocksize;
 
-	if (new_size <= st.st_size) {
+	if (new_size <= st.size) {
 		return;
 	}
 
-	st.st_size = new_size;
+	st.size = new_size;
 	write(batch);
 }
 
-void fentry::truncate(batch_t & batch, size_t new_size)
+bool fentry::truncate(batch_t & batch, size_t new_size)
 {
 	int blocksize = fs->blocksize;
 
-	if (new_size == st.st_size) {
-		return;
+	if (new_size == st.size) {
+		return true;
 	}
 	
-	if (new_size > st.st_size) {
+	if (new_size > st.size) {
 		grow(batch, new_size);
-		return;
+		return true;
+	}
+
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+
+	// extents past the new end go away, a straddling one becomes blocks.
+	// at most one straddles, it is demoted before anything is dropped
+	int cut = (new_size + blocksize - 1) / blocksize;
+	extents_t::iterator it = find_extent(cut - 1);
+	if (it != extents.end() && it->first + it->second > cut) {
+		bool ok = demote_extent(batch, it->first, cut, it->first + it->second);
+		demoted.clear();
+		if (!ok) {
+			return false;
+		}
+	}
+	it = extents.lower_bound(cut);
+	while (it != extents.end()) {
+		int start = it->first;
+		++it;
+		drop_extent(batch, start);
 	}
 
 	size_t offset = new_size;
@@ -203,16 +738,67 @@ void fentry::truncate(batch_t & batch, size_t new_size)
 	}
 
 	// truncate
-	while (cur_offset < st.st_size) {
+	while (cur_offset < st.size) {
 		key.setblock(cur_block);
 
+		if (fs->dedup || fs->vlogs) {
+			release_block(batch, key);
+		}
 		batch.push_back(operation(key, operation::DELETE, std::string()));
 
 		cur_block ++;
 		cur_offset = cur_block * blocksize;
 	}
 
-	st.st_size = new_size;
+	st.size = new_size;
 	write(batch);
+	return true;
+}
+
+bool fentry::write_proto(proto::entry & e)
+{
+	for (extents_t::iterator it = extents.begin(); it != extents.end(); ++it) {
+		proto::entry_extent * x = e.add_extents();
+		x->set_block(it->first);
+		x->set_count(it->second);
+	}
+	return true;
 }
 
+bool fentry::read_proto(const proto::entry & e)
+{
+	extents.clear();
+	for (int i = 0; i < e.extents_size(); ++i) {
+		extents[e.extents(i).block()] = e.extents(i).count();
+	}
+	return true;
+}
+
+std::string fentry::extent_stats()
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+
+	int blocksize = fs->blocksize;
+	size_t blocks = (st.size + blocksize - 1) / blocksize;
+	size_t in_extents = 0;
+	int largest = 0;
+
+	for (extents_t::iterator it = extents.begin(); it != extents.end(); ++it) {
+		in_extents += it->second;
+		largest = std::max(largest, it->second);
+	}
+
+	char buf[1024];
+	snprintf(buf, sizeof(buf),
+	         "extents: %zu\nextent blocks: %zu\nfixed blocks: %zu\n"
+	         "largest extent: %d blocks\nmax extent: %u bytes\n",
+	         extents.size(), in_extents, blocks - std::min(blocks, in_extents),
+	         largest, fs->extent_size);
+
+	std::string r = buf;
+	for (extents_t::iterator it = extents.begin(); it != extents.end(); ++it) {
+		snprintf(buf, sizeof(buf), "%d+%d\n", it->first, it->second);
+		r += buf;
+	}
+	return r;
+}
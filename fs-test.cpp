@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include "fs.h"
+
+// ldbfs without fuse: drives the fs library the way the ldbfs_* handlers
+// do, so its own cost can be told apart from the kernel round trip.
+// prints one json line per workload
+//
+// usage: test-fs dir [--workload name|all] [--threads n] [--blocksize n]
+//          [--parts n] [--meta-parts n] [--flat-dirs] [--inode64] [--journal]
+//          [--iosize n] [--size megabytes] [--files n] [--flush ms]
+//          [--vlog-min bytes]
+//
+// workloads, every thread works on its own file or directory:
+//   seqwrite   write_buf of iosize at increasing offsets
+//   randwrite  write_buf of iosize at random aligned offsets
+//   seqread    read_buf, file written and flushed first
+//   randread   read_buf at random aligned offsets
+//   smallfile  create, write iosize, unlink later
+//   meta       create, find, rename, truncate, unlink; no data
+//   fsync      write iosize then FS::sync, as fsync(2) does
+//
+// written_mb is what the process wrote during the workload, write_amp
+// that over the bytes of the workload. lsm_mb and vlog_mb are the sizes
+// left in leveldb and in the value logs, the lsm part is what compaction
+// keeps rewriting
+
+struct options
+{
+	std::string dir;
+	std::string workload;
+	int threads;
+	int blocksize;
+	int parts;
+	int meta_parts;
+	bool flat_dirs;
+	bool inode64;
+	bool journal;
+	int iosize;
+	size_t size; // bytes per thread
+	int files;   // per thread
+	int flush_ms;
+	int vlog_min;
+};
+
+struct result
+{
+	std::vector<uint64_t> ns; // per op
+	uint64_t bytes;
+	int errors;
+	result(): bytes(0), errors(0) {}
+};
+
+static options opt;
+static boost::atomic<bool> flushing(false);
+
+static void flush_loop(FS * fs)
+{
+	// stands in for the per part threads started by FS::mount
+	while (flushing) {
+		boost::this_thread::sleep(boost::posix_time::milliseconds(opt.flush_ms));
+		fs->flush_buckets();
+	}
+}
+
+static long long process_written()
+{
+	char line[256];
+	long long bytes = -1;
+	FILE * f = fopen("/proc/self/io", "r");
+	if (!f) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "wchar:", 6)) {
+			bytes = atoll(line + 6);
+		}
+	}
+	fclose(f);
+	return bytes;
+}
+
+// bytes under dir, in the value logs or outside of them
+static uint64_t dir_bytes(const std::string & dir, bool vlogs)
+{
+	uint64_t bytes = 0;
+	boost::system::error_code ec;
+	boost::filesystem::recursive_directory_iterator it(dir, ec), end;
+	for (; !ec && it != end; it.increment(ec)) {
+		bool in_vlog = it->path().string().find("/vlog-") != std::string::npos;
+		if (in_vlog == vlogs && boost::filesystem::is_regular_file(it->status())) {
+			bytes += boost::filesystem::file_size(it->path(), ec);
+		}
+	}
+	return bytes;
+}
+
+static std::string thread_path(int t, const char * kind)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "t%03d/%s", t, kind);
+	return buf;
+}
+
+static entry_ptr open_file(FS & fs, const std::string & path)
+{
+	entry_ptr e = fs.find(path);
+	if (!e) {
+		fs.create(path, e);
+	}
+	return e;
+}
+
+static bool write_block(FS & fs, const entry_ptr & e, const std::string & data, off_t off)
+{
+	batch_t batch;
+	if (e->write_buf(batch, data.c_str(), data.size(), off) < 0) {
+		return false;
+	}
+	return fs.write(batch, false);
+}
+
+// one timed op, failures are counted but keep their latency
+#define TIMED(r, expr) do {                                     \
+	uint64_t t1 = now_ns();                                     \
+	if (!(expr)) (r).errors ++;                                 \
+	(r).ns.push_back(now_ns() - t1);                            \
+} while (0)
+
+static void prepare(FS & fs, int t, const std::string & data)
+{
+	entry_ptr e = open_file(fs, thread_path(t, "data"));
+	for (size_t off = 0; off < opt.size; off += data.size()) {
+		write_block(fs, e, data, off);
+	}
+}
+
+static void run(FS * fs, int t, result * r)
+{
+	FS & f = *fs;
+	std::string data(opt.iosize, 0);
+	unsigned int seed = t + 1;
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = (char)rand_r(&seed);
+	}
+	std::string buf(opt.iosize, 0);
+	size_t blocks = std::max<size_t>(opt.size / opt.iosize, 1);
+	const std::string & w = opt.workload;
+
+	if (w == "seqwrite" || w == "randwrite" || w == "seqread" || w == "randread") {
+		entry_ptr e = open_file(f, thread_path(t, "data"));
+		bool rnd = w == "randwrite" || w == "randread";
+		bool rd = w == "seqread" || w == "randread";
+		for (size_t i = 0; i < blocks; ++i) {
+			off_t off = ((rnd) ? rand_r(&seed) % blocks : i) * (off_t)opt.iosize;
+			if (rd) {
+				TIMED(*r, e->read_buf(&buf[0], buf.size(), off) == (int)buf.size());
+			} else {
+				TIMED(*r, write_block(f, e, data, off));
+			}
+			r->bytes += opt.iosize;
+		}
+	} else if (w == "smallfile") {
+		char name[64];
+		for (int i = 0; i < opt.files; ++i) {
+			snprintf(name, sizeof(name), "t%03d/f%07d", t, i);
+			entry_ptr e;
+			TIMED(*r, f.create(name, e) == 0 && write_block(f, e, data, 0));
+			r->bytes += opt.iosize;
+		}
+		for (int i = 0; i < opt.files; ++i) {
+			snprintf(name, sizeof(name), "t%03d/f%07d", t, i);
+			TIMED(*r, f.unlink(name) == 0);
+		}
+	} else if (w == "meta") {
+		char name[64], moved[64];
+		for (int i = 0; i < opt.files; ++i) {
+			snprintf(name, sizeof(name), "t%03d/f%07d", t, i);
+			snprintf(moved, sizeof(moved), "t%03d/m%07d", t, i);
+			entry_ptr e;
+			TIMED(*r, f.create(name, e) == 0);
+			TIMED(*r, f.find(name));
+			TIMED(*r, f.rename(name, moved) == 0);
+			TIMED(*r, f.truncate(moved, 0) == 0);
+		}
+		for (int i = 0; i < opt.files; ++i) {
+			snprintf(moved, sizeof(moved), "t%03d/m%07d", t, i);
+			TIMED(*r, f.unlink(moved) == 0);
+		}
+	} else if (w == "fsync") {
+		entry_ptr e = open_file(f, thread_path(t, "data"));
+		for (size_t i = 0; i < blocks; ++i) {
+			off_t off = i * (off_t)opt.iosize;
+			TIMED(*r, write_block(f, e, data, off) && f.sync(e));
+			r->bytes += opt.iosize;
+		}
+	}
+}
+
+static void run_workload(const std::string & name)
+{
+	std::string dir = opt.dir + "/" + name;
+	boost::filesystem::remove_all(dir);
+	boost::filesystem::create_directories(dir);
+
+	FS fs(dir);
+	fs.meta_parts = opt.meta_parts;
+	fs.flat_dirs = opt.flat_dirs;
+	fs.inode64 = opt.inode64;
+	fs.journaled = opt.journal;
+	fs.vlog_min_size = opt.vlog_min;
+	fs.mkfs(opt.blocksize, opt.parts);
+
+	opt.workload = name;
+	std::string data(opt.iosize, 'x');
+	for (int t = 0; t < opt.threads; ++t) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "t%03d", t);
+		fs.mkdir(buf);
+		if (name == "seqread" || name == "randread") {
+			prepare(fs, t, data);
+		}
+	}
+	fs.flush_buckets();
+
+	flushing = true;
+	boost::thread flusher(boost::bind(flush_loop, &fs));
+
+	std::vector<result> results(opt.threads);
+	boost::thread_group threads;
+	long long written1 = process_written();
+	uint64_t t1 = now_ns();
+	for (int t = 0; t < opt.threads; ++t) {
+		threads.create_thread(boost::bind(run, &fs, t, &results[t]));
+	}
+	threads.join_all();
+	// dirty batches are part of the cost of a write workload
+	fs.flush_buckets();
+	uint64_t t2 = now_ns();
+	long long written2 = process_written();
+
+	flushing = false;
+	flusher.interrupt();
+	flusher.join();
+
+	std::vector<uint64_t> ns;
+	uint64_t bytes = 0;
+	int errors = 0;
+	for (int t = 0; t < opt.threads; ++t) {
+		ns.insert(ns.end(), results[t].ns.begin(), results[t].ns.end());
+		bytes += results[t].bytes;
+		errors += results[t].errors;
+	}
+	std::sort(ns.begin(), ns.end());
+
+	double seconds = (t2 - t1) / 1e9;
+	double written = (written1 < 0 || written2 < 0) ? 0 : written2 - written1;
+	printf("{\"workload\": \"%s\", \"threads\": %d, \"blocksize\": %d, \"parts\": %d, "
+	       "\"journal\": %s, \"vlog_min\": %d, \"iosize\": %d, \"ops\": %lu, \"errors\": %d, "
+	       "\"seconds\": %.3f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+	       "\"written_mb\": %.2f, \"write_amp\": %.2f, \"lsm_mb\": %.2f, \"vlog_mb\": %.2f, "
+	       "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}\n",
+	       name.c_str(), opt.threads, opt.blocksize, opt.parts,
+	       (opt.journal) ? "true" : "false", opt.vlog_min, opt.iosize, (unsigned long)ns.size(),
+	       errors, seconds, ns.size() / seconds, bytes / seconds / 1024 / 1024,
+	       written / 1024 / 1024, (bytes) ? written / bytes : 0,
+	       dir_bytes(dir, false) / 1024.0 / 1024, dir_bytes(dir, true) / 1024.0 / 1024,
+	       percentile(ns, 0.5) / 1e3, percentile(ns, 0.9) / 1e3,
+	       percentile(ns, 0.99) / 1e3, percentile(ns, 0.999) / 1e3,
+	       (ns.empty() ? 0 : ns.back()) / 1e3);
+	fflush(stdout);
+}
+
+int main(int argc, char ** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s dir [--workload name|all] [--threads n] [--blocksize n] "
+		        "[--parts n] [--meta-parts n] [--flat-dirs] [--inode64] [--journal] "
+		        "[--iosize n] [--size megabytes] [--files n] [--flush ms] [--vlog-min bytes]\n",
+		        argv[0]);
+		return -1;
+	}
+
+	std::string workload = "all";
+	opt.dir = argv[1];
+	opt.threads = 4;
+	opt.blocksize = 128*1024;
+	opt.parts = 2;
+	opt.meta_parts = 1;
+	opt.flat_dirs = false;
+	opt.inode64 = false;
+	opt.journal = false;
+	opt.iosize = 0;
+	opt.size = 64;
+	opt.files = 10000;
+	opt.flush_ms = 5000;
+	opt.vlog_min = 0;
+
+	for (int i = 2; i < argc; ++i) {
+		const char * v = (i + 1 < argc) ? argv[i+1] : "0";
+		if (!strcmp(argv[i], "--workload")) {
+			workload = v;
+		} else if (!strcmp(argv[i], "--threads")) {
+			opt.threads = atoi(v);
+		} else if (!strcmp(argv[i], "--blocksize")) {
+			opt.blocksize = atoi(v);
+		} else if (!strcmp(argv[i], "--parts")) {
+			opt.parts = atoi(v);
+		} else if (!strcmp(argv[i], "--meta-parts")) {
+			opt.meta_parts = atoi(v);
+		} else if (!strcmp(argv[i], "--flat-dirs")) {
+			opt.flat_dirs = true;
+		} else if (!strcmp(argv[i], "--inode64")) {
+			opt.inode64 = true;
+		} else if (!strcmp(argv[i], "--journal")) {
+			opt.journal = true;
+		} else if (!strcmp(argv[i], "--iosize")) {
+			opt.iosize = atoi(v);
+		} else if (!strcmp(argv[i], "--size")) {
+			opt.size = atol(v);
+		} else if (!strcmp(argv[i], "--files")) {
+			opt.files = atoi(v);
+		} else if (!strcmp(argv[i], "--flush")) {
+			opt.flush_ms = atoi(v);
+		} else if (!strcmp(argv[i], "--vlog-min")) {
+			opt.vlog_min = atoi(v);
+		}
+	}
+
+	if (opt.iosize <= 0) {
+		opt.iosize = opt.blocksize;
+	}
+	opt.size *= 1024L * 1024L;
+
+	if (opt.threads <= 0 || opt.blocksize <= 0 || opt.parts <= 0 || opt.meta_parts <= 0) {
+		fprintf(stderr, "invalid threads, blocksize or parts\n");
+		return -1;
+	}
+	if (opt.vlog_min < 0 || (opt.journal && opt.vlog_min > 0)) {
+		// as mkfs, the journal does not cover the value logs
+		fprintf(stderr, "invalid vlog min size, or vlog with journal\n");
+		return -1;
+	}
+
+	boost::log::core::get()->set_logging_enabled(false);
+
+	const char * all[] = {
+		"seqwrite", "randwrite", "seqread", "randread", "smallfile", "meta", "fsync"
+	};
+	for (int i = 0; i < 7; ++i) {
+		if (workload == "all" || workload == all[i]) {
+			run_workload(all[i]);
+		}
+	}
+
+	return 0;
+}
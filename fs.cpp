@@ -1,6 +1,12 @@
+#include <endian.h>
+#include <errno.h>
+
+#include <sstream>
+
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/log/utility/setup/console.hpp>
 #include <boost/log/utility/setup/file.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
@@ -16,19 +22,150 @@ FS::FS(const std::string & dbpath): lg(global_lg::get())
 	maxhandles=1000000;
 	blocksize=-1;
 	parts=-1;
+	dentry_compression=proto::fsmeta::SNAPPY;
+	data_compression=proto::fsmeta::SNAPPY;
+	dedup=false;
+	vlog_min_size=0;
+	extent_size=0;
+	inode64=false;
+	flat_dirs=false;
+	next_inode=2; // 1 is root
+	reserved_inode=2;
+	meta_parts=1;
+	placement=proto::fsmeta::MODULO;
+	intent_seq=0;
+	intent_synced=0;
+	stopping=false;
+	max_entries=0;
+	nodes=0;
+	evicted=0;
+	vlogs=0;
+	journaled=false;
+	reshard_parts=0;
+	jlog=0;
+	dedup_logical=0;
+	hash_bytes=0;
+	hash_ns=0;
 
 	dbroot = dbpath;
 
     handles.resize(maxhandles);
 }
 
+static leveldb::CompressionType leveldb_compression(int type)
+{
+	switch (type) {
+	case proto::fsmeta::NONE:
+	case proto::fsmeta::ADAPTIVE: // fentry compresses blocks itself
+		return leveldb::kNoCompression;
+	case proto::fsmeta::LZ4:
+		return leveldb::kLZ4Compression;
+	default:
+		return leveldb::kSnappyCompression;
+	}
+}
+
+int FS::compression_type(const std::string & name)
+{
+	std::string upper = boost::algorithm::to_upper_copy(name);
+	proto::fsmeta_compression type;
+	if (!proto::fsmeta_compression_Parse(upper, &type)) {
+		return -1;
+	}
+	return type;
+}
+
+int FS::placement_type(const std::string & name)
+{
+	std::string upper = boost::algorithm::to_upper_copy(name);
+	proto::fsmeta_placement type;
+	if (!proto::fsmeta_placement_Parse(upper, &type)) {
+		return -1;
+	}
+	return type;
+}
+
+const char * FS::compression_name(int type)
+{
+	switch (type) {
+	case proto::fsmeta::NONE: return "none";
+	case proto::fsmeta::SNAPPY: return "snappy";
+	case proto::fsmeta::LZ4: return "lz4";
+	case proto::fsmeta::ADAPTIVE: return "adaptive";
+	default: return "unknown";
+	}
+}
+
+bool FS::tagged_blocks() const
+{
+	return data_compression == proto::fsmeta::ADAPTIVE || dedup || vlog_min_size > 0;
+}
+
+bool FS::allocate_inode(entry * e)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(inode_mutex);
+	if (next_inode >= reserved_inode) {
+		// one synced write per range, so a number is never handed out twice.
+		// only the 'a' key, the dentry batch is not flushed under the lock
+		uuid_t zero;
+		memset(zero, 0, sizeof(zero));
+		uint64_t reserved = next_inode + 1024;
+		char buf[sizeof(block_key)];
+		leveldb::WriteOptions writeOptions;
+		writeOptions.sync = true;
+		leveldb::Status status = buckets[0].db->Put(writeOptions,
+			leveldb::Slice(buf, block_key('a', zero).encode(buf, inode64)),
+			leveldb::Slice((char*)&reserved, sizeof(reserved)));
+		if (!status.ok()) {
+			// a number past the persisted range could be handed out again
+			BOOST_LOG(lg) << "cannot write inode allocator " << status.ToString();
+			return false;
+		}
+		reserved_inode = reserved;
+	}
+
+	if (!inode64) {
+		// the key stays the uuid of the constructor, the number goes
+		// into the record
+		e->ino = next_inode++;
+		return true;
+	}
+
+	// big endian, keys of files created together sort together
+	uint64_t n = htobe64(next_inode++);
+	memset(e->inode, 0, sizeof(uuid_t));
+	memcpy(e->inode, &n, sizeof(n));
+	return true;
+}
+
+uint64_t FS::inode_number(const entry * e)
+{
+	uint64_t n;
+	memcpy(&n, e->inode, sizeof(n));
+	if (inode64) {
+		n = be64toh(n);
+		return (n == 0) ? 1 : n; // root
+	}
+	if (e->ino) {
+		return e->ino;
+	}
+
+	uuid_t zero;
+	memset(zero, 0, sizeof(zero));
+	if (!memcmp(e->inode, zero, sizeof(zero))) {
+		return 1; // root
+	}
+	// records written before numbers were stored: both halves of the
+	// uuid folded, the top bit keeps them apart from allocated numbers
+	uint64_t h;
+	memcpy(&h, e->inode + sizeof(n), sizeof(h));
+	return (n ^ h) | (1ULL << 63);
+}
+
 void FS::open(bool create)
 {
 	leveldb::Options options;
     options.create_if_missing = create;
-//    options.compression = leveldb::kLZ4Compression;
-//    options.compression = leveldb::kNoCompression;
-//    options.write_buffer_size = 32*1024*1024;
 
     options.filter_policy=leveldb::NewBloomFilterPolicy2(16);
     options.write_buffer_size=62914560;  // 60Mbytes
@@ -42,6 +179,9 @@ void FS::open(bool create)
 	block_key metakey('m', metauuid);
 
 	leveldb::DB * rootdb;
+	if (create) {
+		options.compression = leveldb_compression(dentry_compression);
+	}
     status = leveldb::DB::Open(options, dbroot + "/dentry", &rootdb);
 
 	// read meta
@@ -50,9 +190,23 @@ void FS::open(bool create)
 		proto::fsmeta fsmeta;
 		assert(blocksize > 0);
 		assert(parts > 0);
-	    buckets = new bucket[parts+1];
+	    buckets = new bucket[parts+meta_parts];
 		fsmeta.set_blocksize(blocksize);
 		fsmeta.set_parts(parts);
+		fsmeta.set_dentry_compression((proto::fsmeta_compression)dentry_compression);
+		fsmeta.set_data_compression((proto::fsmeta_compression)data_compression);
+		fsmeta.set_dedup(dedup);
+		fsmeta.set_vlog_min_size(vlog_min_size);
+		fsmeta.set_extent_size(extent_size);
+		fsmeta.set_inode64(inode64);
+		fsmeta.set_flat_dirs(flat_dirs);
+		fsmeta.set_meta_parts(meta_parts);
+		fsmeta.set_data_placement((proto::fsmeta_placement)placement);
+		fsmeta.set_journal(journaled);
+		for (size_t i = 0; i < data_dirs.size(); ++i) {
+			fsmeta.add_data_dirs(data_dirs[i]);
+			boost::filesystem::create_directories(data_dirs[i]);
+		}
 		std::string value;
 		fsmeta.SerializeToString(&value); // TODO: check error
 		buckets[0].db = rootdb;
@@ -73,29 +227,153 @@ void FS::open(bool create)
 		}
 		blocksize = fsmeta.blocksize();
 		parts = fsmeta.parts();
-	    buckets = new bucket[parts+1];
+		dentry_compression = fsmeta.dentry_compression();
+		data_compression = fsmeta.data_compression();
+		dedup = fsmeta.dedup();
+		vlog_min_size = fsmeta.vlog_min_size();
+		extent_size = fsmeta.extent_size();
+		inode64 = fsmeta.inode64();
+		flat_dirs = fsmeta.flat_dirs();
+		meta_parts = fsmeta.meta_parts();
+		placement = fsmeta.data_placement();
+		journaled = fsmeta.journal();
+		reshard_parts = fsmeta.reshard_parts();
+		if (data_dirs.empty()) {
+			for (int i = 0; i < fsmeta.data_dirs_size(); ++i) {
+				data_dirs.push_back(fsmeta.data_dirs(i));
+			}
+		} else if ((int)data_dirs.size() != fsmeta.data_dirs_size()) {
+			// parts are found by index, a different count moves them
+			BOOST_LOG(lg) << "data dirs override: " << data_dirs.size()
+			              << " dirs, filesystem has " << fsmeta.data_dirs_size();
+		}
+
+		// meta is read with default options, reopen if dentry differs
+		if (options.compression != leveldb_compression(dentry_compression)) {
+			delete rootdb;
+			options.compression = leveldb_compression(dentry_compression);
+			status = leveldb::DB::Open(options, dbroot + "/dentry", &rootdb);
+		}
+	    buckets = new bucket[parts+meta_parts];
 		buckets[0].db = rootdb;
 	}
 
 	assert(blocksize > 0);
 	assert(parts > 0);
+	assert(meta_parts > 0);
+
+	for (int i = 0; i < buckets_count(); ++i) {
+		buckets[i].compact = inode64;
+	}
+
+	// superblock, allocator and intents stay in dentry
+	for (int i = 1; i < meta_parts; ++i) {
+		char buf[1024];
+		snprintf(buf, sizeof(buf), "/dentry-%04d", i);
+		status = leveldb::DB::Open(options, dbroot + buf, &buckets[parts+i].db);
+	}
+
+	if (!create) {
+		// numbers handed out before a crash are at most reserved_inode,
+		// continue after them
+		std::string value;
+		block_key key('a', metauuid);
+		if (buckets[0].read(key, value) && value.size() == sizeof(uint64_t)) {
+			memcpy(&reserved_inode, value.data(), sizeof(uint64_t));
+			next_inode = reserved_inode;
+		}
+	}
+
+	options.compression = leveldb_compression(data_compression);
+	data_options = options;
    
     for (int i = 0; i < parts; ++i) {
 	    char buf[1024];
 	    snprintf(buf, sizeof(buf), "/fentry-%04d", i);
-	    status = leveldb::DB::Open(options, dbroot + buf, &buckets[i+1].db);
+	    status = leveldb::DB::Open(options, part_dir(i) + buf, &buckets[i+1].db);
+	    if (!status.ok()) {
+		    BOOST_LOG(lg) << "cannot open " << part_dir(i) << buf << ": " << status.ToString();
+		    exit(-1);
+	    }
     }
 
+	if (vlog_min_size > 0) {
+		vlogs = new vlog[parts];
+		for (int i = 0; i < parts; ++i) {
+			char buf[1024];
+			snprintf(buf, sizeof(buf), "/vlog-%04d", i);
+			if (!vlogs[i].open(part_dir(i) + buf)) {
+				BOOST_LOG(lg) << "cannot open vlog " << buf;
+				exit(-1);
+			}
+			buckets[i+1].log = &vlogs[i];
+		}
+	}
+
+	if (journaled) {
+		jlog = new journal;
+		if (!jlog->open(dbroot + "/journal")) {
+			BOOST_LOG(lg) << "cannot open journal";
+			exit(-1);
+		}
+		for (int i = 0; i < buckets_count(); ++i) {
+			buckets[i].jlog = jlog;
+		}
+	}
+
+	uuid_t zero;
+	memset(zero, 0, sizeof(zero));
+	for (int i = 0; i < buckets_count(); ++i) {
+		std::string value;
+		if (buckets[i].read(block_key('w', zero), value) && value.size() == sizeof(uint64_t)) {
+			memcpy(&buckets[i].marker, value.data(), sizeof(uint64_t));
+			intent_seq = std::max(intent_seq, buckets[i].marker);
+		}
+	}
+
+	if (!create) {
+		replay_intents();
+	}
+
+	if (!create && jlog) {
+		int replayed = jlog->replay(*this);
+		// synced to the parts before the old segments go
+		flush_buckets();
+		if (replayed > 0) {
+			BOOST_LOG(lg) << "replayed journal records: " << replayed;
+		}
+	}
+
     root.reset(new dentry("", this));
 
-	BOOST_LOG(lg) << ((create) ? "create " : "mounted ") << "ldbfs, blocksize " << blocksize << ", parts " << parts;
+	BOOST_LOG(lg) << ((create) ? "create " : "mounted ") << "ldbfs, blocksize " << blocksize << ", parts " << parts
+	              << ", compression " << compression_name(dentry_compression)
+	              << "/" << compression_name(data_compression)
+	              << ((dedup) ? ", dedup" : "")
+	              << ((vlog_min_size > 0) ? ", vlog" : "")
+	              << ((extent_size > 0) ? ", extents" : "")
+	              << ((inode64) ? ", inode64" : "")
+	              << ((flat_dirs) ? ", flat dirs" : "")
+	              << ((journaled) ? ", journal" : "")
+	              << ", meta parts " << meta_parts
+	              << ", data dirs " << std::max((int)data_dirs.size(), 1)
+	              << ((placement == proto::fsmeta::JUMP) ? ", jump placement" : "");
 }
 
 void FS::mount()
 {
 	open(false);
+	// keys are half moved, neither layout finds all of them
+	if (reshard_parts > 0) {
+		BOOST_LOG(lg) << "reshard to " << reshard_parts << " parts did not finish, run reshard.ldbfs "
+		              << reshard_parts << " " << dbroot;
+		exit(-1);
+	}
 	root->read();
 
+	for (int i = 0; i < buckets_count(); ++i) {
+		part_threads.create_thread(boost::bind(&FS::flush_part, this, i));
+	}
 	flush_thread = boost::thread(boost::bind(&FS::flush_job, this));
 }
 
@@ -113,19 +391,36 @@ void FS::mkfs(int blocksize, int parts)
 	}
 }
 
-boost::shared_ptr<entry> FS::find(const std::string & path)
+entry_ptr FS::find(const std::string & path)
+{
+	entry_ptr e;
+	if (paths.lookup(path, e)) {
+		return e;
+	}
+	uint64_t gen = paths.generation();
+	TRACE_SPAN("FS::find walk");
+	e = root->find(path);
+	paths.insert(path, e, gen);
+	return e;
+}
+
+void FS::invalidate(const std::string & path, bool subtree)
 {
-	return root->find(path);
+	if (subtree) {
+		paths.clear();
+	} else {
+		paths.erase(path);
+	}
 }
 
-boost::shared_ptr<entry> FS::find_parent(const std::string & path)
+entry_ptr FS::find_parent(const std::string & path)
 {
-	boost::shared_ptr<entry> dst;
+	entry_ptr dst;
 	size_t pos = path.rfind("/");
 	if (pos == std::string::npos) {
 		dst = root;
 	} else {
-		dst = root->find(path.substr(0, pos));
+		dst = find(path.substr(0, pos));
 	}
 	return dst;
 }
@@ -142,7 +437,271 @@ std::string FS::filename(const std::string & path)
 	return name;
 }
 
-uint64_t FS::allocate_handle(const boost::shared_ptr<entry> & r, struct fuse_file_info *fi)
+// namespace operations, path is relative to the root as in find;
+// 0 or -errno as fuse wants
+
+int FS::create(const std::string & path, entry_ptr & r)
+{
+	// one walk to the parent, the name is looked up in it
+	entry_ptr dst = find_parent(path);
+	std::string name = filename(path);
+
+	if (!dst) {
+		BOOST_LOG(lg) << "cannot find dst " << path;
+		return -ENOENT;
+	}
+
+	if (dst->child(name)) {
+		BOOST_LOG(lg) << "already exists " << path;
+		return -EEXIST;
+	}
+
+	r.reset(new fentry(name, this));
+	if (!allocate_inode(r.get())) {
+		return -EIO;
+	}
+	if (!dst->add_child(r)) {
+		BOOST_LOG(lg) << "cannot read parent of " << path;
+		return -EIO;
+	}
+	invalidate(path);
+
+	batch_t batch;
+
+	r->write(batch);
+	if (!dst->write(batch)) {
+		return -EIO;
+	}
+	if (!write(batch, true)) {
+		BOOST_LOG(lg) << "cannot commit " << path;
+		return -EIO;
+	}
+
+	LOG_DEBUG(lg) << "created " << r->tostring();
+	return 0;
+}
+
+int FS::mkdir(const std::string & path)
+{
+	entry_ptr dst = find_parent(path);
+	std::string name = filename(path);
+
+	if (!dst) {
+		BOOST_LOG(lg) << "cannot find dst " << path;
+		return -ENOENT;
+	}
+
+	if (dst->child(name)) {
+		BOOST_LOG(lg) << "already exists " << path;
+		return -EEXIST;
+	}
+
+	LOG_DEBUG(lg) << "parent: " << dst->name << "/" << name;
+
+	entry_ptr r(new dentry(name, this));
+	if (!allocate_inode(r.get())) {
+		return -EIO;
+	}
+	if (!dst->add_child(r)) {
+		BOOST_LOG(lg) << "cannot read parent of " << path;
+		return -EIO;
+	}
+	invalidate(path);
+
+	batch_t batch;
+
+	r->write(batch);
+	if (!dst->write(batch)) {
+		return -EIO;
+	}
+	if (!write(batch, true)) {
+		BOOST_LOG(lg) << "cannot commit " << path;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int FS::unlink(const std::string & path)
+{
+	entry_ptr e = find(path);
+	if (!e) {
+		BOOST_LOG(lg) << "cannot unlink unexistent " << path;
+		return -ENOENT;
+	}
+
+	entry_ptr dst(e->parent);
+
+	if (!dst) {
+		BOOST_LOG(lg) << "cannot find dst " << path;
+		return -ENOENT;
+	}
+	LOG_DEBUG(lg) << "unlinked " << e->tostring();
+
+	// TODO: lock e and dst
+
+	batch_t batch;
+
+	if (!dst->remove_child(e)) {
+		BOOST_LOG(lg) << "cannot read parent of " << path;
+		return -EIO;
+	}
+	e->remove(batch);
+	invalidate(path);
+	if (!dst->write(batch)) {
+		return -EIO;
+	}
+
+	if (!write(batch, true)) {
+		BOOST_LOG(lg) << "cannot remove " << path;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int FS::rmdir(const std::string & path)
+{
+	entry_ptr e = find(path);
+	if (!e) {
+		BOOST_LOG(lg) << "not found " << path;
+		return -ENOENT;
+	}
+
+	dentry * d = dynamic_cast<dentry*>(e.get());
+	if (!d) {
+		return -ENOTDIR;
+	}
+	bool empty = false;
+	if (!d->empty(empty)) {
+		BOOST_LOG(lg) << "cannot read children of " << path;
+		return -EIO;
+	}
+	if (!empty) {
+		BOOST_LOG(lg) << "non empty dir " << path;
+		return -ENOTEMPTY;
+	}
+
+	entry_ptr parent(e->parent);
+	if (!parent) {
+		BOOST_LOG(lg) << "not found " << path;
+		return -ENOENT;
+	}
+	if (!parent->remove_child(e)) {
+		BOOST_LOG(lg) << "cannot read parent of " << path;
+		return -EIO;
+	}
+	invalidate(path);
+
+	batch_t batch;
+
+	if (!parent->write(batch)) {
+		return -EIO;
+	}
+	e->remove(batch);
+
+	if (!write(batch, true)) {
+		BOOST_LOG(lg) << "cannot commit " << path;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int FS::rename(const std::string & from, const std::string & to)
+{
+	entry_ptr src = find(from);
+	if (!src) {
+		BOOST_LOG(lg) << "not found " << from;
+		return -ENOENT;
+	}
+
+	batch_t batch;
+
+	entry_ptr dst = find(to);
+
+	entry_ptr src_parent(src->parent);
+	entry_ptr dst_parent = find_parent(to);
+	std::string new_name = filename(to);
+
+	if (!src_parent || !dst_parent) {
+		BOOST_LOG(lg) << "not found parent " << from;
+		return -ENOENT;
+	}
+
+	// every child list below is changed, read them before the first change
+	dentry * sp = dynamic_cast<dentry*>(src_parent.get());
+	dentry * dp = dynamic_cast<dentry*>(dst_parent.get());
+	if (!dp) {
+		return -ENOTDIR;
+	}
+	if (!sp || !sp->readable() || !dp->readable()) {
+		BOOST_LOG(lg) << "cannot read parents of " << from << " and " << to;
+		return -EIO;
+	}
+
+	if (dst) {
+		if (dst == src) {
+			BOOST_LOG(lg) << "cannot self copy " << from;
+			return -EINVAL;
+		}
+		dst->remove(batch);
+		dst_parent->remove_child(dst);
+	}
+
+	// TODO: locks
+
+	src_parent->remove_child(src);
+	src->name = new_name;
+	dst_parent->add_child(src);
+	// paths below a moved or replaced directory change too
+	bool subtree = dynamic_cast<dentry*>(src.get())
+		|| dynamic_cast<dentry*>(dst.get());
+	invalidate(from, subtree);
+	invalidate(to, subtree);
+
+	LOG_DEBUG(lg) << "renamed " << src->tostring();
+
+	if (!src_parent->write(batch) || !dst_parent->write(batch)) {
+		return -EIO;
+	}
+
+	if (!write(batch, true)) {
+		BOOST_LOG(lg) << "cannot commit " << from;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int FS::truncate(const std::string & path, off_t size)
+{
+	entry_ptr e = find(path);
+	if (!e) {
+		BOOST_LOG(lg) << "not found " << path;
+		return -ENOENT;
+	}
+
+	batch_t batch;
+
+	if (!e->truncate(batch, size)) {
+		BOOST_LOG(lg) << "cannot truncate " << path;
+		return -EIO;
+	}
+	// TODO: recovery?
+	bool status = write(batch, false);
+
+	LOG_DEBUG(lg) << "truncated " << e->tostring();
+
+	if (!status) {
+		BOOST_LOG(lg) << "cannot commit " << path;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+uint64_t FS::allocate_handle(const entry_ptr & r, struct fuse_file_info *fi)
 {
 	boost::unique_lock<boost::mutex> scoped_lock(mutex);
 	uint64_t fh = 0;
@@ -160,30 +719,128 @@ void FS::release_handle(uint64_t h)
 {
 	boost::unique_lock<boost::mutex> scoped_lock(mutex);
 	allocated_handles.erase(h);
-	boost::shared_ptr<entry> e = handles[h];
+	listings.erase(h);
+	entry_ptr e = handles[h];
 	handles[h].reset();
 	if (e) {
 		sync(e);
 	}
 }
 
-boost::shared_ptr<entry> FS::find_handle(uint64_t t)
+boost::shared_ptr<listing_t> FS::listing(uint64_t h, bool restart)
+{
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(mutex);
+		boost::unordered_map<uint64_t, boost::shared_ptr<listing_t> >::iterator it
+			= listings.find(h);
+		if (!restart && it != listings.end()) {
+			return it->second;
+		}
+	}
+
+	boost::shared_ptr<listing_t> names(new listing_t);
+	dentry * d = dynamic_cast<dentry*>(handles[h].get());
+	if (d) {
+		d->list(*names);
+	}
+
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	listings[h] = names;
+	return names;
+}
+
+entry_ptr FS::find_handle(uint64_t t)
 {
 	return handles[t];
 }
 
+int FS::buckets_count() const
+{
+	return parts + meta_parts;
+}
+
+std::string FS::part_dir(int i) const
+{
+	if (data_dirs.empty()) {
+		return dbroot;
+	}
+	return data_dirs[i % data_dirs.size()];
+}
+
+std::vector<std::string> FS::split_dirs(const std::string & dirs)
+{
+	// ':' separated, ',' is taken by the mount options
+	std::vector<std::string> r;
+	boost::algorithm::split(r, dirs, boost::algorithm::is_any_of(":"),
+	                        boost::algorithm::token_compress_on);
+	r.erase(std::remove(r.begin(), r.end(), std::string()), r.end());
+	// stored in fsmeta and used after fuse chdirs to /
+	for (size_t i = 0; i < r.size(); ++i) {
+		r[i] = boost::filesystem::absolute(r[i]).string();
+	}
+	return r;
+}
+
 int FS::part(const block_key & key)
 {
-	if (key.type == 'd' || key.type == 'm') {
+	if (key.type == 'd' && meta_parts > 1) {
+		uint64_t h = *((uint64_t*)key.inode);
+		if (inode64) {
+			h = be64toh(h);
+		}
+		int i = h % meta_parts;
+		return (i == 0) ? 0 : parts + i; // root stays in dentry
+	} else if (key.type == 'd' || key.type == 'm' || key.type == 'a' || key.type == 'i') {
 		return 0;
 	} else {
-		return *((uint64_t*)key.inode)%parts+1;
+		return data_part(key, parts, placement);
+	}
+}
+
+// Lamping, Veach: a fast, minimal memory, consistent hash algorithm
+static int jump_hash(uint64_t key, int buckets)
+{
+	int64_t b = -1, j = 0;
+	while (j < buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+	}
+	return (int)b;
+}
+
+int FS::data_part(const block_key & key, int parts, int placement) const
+{
+	if (key.type == 'h' || key.type == 'r') {
+		// dedup records carry the part of the inode that stored them,
+		// so refcounts land in the same WriteBatch as the block mapping.
+		// reshard moves them by that number, not with their inodes:
+		// afterwards older records sit in another part than the mappings
+		return ntohl(key.blockno)%parts+1;
+	}
+
+	uint64_t h = *((uint64_t*)key.inode);
+	if (inode64) {
+		// consecutive numbers, spread round robin
+		h = be64toh(h);
+	}
+
+	if (placement == proto::fsmeta::JUMP) {
+		return jump_hash(h, parts)+1;
+	} else {
+		return h%parts+1;
 	}
 }
 
 bool bucket::read(const block_key & key, std::string & value)
 {
-	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	boost::unique_lock<boost::mutex> scoped_lock(mutex, boost::defer_lock);
+	TRACE_LOCK(scoped_lock, "bucket::mutex");
+	return lookup(key, value);
+}
+
+bool bucket::lookup(const block_key & key, std::string & value)
+{
 //	fprintf(l, "read %p\n", this);
 	std::map<block_key, operation>::iterator it = batch.find(key);
 	if (it == batch.end()) {
@@ -194,7 +851,9 @@ bool bucket::read(const block_key & key, std::string & value)
 //		}
 		leveldb::ReadOptions readOptions;
 		leveldb::Status status;
-		status = db->Get(readOptions, leveldb::Slice((char*)&key, key.size()), &value);
+		char buf[sizeof(block_key)];
+		TRACE_SPAN("db->Get");
+		status = db->Get(readOptions, leveldb::Slice(buf, key.encode(buf, compact)), &value);
 //		if (!status.ok()) {
 //			fprintf(l, "not found on disk '%s'\n", key.tostring().c_str());
 //		}
@@ -213,27 +872,127 @@ bool bucket::read(const block_key & key, std::string & value)
 
 void bucket::add_op(const operation & op)
 {
-	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	boost::unique_lock<boost::mutex> scoped_lock(mutex, boost::defer_lock);
+	TRACE_LOCK(scoped_lock, "bucket::mutex");
 //	fprintf(l, "add op to %p \n", this);
-	batch.erase(op.key);
+	apply(op);
+}
+
+void bucket::add_ops(const batch_t & ops, uint64_t intent)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex, boost::defer_lock);
+	TRACE_LOCK(scoped_lock, "bucket::mutex");
+	for (size_t i = 0; i < ops.size(); ++i) {
+		apply(ops[i]);
+	}
+	// the marker lands in the same WriteBatch as the ops,
+	// replay skips intents the part has already seen
+	if (intent > marker) {
+		uuid_t zero;
+		memset(zero, 0, sizeof(zero));
+		marker = intent;
+		store(operation(block_key('w', zero), operation::PUT,
+		                std::string((char*)&marker, sizeof(marker))));
+	}
+}
+
+void bucket::apply(const operation & op)
+{
+	if (op.type == operation::ADDREF || op.type == operation::DECREF) {
+		refcount(op);
+	} else {
+		store(op);
+	}
+}
+
+bool bucket::replace(const block_key & key, const std::string & expected,
+                     const std::string & value)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex, boost::defer_lock);
+	TRACE_LOCK(scoped_lock, "bucket::mutex");
+	std::string current;
+	if (!lookup(key, current) || current != expected) {
+		return false;
+	}
+	store(operation(key, operation::PUT, value));
+	return true;
+}
+
+void bucket::store(const operation & op)
+{
+	std::map<block_key, operation>::iterator it = batch.find(op.key);
+	if (it != batch.end()) {
+		dirty -= it->second.data.size();
+		batch.erase(it);
+	}
 //	fprintf(l, "store in cache '%s' -> '%s'\n",
 //	        op.key.tostring().c_str(), op.data.c_str());
 	batch.insert(std::make_pair(op.key, op));
+	dirty += op.data.size();
+}
+
+void bucket::refcount(const operation & op)
+{
+	// op.key is the 'r' record, the block itself is 'h' with the same digest.
+	// ADDREF carries the block, it is stored only by the first reference.
+	block_key data_key(op.key);
+	data_key.type = 'h';
+
+	uint64_t count = 0;
+	std::string value;
+	if (lookup(op.key, value) && value.size() == sizeof(count)) {
+		memcpy(&count, value.data(), sizeof(count));
+	}
+
+	if (op.type == operation::ADDREF) {
+		if (count == 0) {
+			store(operation(data_key, operation::PUT, op.data));
+			unique += op.data.size();
+		}
+		count ++;
+	} else if (count > 0) {
+		count --;
+	}
+
+	if (count == 0) {
+		// the last reference went, the block is no longer unique data
+		std::string block;
+		if (op.type == operation::DECREF && lookup(data_key, block)) {
+			unique -= std::min(unique, block.size());
+		}
+		store(operation(op.key, operation::DELETE, std::string()));
+		store(operation(data_key, operation::DELETE, std::string()));
+	} else {
+		store(operation(op.key, operation::PUT,
+		                std::string((char*)&count, sizeof(count))));
+	}
 }
 
 size_t global_written = 0;
 static boost::mutex global_written_mutex;
 
-bool bucket::flush(unsigned char * inode)
+bool bucket::flush(unsigned char * inode, bool durable)
 {
 	boost::log::sources::severity_logger< >& lg = global_lg::get();
 	leveldb::WriteBatch b;
-	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	boost::unique_lock<boost::mutex> scoped_lock(mutex, boost::defer_lock);
+	TRACE_LOCK(scoped_lock, "bucket::mutex");
 
-	if (batch.empty()) {
+	// an empty synced write still syncs what went unsynced before
+	if (batch.empty() && !(durable && unsynced)) {
 		return true;
 	}
 
+	// a dirty marker goes with all ops of its intents, replay skips them
+	// once it is stored
+	if (inode && marker > 0) {
+		uuid_t zero;
+		memset(zero, 0, sizeof(zero));
+		if (batch.find(block_key('w', zero)) != batch.end()) {
+			inode = 0;
+		}
+	}
+
 	size_t written_local = 0;
 //	fprintf(l, "flush %p\n", this);
 
@@ -244,11 +1003,15 @@ bool bucket::flush(unsigned char * inode)
 	{
 		const block_key & key = it->first;
 		operation & op = it->second;
-		if (inode && memcmp(key.inode, inode, sizeof(key.inode)) != 0) {
+		// dedup records go with any sync, they back the synced mappings
+		if (inode && key.type != 'h' && key.type != 'r' &&
+		    memcmp(key.inode, inode, sizeof(key.inode)) != 0)
+		{
 //			BOOST_LOG(lg) << "skip key " << key.tostring();
 			continue;
 		}
-		leveldb::Slice slice((char*)&key, key.size());
+		char buf[sizeof(block_key)];
+		leveldb::Slice slice(buf, key.encode(buf, compact));
 		switch (op.type) {
 		case operation::DELETE:
 //			fprintf(l, "delete '%s' \n", key.tostring().c_str());
@@ -266,17 +1029,52 @@ bool bucket::flush(unsigned char * inode)
 		remove.insert(it->first);
 	}
 
+	uint64_t start = now_ns();
+
+	// pointers must not reach leveldb before the values they point to
+	if (log) {
+		TRACE_SPAN("vlog sync");
+		if (!log->sync()) {
+			BOOST_LOG(lg) << "cannot sync vlog " << log->dir;
+			return false;
+		}
+	}
+
+	// nor ops before their journal record
+	if (jlog) {
+		TRACE_SPAN("journal commit");
+		if (!jlog->commit(jlog->tail())) {
+			BOOST_LOG(lg) << "cannot commit journal " << jlog->dir;
+			return false;
+		}
+	}
+
 	leveldb::WriteOptions writeOptions;
-	writeOptions.sync = true;
+	writeOptions.sync = durable;
 	
 	sync = false;
 
 	leveldb::Status status;
-	status = db->Write(writeOptions, &b);
+	{
+		TRACE_SPAN("db->Write sync");
+		status = db->Write(writeOptions, &b);
+	}
+	if (status.ok()) {
+		unsynced = !durable;
+	}
 
 	for (std::set<block_key>::iterator it = remove.begin(); it != remove.end(); ++it)
 	{
-		batch.erase(*it);
+		std::map<block_key, operation>::iterator b = batch.find(*it);
+		dirty -= b->second.data.size();
+		batch.erase(b);
+	}
+
+	uint64_t ns = now_ns() - start;
+	flushes ++;
+	flush_ns += ns;
+	if (ns > flush_max_ns) {
+		flush_max_ns = ns; // racy max, stats only
 	}
 
 	written += written_local;
@@ -285,7 +1083,7 @@ bool bucket::flush(unsigned char * inode)
 		boost::unique_lock<boost::mutex> scoped_lock(global_written_mutex);
 		global_written += written_local; // TODO: lock
 	}
-	BOOST_LOG(lg) << " written: " << written
+	LOG_DEBUG(lg) << " written: " << written
 	              << " local: " << written_local
 	              << " total: " << global_written;
 
@@ -303,26 +1101,159 @@ bool FS::read(const block_key & key, std::string & value)
 	return buckets[part(key)].read(key, value);
 }
 
-bool FS::write(batch_t & batch, bool sync)
+static block_key intent_key(uint64_t seq)
 {
-	leveldb::WriteOptions writeOptions;
-	writeOptions.sync = sync;
-
-	leveldb::WriteBatch dbatch;
-	leveldb::WriteBatch fbatch;
+	uuid_t ino;
+	memset(ino, 0, sizeof(ino));
+	seq = htobe64(seq);
+	memcpy(ino, &seq, sizeof(seq));
+	return block_key('i', ino);
+}
 
-	leveldb::DB * db = 0;
-	leveldb::DB * fb = 0;
+// intents and journal records
+static std::string encode_ops(const batch_t & batch)
+{
+	proto::intent intent;
+	for (int i = 0; i < batch.size(); ++i) {
+		const operation & op = batch[i];
+		if (op.type != operation::PUT && op.type != operation::DELETE) {
+			continue;
+		}
+		proto::intent_op * o = intent.add_ops();
+		o->set_key((char*)&op.key, sizeof(op.key));
+		o->set_type(op.type);
+		o->set_data(op.data);
+	}
+	std::string value;
+	intent.SerializeToString(&value);
+	return value;
+}
 
+bool FS::write(batch_t & batch, bool sync)
+{
+	std::map<int, batch_t> split;
+	bool refcounted = false;
 	for (int i = 0; i < batch.size(); ++i) {
 		operation & op = batch[i];
-		bucket & b = buckets[part(op.key)];
-		b.add_op(op);
-		b.sync = sync;
+		split[part(op.key)].push_back(op);
+		refcounted |= op.type == operation::ADDREF || op.type == operation::DECREF;
+	}
+
+	if (jlog) {
+		// one record for all parts, the buckets get the ops in journal
+		// order and flush_part writes them unsynced
+		std::string value = encode_ops(batch);
+		uint64_t end = 0;
+		{
+			boost::unique_lock<boost::mutex> order_lock(intent_mutex, boost::defer_lock);
+			TRACE_LOCK(order_lock, "intent_mutex");
+			TRACE_SPAN("journal append");
+			if (!jlog->append(value, end)) {
+				BOOST_LOG(lg) << "cannot append to journal " << jlog->dir;
+				return false;
+			}
+			for (std::map<int, batch_t>::iterator it = split.begin(); it != split.end(); ++it) {
+				buckets[it->first].add_ops(it->second, 0);
+			}
+		}
+		// group commit, one fdatasync for every writer waiting
+		TRACE_SPAN("journal commit");
+		return !sync || jlog->commit(end);
+	}
+
+	// a synced op spanning parts (create, unlink, rename, a write with
+	// its size) is one synced intent in dentry, the parts are written
+	// unsynced after it. replay_intents finishes it after a crash,
+	// flush_buckets drops intents once the parts are synced.
+	// refcount ops are not idempotent and stay out of the intent: new
+	// references are synced before it, dropped ones follow it unsynced.
+	// a crash between them leaks blocks, it never frees a used one
+	std::map<int, batch_t> decrefs;
+	if (sync && split.size() > 1 && refcounted) {
+		std::map<int, batch_t> rest;
+		for (std::map<int, batch_t>::iterator it = split.begin(); it != split.end(); ++it) {
+			batch_t addrefs;
+			for (int i = 0; i < it->second.size(); ++i) {
+				const operation & op = it->second[i];
+				if (op.type == operation::ADDREF) {
+					addrefs.push_back(op);
+				} else if (op.type == operation::DECREF) {
+					decrefs[it->first].push_back(op);
+				} else {
+					rest[it->first].push_back(op);
+				}
+			}
+			if (!addrefs.empty()) {
+				buckets[it->first].add_ops(addrefs, 0);
+				if (!buckets[it->first].flush(0)) {
+					return false;
+				}
+			}
+		}
+		split.swap(rest);
+	}
+
+	uint64_t seq = 0;
+	// parts see intents in sequence order, so one marker per part is enough
+	boost::unique_lock<boost::mutex> intent_lock(intent_mutex, boost::defer_lock);
+	if (sync && split.size() > 1) {
+		// replay installs the vlog pointers of the intent, the values
+		// they point to must be on disk before it, as in bucket::flush
+		for (std::map<int, batch_t>::iterator it = split.begin(); it != split.end(); ++it) {
+			vlog * log = buckets[it->first].log;
+			bool pointers = false;
+			vlog::pointer ptr;
+			for (int i = 0; log && !pointers && i < it->second.size(); ++i) {
+				pointers = vlog::decode(it->second[i].data, ptr);
+			}
+			if (pointers) {
+				TRACE_SPAN("vlog sync");
+				if (!log->sync()) {
+					BOOST_LOG(lg) << "cannot sync vlog " << log->dir;
+					return false;
+				}
+			}
+		}
+
+		std::string value = encode_ops(batch);
+
+		TRACE_LOCK(intent_lock, "intent_mutex");
+		seq = ++intent_seq;
+		block_key ikey = intent_key(seq);
+		char buf[sizeof(block_key)];
+		leveldb::WriteOptions writeOptions;
+		writeOptions.sync = true;
+		TRACE_SPAN("intent put");
+		leveldb::Status status = buckets[0].db->Put(writeOptions,
+			leveldb::Slice(buf, ikey.encode(buf, inode64)), value);
+		if (!status.ok()) {
+			BOOST_LOG(lg) << "cannot write intent " << status.ToString();
+			return false;
+		}
+	}
+
+	for (std::map<int, batch_t>::iterator it = split.begin(); it != split.end(); ++it) {
+		bucket & b = buckets[it->first];
+		b.add_ops(it->second, seq);
+		b.sync = sync && !seq;
+	}
+	if (seq) {
+		intent_lock.unlock();
+	}
+	for (std::map<int, batch_t>::iterator it = decrefs.begin(); it != decrefs.end(); ++it) {
+		buckets[it->first].add_ops(it->second, 0);
 	}
 
 	bool ret = true;
-	for (int i = 0; i < parts+1; ++i) {
+	if (seq) {
+		// the intent is the sync, parts get it with flush_part
+		for (std::map<int, batch_t>::iterator it = split.begin(); it != split.end(); ++it) {
+			ret &= buckets[it->first].flush(0, false);
+		}
+		return ret;
+	}
+
+	for (int i = 0; i < buckets_count(); ++i) {
 		if (buckets[i].sync) {
 			ret &= buckets[i].flush(0);
 		}
@@ -332,8 +1263,83 @@ bool FS::write(batch_t & batch, bool sync)
 	return ret;
 }
 
-bool FS::sync(const boost::shared_ptr<entry> & e)
+void FS::replay_intents()
+{
+	leveldb::Iterator * it = buckets[0].db->NewIterator(leveldb::ReadOptions());
+	int replayed = 0;
+	for (it->Seek("i"); it->Valid() && it->key().data()[0] == 'i'; it->Next()) {
+		uint64_t seq;
+		memcpy(&seq, it->key().data() + 1, sizeof(seq));
+		seq = be64toh(seq);
+		intent_seq = std::max(intent_seq, seq);
+
+		proto::intent intent;
+		if (!intent.ParseFromArray(it->value().data(), it->value().size())) {
+			BOOST_LOG(lg) << "cannot parse intent " << seq;
+			continue;
+		}
+
+		std::map<int, batch_t> split;
+		for (int i = 0; i < intent.ops_size(); ++i) {
+			const proto::intent_op & o = intent.ops(i);
+			if (o.key().size() != sizeof(block_key)) {
+				continue;
+			}
+			block_key key(*(const block_key*)o.key().data());
+			split[part(key)].push_back(operation(key, o.type(), o.data()));
+		}
+
+		for (std::map<int, batch_t>::iterator j = split.begin(); j != split.end(); ++j) {
+			bucket & b = buckets[j->first];
+			if (b.marker < seq) {
+				b.add_ops(j->second, seq);
+			}
+		}
+		replayed ++;
+	}
+	delete it;
+
+	// one synced write per part for all of them
+	bool ok = true;
+	for (int i = 0; i < buckets_count(); ++i) {
+		ok &= buckets[i].flush(0);
+	}
+	if (ok) {
+		drop_intents(intent_seq);
+	}
+
+	if (replayed > 0) {
+		BOOST_LOG(lg) << "replayed intents: " << replayed;
+	}
+}
+
+void FS::drop_intents(uint64_t seq)
 {
+	// markers are durable, losing these deletes only costs a replay
+	leveldb::WriteBatch b;
+	block_key last = intent_key(seq);
+	char end[sizeof(block_key)];
+	leveldb::Slice limit(end, last.encode(end, inode64));
+	leveldb::Iterator * it = buckets[0].db->NewIterator(leveldb::ReadOptions());
+	for (it->Seek("i"); it->Valid() && it->key().data()[0] == 'i'
+	     && it->key().compare(limit) <= 0; it->Next())
+	{
+		b.Delete(it->key());
+	}
+	delete it;
+	buckets[0].db->Write(leveldb::WriteOptions(), &b);
+	intent_synced = seq;
+}
+
+bool FS::sync(const entry_ptr & e)
+{
+	if (e->type == 'v') {
+		return true;
+	}
+	if (jlog) {
+		// everything appended so far, the file's ops included
+		return jlog->commit(jlog->tail());
+	}
 	block_key key(e->type, e->inode, 0);
 	bucket & b = buckets[part(key)];
 	return b.flush(e->inode);
@@ -341,25 +1347,257 @@ bool FS::sync(const boost::shared_ptr<entry> & e)
 
 void FS::flush_job()
 {
-	bool running = true; // TODO:
-	while (running) {
-		// TODO: commit interval
-		boost::this_thread::sleep(boost::posix_time::milliseconds(5000));
-		flush_buckets();
+	for (int round = 1; wait_running(5000); ++round) {
+		dedup_stats();
+		shrink();
+		log_flush();
+		// checkpoint, racy reads: a late one only keeps more journal
+		// or intents
+		if (jlog && (jlog->head_size >= jlog->segment_size || round % 6 == 0)) {
+			flush_buckets();
+		} else if (intent_seq > intent_synced
+		           && (intent_seq - intent_synced >= 65536 || round % 6 == 0))
+		{
+			flush_buckets();
+		}
+		if (vlogs && round % 12 == 0) {
+			collect_vlogs();
+		}
+	}
+}
+
+void FS::touch(dentry * d)
+{
+	if (max_entries == 0) {
+		return;
+	}
+
+	// lock free on every path component but the first one
+	if (!d->in_lru) {
+		boost::unique_lock<boost::mutex> scoped_lock(lru_mutex);
+		if (!d->in_lru) {
+			lru.push_front(d);
+			d->lru_pos = lru.begin();
+			d->in_lru = true;
+		}
+	} else if (!d->referenced) {
+		d->referenced = true;
+	}
+
+	if (nodes > max_entries) {
+		shrink();
+	}
+}
+
+void FS::forget(dentry * d)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(lru_mutex);
+	if (d->in_lru) {
+		lru.erase(d->lru_pos);
+		d->in_lru = false;
 	}
 }
 
+void FS::shrink()
+{
+	if (max_entries == 0 || nodes <= max_entries) {
+		return;
+	}
+
+	// one shrinker at a time, the others go on with their lookups
+	boost::unique_lock<boost::mutex> shrink_lock(shrink_mutex, boost::try_to_lock);
+	if (!shrink_lock.owns_lock()) {
+		return;
+	}
+
+	// cached lookups hold references, nothing could be evicted
+	paths.clear();
+
+	size_t target = max_entries - max_entries / 10;
+	size_t attempts = 0;
+	size_t before = nodes;
+	while (nodes > target) {
+		boost::intrusive_ptr<dentry> victim;
+		{
+			boost::unique_lock<boost::mutex> scoped_lock(lru_mutex);
+			// twice around: once to clear referenced, once to evict
+			if (lru.empty() || attempts++ >= 2 * lru.size()) {
+				break;
+			}
+			// pinned and recently used ones rotate to the front
+			dentry * d = lru.back();
+			lru.splice(lru.begin(), lru, d->lru_pos);
+			d->lru_pos = lru.begin();
+			if (d->referenced) {
+				d->referenced = false;
+				continue;
+			}
+
+			// ~dentry waits for lru_mutex, a dying one has no refs left
+			int refs = d->refs;
+			while (refs > 0 && !d->refs.compare_exchange_weak(refs, refs + 1));
+			if (refs == 0) {
+				continue;
+			}
+			victim = boost::intrusive_ptr<dentry>(d, false);
+		}
+
+		if (victim->evict()) {
+			forget(victim.get());
+			evicted ++;
+		}
+	}
+
+	BOOST_LOG(lg) << "namespace shrink: " << before << " -> " << nodes
+	              << " entries, evicted dirs " << evicted;
+}
+
+void FS::flush_part(int i)
+{
+	// one thread per part, a slow sync does not delay the others
+	// TODO: commit interval
+	while (wait_running(5000)) {
+		// journaled ops are durable already, leave the sync to checkpoints
+		buckets[i].flush(0, !jlog);
+	}
+}
+
+bool FS::wait_running(int ms)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(stop_mutex);
+	boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(ms);
+	while (!stopping) {
+		if (!stop_cond.timed_wait(scoped_lock, deadline)) {
+			break;
+		}
+	}
+	return !stopping;
+}
+
 void FS::flush_buckets()
 {
-	for (int i = 0; i <= parts; ++i) {
+	// records before the rotation and intents up to seq have their ops
+	// in the buckets, they go once the parts are synced
+	uint32_t last = 0;
+	bool rotated = false;
+	uint64_t seq = 0;
+	{
+		boost::unique_lock<boost::mutex> order_lock(intent_mutex, boost::defer_lock);
+		TRACE_LOCK(order_lock, "intent_mutex");
+		seq = intent_seq;
+		if (jlog) {
+			rotated = jlog->rotate(last);
+		}
+	}
+
+	bool ok = true;
+	for (int i = 0; i < buckets_count(); ++i) {
 		bucket & b = buckets[i];
-		b.flush(0);
+		ok &= b.flush(0);
+	}
+
+	if (rotated && ok) {
+		jlog->drop(last);
+	}
+	if (seq > intent_synced && ok) {
+		drop_intents(seq);
+	}
+
+	dedup_stats();
+}
+
+void FS::dedup_stats()
+{
+	if (dedup && dedup_logical > 0) {
+		size_t unique = 0;
+		for (int i = 0; i <= parts; ++i) {
+			unique += buckets[i].unique;
+		}
+		BOOST_LOG(lg) << "dedup ratio: "
+		              << (double)dedup_logical / std::max(unique, (size_t)1)
+		              << " hashed: " << hash_bytes
+		              << " hash MB/s: "
+		              << (double)hash_bytes * 1000 / std::max((uint64_t)hash_ns, (uint64_t)1);
+	}
+}
+
+std::string FS::stats()
+{
+	std::ostringstream out;
+
+	out << ops_report() << "\n";
+
+	out << "part   dirty_bytes      written    flushes  mean_flush_ms  max_flush_ms\n";
+	for (int i = 0; i < buckets_count(); ++i) {
+		bucket & b = buckets[i];
+		uint64_t n = b.flushes;
+		char line[256];
+		snprintf(line, sizeof(line), "%4d %13llu %12llu %10llu %14.2f %13.2f\n",
+		         i, (unsigned long long)b.dirty, (unsigned long long)b.written,
+		         (unsigned long long)n, (n) ? b.flush_ns / 1e6 / n : 0.0,
+		         b.flush_max_ns / 1e6);
+		out << line;
+	}
+	out << "\n";
+
+	uint64_t hits = paths.hits, misses = paths.misses;
+	size_t handles_count;
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(mutex);
+		handles_count = allocated_handles.size();
+	}
+	out << "path cache: hits " << hits << ", misses " << misses
+	    << ", ratio " << (double)hits / std::max(hits + misses, (uint64_t)1) << "\n";
+	out << "entries: " << nodes << ", evicted dirs " << evicted
+	    << ", max " << max_entries << "\n";
+	out << "names: " << name_t::count() << ", bytes " << name_t::bytes() << "\n";
+	out << "open handles: " << handles_count << "\n";
+	if (jlog) {
+		boost::unique_lock<boost::mutex> scoped_lock(jlog->mutex);
+		out << "journal: records " << jlog->records << ", bytes " << jlog->written
+		    << ", commits " << jlog->commits << ", syncs " << jlog->syncs
+		    << ", segment " << jlog->head << "\n";
+	}
+	if (dedup) {
+		out << "dedup: logical " << dedup_logical << ", hashed " << hash_bytes << "\n";
+	}
+
+	for (int i = 0; i < buckets_count(); ++i) {
+		std::string s;
+		if (buckets[i].db->GetProperty("leveldb.stats", &s)) {
+			out << "\nleveldb part " << i << ":\n" << s;
+		}
+	}
+
+	return out.str();
+}
+
+void FS::collect_vlogs()
+{
+	for (int i = 0; i < parts; ++i) {
+		uint64_t reclaimed = vlogs[i].collect(buckets[i+1], 0.5);
+		if (reclaimed > 0) {
+			BOOST_LOG(lg) << "vlog " << vlogs[i].dir << " reclaimed: " << reclaimed
+			              << " appended: " << vlogs[i].appended
+			              << " rewritten: " << vlogs[i].collected;
+		}
 	}
 }
 
 void FS::umount()
 {
+	// the flush threads use this FS, they go before it does
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(stop_mutex);
+		stopping = true;
+		stop_cond.notify_all();
+	}
+	part_threads.join_all();
+	if (flush_thread.joinable()) {
+		flush_thread.join();
+	}
+
 	flush_buckets();
-	// TODO: close all
+	// TODO: close the dbs
 }
 
@@ -10,26 +10,56 @@
 
 #include <vector>
 #include <boost/unordered_set.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/atomic.hpp>
 #include <map>
+#include <list>
 
 #include "dentry.h"
-
-BOOST_LOG_INLINE_GLOBAL_LOGGER_DEFAULT(global_lg, boost::log::sources::severity_logger< >);
+#include "vlog.h"
+#include "journal.h"
+#include "pathcache.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
 
 struct bucket
 {
-	size_t written;
+	size_t unique; // bytes of new dedup blocks
+	// for stats, read without the mutex
+	boost::atomic<uint64_t> written;
+	boost::atomic<uint64_t> dirty; // bytes in batch
+	boost::atomic<uint64_t> flushes;
+	boost::atomic<uint64_t> flush_ns;
+	boost::atomic<uint64_t> flush_max_ns;
 	boost::mutex mutex;
 	leveldb::DB * db;
+	vlog * log; // synced before every flush when set
+	journal * jlog; // committed before every flush when set
+	bool unsynced; // written without sync since the last synced flush
 	std::map<block_key, operation> batch;
 	bool sync;
+	bool compact; // block_key::encode mode
+	uint64_t marker; // last intent applied, 'w' key
 	bool read(const block_key & key, std::string & value);
 	void add_op(const operation & op);
-	bool flush(unsigned char * inode);
-	bucket(): written(0) {}
+	void add_ops(const batch_t & ops, uint64_t intent);
+	bool replace(const block_key & key, const std::string & expected,
+	             const std::string & value);
+	// durable: false only when the journal or an intent has the ops
+	bool flush(unsigned char * inode, bool durable = true);
+	bucket(): unique(0), written(0), dirty(0), flushes(0), flush_ns(0), flush_max_ns(0),
+		log(0), jlog(0), unsynced(false), compact(false), marker(0) {}
+
+private:
+	// callers hold mutex
+	bool lookup(const block_key & key, std::string & value);
+	void store(const operation & op);
+	void refcount(const operation & op);
+	void apply(const operation & op);
 };
 
 struct FS
@@ -37,29 +67,98 @@ struct FS
 	boost::log::sources::severity_logger< >& lg;
 	boost::mutex mutex;
 	boost::thread flush_thread;
+	boost::thread_group part_threads;
+	// umount wakes and joins the threads above
+	boost::mutex stop_mutex;
+	boost::condition_variable stop_cond;
+	bool stopping;
 
 	int maxhandles;
 	int blocksize;
 	std::string dbroot;
 
+	// proto::fsmeta::compression, chosen at mkfs
+	int dentry_compression;
+	int data_compression;
+	bool dedup;
+	uint32_t vlog_min_size;
+	uint32_t extent_size;
+	bool inode64;
+	bool flat_dirs; // directories are written as dir_record
+	int meta_parts; // directory records, bucket 0 and parts+1..
+	int placement;  // proto::fsmeta::placement of data keys
+	bool journaled; // all writes go through jlog
+	int reshard_parts; // target of an unfinished reshard.ldbfs, 0: none
+
+	// data parts and vlogs are striped over, set before mount to override
+	std::vector<std::string> data_dirs;
+
+	// data parts are opened with
+	leveldb::Options data_options;
+
+	// inode numbers, up to reserved_inode are persisted in 'a'. they are
+	// the keys of inode64 filesystems and st_ino of uuid ones
+	boost::mutex inode_mutex;
+	uint64_t next_inode;
+	uint64_t reserved_inode;
+
+	// cross part batches and journal order, see FS::write
+	boost::mutex intent_mutex;
+	uint64_t intent_seq;
+	uint64_t intent_synced; // intents up to here are on synced parts
+
+	// dedup counters
+	boost::atomic<uint64_t> dedup_logical;
+	boost::atomic<uint64_t> hash_bytes;
+	boost::atomic<uint64_t> hash_ns;
+
+	// in-memory namespace cap, 0: unlimited
+	size_t max_entries;
+	boost::atomic<size_t> nodes;
+	boost::atomic<size_t> evicted;
+	boost::mutex lru_mutex;
+	boost::mutex shrink_mutex;
+	// loaded directories, newest first. lookups only set
+	// dentry::referenced, shrink gives those a second round
+	std::list<dentry*> lru;
+
+	// FS::find results, cleared by shrink since it pins entries
+	path_cache paths;
+
 	// opened files
-	std::vector<boost::shared_ptr<entry> > handles;
+	std::vector<entry_ptr > handles;
 
 	int parts;
 	bucket * buckets;
+	vlog * vlogs; // per data part, when vlog_min_size is set
+	journal * jlog; // when journaled
 
 	boost::unordered_set<uint64_t> allocated_handles;
 
-	boost::shared_ptr<dentry> root;
+	// readdir cursors, per directory handle
+	boost::unordered_map<uint64_t, boost::shared_ptr<listing_t> > listings;
 
-	boost::shared_ptr<entry> find(const std::string & path);
-	boost::shared_ptr<entry> find_parent(const std::string & path);
-	boost::shared_ptr<entry> find_handle(uint64_t t);
+	boost::intrusive_ptr<dentry> root;
+
+	entry_ptr find(const std::string & path);
+	entry_ptr find_parent(const std::string & path);
+	entry_ptr find_handle(uint64_t t);
 	std::string filename(const std::string & path);
+	// after a namespace change of path; subtree: a directory moved
+	void invalidate(const std::string & path, bool subtree = false);
 
-	uint64_t allocate_handle(const boost::shared_ptr<entry> & r, struct fuse_file_info *fi);
+	uint64_t allocate_handle(const entry_ptr & r, struct fuse_file_info *fi);
 	void release_handle(uint64_t h);
-	
+	// names of an open directory, taken again on restart
+	boost::shared_ptr<listing_t> listing(uint64_t h, bool restart);
+
+	// namespace operations without fuse, 0 or -errno
+	int create(const std::string & path, entry_ptr & r);
+	int mkdir(const std::string & path);
+	int unlink(const std::string & path);
+	int rmdir(const std::string & path);
+	int rename(const std::string & from, const std::string & to);
+	int truncate(const std::string & path, off_t size);
 
 	bool write(batch_t & batch, bool sync = false);
 	bool read(const block_key & key, std::string & value);
@@ -69,12 +168,37 @@ struct FS
 	void open(bool create);
 
 	int part(const block_key & key);
-	bool sync(const boost::shared_ptr<entry> & e);
+	int data_part(const block_key & key, int parts, int placement) const;
+	int buckets_count() const;
+	std::string part_dir(int i) const;
+	bool sync(const entry_ptr & e);
+
+	bool tagged_blocks() const;
+
+	bool allocate_inode(entry * e);
+	uint64_t inode_number(const entry * e);
+
+	static int compression_type(const std::string & name);
+	static const char * compression_name(int type);
+	static int placement_type(const std::string & name);
+	static std::vector<std::string> split_dirs(const std::string & dirs);
 
 
 	void umount();
+	void touch(dentry * d);
+	void forget(dentry * d);
+	void shrink();
+
 	void flush_buckets();
+	void collect_vlogs();
 	void flush_job();
+	void flush_part(int i);
+	// sleeps ms, false once umount has begun
+	bool wait_running(int ms);
+	void replay_intents();
+	void drop_intents(uint64_t seq);
+	void dedup_stats();
+	std::string stats(); // /.ldbfs/stats
 
 	FS(const std::string & dbpath);
 };
@@ -0,0 +1,139 @@
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hash.h"
+
+// stripe accumulation and scrambling follow the xxh3 long-input scheme
+
+static const uint64_t prime32 = 0x9E3779B1ULL;
+static const uint64_t prime64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+
+static const uint64_t secret[8] = {
+	0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL,
+	0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+	0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+	0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL
+};
+
+enum {
+	stripe = 64,
+	stripes_per_scramble = 16
+};
+
+#ifdef __SSE2__
+
+static void accumulate(uint64_t acc[8], const char * p)
+{
+	__m128i * a = (__m128i *)acc;
+	const __m128i * s = (const __m128i *)secret;
+	for (int i = 0; i < 4; ++i) {
+		__m128i d = _mm_loadu_si128((const __m128i *)p + i);
+		__m128i k = _mm_xor_si128(d, _mm_loadu_si128(s + i));
+		// lo32(k) * hi32(k) per 64-bit lane
+		__m128i khi = _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1));
+		__m128i prod = _mm_mul_epu32(k, khi);
+		__m128i swap = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+		__m128i v = _mm_loadu_si128(a + i);
+		v = _mm_add_epi64(v, _mm_add_epi64(prod, swap));
+		_mm_storeu_si128(a + i, v);
+	}
+}
+
+static void scramble(uint64_t acc[8])
+{
+	__m128i * a = (__m128i *)acc;
+	const __m128i * s = (const __m128i *)secret;
+	const __m128i p = _mm_set1_epi32((int)prime32);
+	for (int i = 0; i < 4; ++i) {
+		__m128i v = _mm_loadu_si128(a + i);
+		v = _mm_xor_si128(v, _mm_srli_epi64(v, 47));
+		v = _mm_xor_si128(v, _mm_loadu_si128(s + i));
+		// 64x32 multiply from two 32x32->64 products
+		__m128i hi = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 0, 1));
+		__m128i lo_p = _mm_mul_epu32(v, p);
+		__m128i hi_p = _mm_mul_epu32(hi, p);
+		v = _mm_add_epi64(lo_p, _mm_slli_epi64(hi_p, 32));
+		_mm_storeu_si128(a + i, v);
+	}
+}
+
+#else
+
+static void accumulate(uint64_t acc[8], const char * p)
+{
+	uint64_t d[8];
+	memcpy(d, p, sizeof(d));
+	for (int i = 0; i < 8; ++i) {
+		uint64_t k = d[i] ^ secret[i];
+		acc[i] += (k & 0xffffffffULL) * (k >> 32) + d[i ^ 1];
+	}
+}
+
+static void scramble(uint64_t acc[8])
+{
+	for (int i = 0; i < 8; ++i) {
+		uint64_t v = acc[i];
+		v ^= v >> 47;
+		v ^= secret[i];
+		acc[i] = v * prime32;
+	}
+}
+
+#endif
+
+static uint64_t mix(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint64_t avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+void hash128(const char * buf, size_t size, unsigned char digest[16])
+{
+	uint64_t acc[8] = {
+		prime32, prime64_1, prime64_2, 0x165667B19E3779F9ULL,
+		0x85EBCA77C2B2AE63ULL, 0x27D4EB2F165667C5ULL, prime64_2, prime32
+	};
+
+	const char * p = buf;
+	const char * end = buf + size;
+	size_t n = 0;
+
+	for (; end - p >= stripe; p += stripe) {
+		accumulate(acc, p);
+		if (++n % stripes_per_scramble == 0) {
+			scramble(acc);
+		}
+	}
+
+	if (p != end) {
+		char last[stripe];
+		memset(last, 0, sizeof(last));
+		memcpy(last, p, end - p);
+		accumulate(acc, last);
+	}
+
+	uint64_t h1 = size * prime64_1;
+	uint64_t h2 = ~((uint64_t)size * prime64_2);
+	for (int i = 0; i < 8; i += 2) {
+		h1 += mix(acc[i] ^ secret[i], acc[i + 1] ^ secret[i + 1]);
+		h2 += mix(acc[i] ^ secret[7 - i], acc[i + 1] ^ secret[6 - i]);
+	}
+
+	h1 = avalanche(h1);
+	h2 = avalanche(h2);
+	memcpy(digest, &h1, 8);
+	memcpy(digest + 8, &h2, 8);
+}
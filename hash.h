@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+
+// 128-bit content hash for block deduplication.
+// 8 independent 64-bit lanes per 64-byte stripe, SSE2 on x86-64,
+// portable fallback produces identical digests.
+void hash128(const char * buf, size_t size, unsigned char digest[16]);
@@ -0,0 +1,246 @@
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include <set>
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+
+#include "messages.pb.h"
+#include "journal.h"
+#include "fs.h"
+
+static const uint32_t journal_magic = 0x6c6e726a;
+
+static std::string segment_name(const std::string & dir, uint32_t id)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "/%08u.log", id);
+	return dir + buf;
+}
+
+static uint32_t checksum(const char * data, size_t size)
+{
+	boost::crc_32_type crc;
+	crc.process_bytes(data, size);
+	return crc.checksum();
+}
+
+journal::journal(): fd(-1), head(0), head_size(0), written(0), synced(0),
+	syncing(false), segment_size(64*1024*1024), records(0), commits(0), syncs(0)
+{
+}
+
+journal::~journal()
+{
+	if (fd >= 0) {
+		::close(fd);
+	}
+}
+
+bool journal::open(const std::string & dir)
+{
+	boost::log::sources::severity_logger< >& lg = global_lg::get();
+	boost::system::error_code ec;
+
+	this->dir = dir;
+	boost::filesystem::create_directories(dir, ec);
+	if (ec) {
+		BOOST_LOG(lg) << "cannot create journal " << dir << ": " << ec.message();
+		return false;
+	}
+
+	boost::filesystem::directory_iterator it(dir), end;
+	for (; it != end; ++it) {
+		uint32_t id;
+		std::string name = it->path().filename().string();
+		if (sscanf(name.c_str(), "%08u.log", &id) == 1) {
+			head = std::max(head, id);
+		}
+	}
+
+	// never append after a possibly torn tail, the old segments
+	// stay until replay
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	return rotate(scoped_lock);
+}
+
+bool journal::rotate(boost::unique_lock<boost::mutex> & scoped_lock)
+{
+	// a group commit may still use fd
+	while (syncing) {
+		synced_cond.wait(scoped_lock);
+	}
+
+	if (fd >= 0) {
+		if (fdatasync(fd) != 0) {
+			return false;
+		}
+		::close(fd);
+		fd = -1;
+		synced = written;
+	}
+
+	uint32_t id = head + 1;
+	fd = ::open(segment_name(dir, id).c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+	if (fd < 0) {
+		return false;
+	}
+
+	int dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dirfd >= 0) {
+		fsync(dirfd);
+		::close(dirfd);
+	}
+
+	head = id;
+	head_size = 0;
+	return true;
+}
+
+bool journal::rotate(uint32_t & last)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	last = head;
+	return rotate(scoped_lock);
+}
+
+void journal::drop(uint32_t last)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	boost::filesystem::directory_iterator it(dir), end;
+	for (; it != end; ++it) {
+		uint32_t id;
+		std::string name = it->path().filename().string();
+		if (sscanf(name.c_str(), "%08u.log", &id) == 1 && id <= last && id != head) {
+			boost::system::error_code ec;
+			boost::filesystem::remove(it->path(), ec);
+		}
+	}
+}
+
+bool journal::append(const std::string & record, uint64_t & end)
+{
+	header h;
+	h.magic = journal_magic;
+	h.length = record.size();
+	h.crc = checksum(record.data(), record.size());
+
+	struct iovec iov[2];
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = (void*)record.data();
+	iov[1].iov_len = record.size();
+
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	ssize_t n = writev(fd, iov, 2);
+	if (n != (ssize_t)(sizeof(h) + record.size())) {
+		return false;
+	}
+
+	head_size += n;
+	written += n;
+	records ++;
+	end = written;
+	return true;
+}
+
+bool journal::commit(uint64_t end)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	commits ++;
+	while (synced < end) {
+		if (syncing) {
+			// the running sync may not cover end, check again
+			synced_cond.wait(scoped_lock);
+			continue;
+		}
+
+		// one fdatasync for everything appended so far
+		syncing = true;
+		uint64_t target = written;
+		int f = fd;
+		scoped_lock.unlock();
+		bool ok = fdatasync(f) == 0;
+		scoped_lock.lock();
+		syncing = false;
+		syncs ++;
+		if (ok && target > synced) {
+			synced = target;
+		}
+		synced_cond.notify_all();
+		if (!ok) {
+			return false;
+		}
+	}
+	return true;
+}
+
+uint64_t journal::tail()
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	return written;
+}
+
+int journal::replay(FS & fs)
+{
+	boost::log::sources::severity_logger< >& lg = global_lg::get();
+
+	std::set<uint32_t> ids;
+	boost::filesystem::directory_iterator it(dir), end;
+	for (; it != end; ++it) {
+		uint32_t id;
+		std::string name = it->path().filename().string();
+		if (sscanf(name.c_str(), "%08u.log", &id) == 1 && id < head) {
+			ids.insert(id);
+		}
+	}
+
+	int replayed = 0;
+	for (std::set<uint32_t>::iterator i = ids.begin(); i != ids.end(); ++i) {
+		int f = ::open(segment_name(dir, *i).c_str(), O_RDONLY);
+		if (f < 0) {
+			BOOST_LOG(lg) << "cannot open journal segment " << *i;
+			continue;
+		}
+
+		header h;
+		std::string data;
+		uint64_t off = 0;
+		while (pread(f, &h, sizeof(h), off) == sizeof(h) && h.magic == journal_magic) {
+			data.resize(h.length);
+			if (pread(f, &data[0], h.length, off + sizeof(h)) != (ssize_t)h.length
+			    || checksum(data.data(), data.size()) != h.crc)
+			{
+				break; // torn tail
+			}
+
+			proto::intent record;
+			if (!record.ParseFromString(data)) {
+				BOOST_LOG(lg) << "cannot parse journal record at " << off;
+				break;
+			}
+
+			std::map<int, batch_t> split;
+			for (int k = 0; k < record.ops_size(); ++k) {
+				const proto::intent_op & o = record.ops(k);
+				if (o.key().size() != sizeof(block_key)) {
+					continue;
+				}
+				block_key key(*(const block_key*)o.key().data());
+				split[fs.part(key)].push_back(operation(key, o.type(), o.data()));
+			}
+			for (std::map<int, batch_t>::iterator j = split.begin(); j != split.end(); ++j) {
+				fs.buckets[j->first].add_ops(j->second, 0);
+			}
+
+			off += sizeof(h) + h.length;
+			replayed ++;
+		}
+		::close(f);
+	}
+
+	return replayed;
+}
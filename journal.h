@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+struct FS;
+
+// write-ahead journal of all parts: every FS::write is one record,
+// appended before its ops reach the buckets. synced ops wait for one
+// group commit instead of a synced write per part, parts are written
+// unsynced and replayed from here on mount
+struct journal
+{
+#pragma pack (push, 1)
+	struct header
+	{
+		uint32_t magic;
+		uint32_t length;
+		uint32_t crc;
+	};
+#pragma pack ( pop)
+
+	std::string dir;
+	boost::mutex mutex;
+	boost::condition_variable synced_cond;
+	int fd;            // head segment
+	uint32_t head;
+	uint64_t head_size;
+	uint64_t written;  // bytes appended since open, over all segments
+	uint64_t synced;   // of written, known durable
+	bool syncing;
+	uint64_t segment_size; // FS::flush_job checkpoints after that
+
+	// stats
+	uint64_t records;
+	uint64_t commits;
+	uint64_t syncs;
+
+	journal();
+	~journal();
+
+	bool open(const std::string & dir);
+	// end: pass to commit to wait for this record
+	bool append(const std::string & record, uint64_t & end);
+	bool commit(uint64_t end);
+	uint64_t tail();
+
+	// seals the head, its records are durable once the buckets are
+	// flushed with sync; then drop(last) removes it and older segments
+	bool rotate(uint32_t & last);
+	void drop(uint32_t last);
+
+	// applies the records of segments before head to the buckets
+	int replay(FS & fs);
+
+private:
+	bool rotate(boost::unique_lock<boost::mutex> & scoped_lock);
+};
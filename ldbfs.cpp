@@ -28,6 +28,7 @@
 #include <boost/unordered_map.hpp>
 #include <boost/unordered_set.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/log/utility/setup/console.hpp>
 #include <boost/log/utility/setup/file.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
@@ -74,31 +75,70 @@ static FS * fs;
 
 
 std::string dbpath;
+std::vector<std::string> data_dirs; // overrides the dirs recorded at mkfs
+size_t max_entries = 0;
+long path_cache = -1; // entries, -1: default
+bool writeback = false;
+std::string trace_dump; // absolute, fuse chdirs to /
 boost::log::sources::severity_logger< >& lg = global_lg::get();
 
 static void * ldbfs_init(struct fuse_conn_info *conn) {
 //	conn->direct_io = 1;
 	conn->max_write = 32*1024*1024;
 	conn->want |= FUSE_CAP_BIG_WRITES;
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+	if (writeback) {
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	}
+#endif
+	// fuse_main has forked by now, threads of main are gone
+	log_start();
+	// kill -USR1 writes the trace rings, when built with LDBFS_TRACING
+	trace_dump_on_signal(trace_dump);
+
 	fs = new FS(dbpath);
+	fs->data_dirs = data_dirs;
+	fs->max_entries = max_entries;
+	if (path_cache >= 0) {
+		fs->paths.set_capacity(path_cache);
+	}
 	fs->mount();
 }
 
 static void ldbfs_destroy(void *) {
 	fs->umount();
 	delete fs;
+	log_stop();
 }
 
+// live counters, cat /mnt/.ldbfs/stats. shadows a stored /.ldbfs
+static const char * stats_dir = "/.ldbfs";
+static const char * stats_file = "/.ldbfs/stats";
+static const char * trace_file = "/.ldbfs/trace"; // builds with LDBFS_TRACING
+
 static int ldbfs_getattr(const char *p, struct stat *stbuf)
 {
+	op_timer timer(OP_GETATTR);
 	int res = 0;
 
-	BOOST_LOG_SEV(lg, debug) << "getattr " << p;
+	LOG_DEBUG(lg) << "getattr " << p;
     memset(stbuf, 0, sizeof(struct stat));
 
-	boost::shared_ptr<entry> e = fs->find(p+1);
+	if (!strcmp(p, stats_dir)) {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+	if (!strcmp(p, stats_file) || (!strcmp(p, trace_file) && !trace_json().empty())) {
+		// generated at open and read with direct_io, the size is unknown
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		return 0;
+	}
+
+	entry_ptr e = fs->find(p+1);
 	if (!e) {
-		BOOST_LOG_SEV(lg, error) << "not found " << p;
+		LOG_DEBUG(lg) << "not found " << p;
 		res = -ENOENT;
 	} else {
 		e->fillstat(stbuf);
@@ -112,27 +152,53 @@ static int ldbfs_access(const char *path, int mask)
 	return 0;
 }
 
+// offsets: 1 and 2 for . and .., i + 3 for the i-th name of the sorted
+// listing taken at offset 0, so a resumed readdir neither repeats nor
+// skips names while the directory changes. names removed since are
+// skipped, names added show up after the next rewind
 static int ldbfs_readdir(const char *, void *buf, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi)
 {
-	(void) offset;
-	(void) fi;
-
-	boost::shared_ptr<entry> d(fs->find_handle(fi->fh));
+	op_timer timer(OP_READDIR);
+	entry_ptr e(fs->find_handle(fi->fh));
 	
-	if (!d) {
+	if (!e) {
 		BOOST_LOG(lg) << "not found " << fi->fh;
 		return -ENOENT;
 	}
+	dentry * d = dynamic_cast<dentry*>(e.get());
+	if (!d) {
+		return -ENOTDIR;
+	}
+
+	boost::shared_ptr<listing_t> names = fs->listing(fi->fh, offset == 0);
 
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+	struct stat st;
+	if (offset < 1) {
+		d->fillstat(&st);
+		if (filler(buf, ".", &st, 1)) {
+			return 0;
+		}
+	}
+	if (offset < 2) {
+		memset(&st, 0, sizeof(st));
+		st.st_mode = S_IFDIR;
+		if (filler(buf, "..", &st, 2)) {
+			return 0;
+		}
+	}
 
-	boost::unique_lock<boost::mutex> scoped_lock(d->mutex);
-	for (entries_t::iterator it = d->entries.begin();
-	     it != d->entries.end(); ++it)
-	{
-		filler(buf, it->second->name.c_str(), NULL, 0);
+	// no directory lock between names, the buffer fills at kernel pace
+	for (size_t i = std::max(offset, (off_t)2) - 2; i < names->size(); ++i) {
+		entry_ptr c = d->child((*names)[i]);
+		if (!c) {
+			continue;
+		}
+		// only inode and type reach the kernel through the 2.6 api
+		c->fillstat(&st);
+		if (filler(buf, c->name.c_str(), &st, i + 3)) {
+			break;
+		}
 	}
 
 	return 0;
@@ -140,218 +206,37 @@ static int ldbfs_readdir(const char *, void *buf, fuse_fill_dir_t filler,
 
 static int ldbfs_mkdir(const char *p, mode_t mode)
 {
-	std::string path(p+1);
-	std::string name;
-
-	BOOST_LOG(lg) << "mkdir " << p;
-
-	if (fs->find(path)) {
-		BOOST_LOG(lg) << "already exists " << p;
-		return -1; // already exists. TODO: check error code
-	}
-
-	boost::shared_ptr<entry> dst = fs->find_parent(path);
-	name = fs->filename(path);
-
-	if (!dst) {
-		BOOST_LOG(lg) << "cannot find dst " << p;
-		return -1; // parent not exists: TODO: check error code;
-	}
-
-	BOOST_LOG(lg) << "parent: " << dst->name << "/" << name;
-
-	boost::shared_ptr<entry> r(new dentry(name, fs));
-	dst->add_child(r);
-
-	batch_t batch;
-
-	r->write(batch);
-	dst->write(batch);
-	fs->write(batch, true); // TODO: check status
-
-	return 0;
+	op_timer timer(OP_MKDIR);
+	LOG_DEBUG(lg) << "mkdir " << p;
+	return fs->mkdir(p+1);
 }
 
 static int ldbfs_unlink(const char *p)
 {
-	BOOST_LOG(lg) << "unlink " << p;
-	std::string path(p+1);
-
-	boost::shared_ptr<entry> e = fs->find(path);
-	if (!e) {
-		BOOST_LOG(lg) << "cannot unlink unexistent " << p;
-		return -ENOENT;
-	}
-
-	boost::shared_ptr<entry> dst = e->parent;
-
-	if (!dst) {
-		BOOST_LOG(lg) << "cannot find dst " << p;
-		return -1; // parent not exists: TODO: check error code;
-	}
-	BOOST_LOG(lg) << "unlinked " << e->tostring();
-
-	// lock dst
-
-	boost::mutex * m1 = &e->mutex;
-	boost::mutex * m2 = &dst->mutex;
-
-	assert(m1 != m2);
-
-	if (m2 > m1) {
-		std::swap(m1, m2);
-	}
-
-//	boost::unique_lock<boost::mutex> scoped_lock1(*m1);
-//	boost::unique_lock<boost::mutex> scoped_lock2(*m2);
-
-	batch_t batch;
-
-	e->remove(batch);
-	dst->remove_child(e);
-	dst->write(batch);
-
-	bool status = fs->write(batch, true); //TODO: check status
-
-
-	if (!status) {
-//		fprintf(l, "cannot remove %s %s\n",
-//		        p, status.ToString().c_str());
-        BOOST_LOG(lg) << "cannot remove " << p;
-		return -1;
-	}
-
-	return 0;
+	op_timer timer(OP_UNLINK);
+	LOG_DEBUG(lg) << "unlink " << p;
+	return fs->unlink(p+1);
 }
 
 static int ldbfs_rmdir(const char *p)
 {
+	op_timer timer(OP_RMDIR);
 	BOOST_LOG(lg) << "rmdir " << p;
-	std::string path(p+1);
-
-	boost::shared_ptr<entry> e = fs->find(path);
-	if (!e) {
-		BOOST_LOG(lg) << "not found " << p;
-		return -ENOENT;
-	}
-
-//	boost::unique_lock<boost::mutex> scoped_lock(e->mutex);
-	if (!e->entries.empty()) {
-		BOOST_LOG(lg) << "non empty dir " << p;
-		return -1;
-	}
-
-	boost::shared_ptr<entry> parent = e->parent;
-	if (!parent) {
-		BOOST_LOG(lg) << "not found " << path;
-		return -1;
-	}
-	parent->remove_child(e);
-
-	batch_t batch;
-
-	parent->write(batch);
-	e->remove(batch);
-	bool status = fs->write(batch, true); //TODO: check status
-
-	if (!status) {
-//		fprintf(l, "cannot rmdir %s %s\n",
-//		        p, status.ToString().c_str());
-        BOOST_LOG(lg) << "cannot commit " << p;
-		return -1;
-	}
-
-	return 0;
+	return fs->rmdir(p+1);
 }
 
 static int ldbfs_rename(const char *f, const char *t)
 {
-	std::string from(f+1);
-	std::string to(t+1);
-
-	boost::shared_ptr<entry> src = fs->find(from);
-	BOOST_LOG(lg) << "rename " << f << " to " << t;
-	if (!src) {
-		BOOST_LOG(lg) << "not found " << f;
-		return -ENOENT;
-	}
-
-	batch_t batch;
-
-	boost::shared_ptr<entry> dst = fs->find(to);
-
-	boost::shared_ptr<entry> src_parent = src->parent;
-	boost::shared_ptr<entry> dst_parent = fs->find_parent(to);	
-	std::string new_name = fs->filename(to);
-
-	if (!src_parent || !dst_parent) {
-		BOOST_LOG(lg) << "not found parent " << f;
-		return -1;
-	}
-
-	if (dst) {
-		if (dst == src) {
-			BOOST_LOG(lg) << "cannot self copy " << f;
-			return -1;
-		}
-		dst->remove(batch);
-		dst_parent->remove_child(dst);
-	}
-
-	// TODO: locks
-
-	src_parent->remove_child(src);
-	src->name = new_name;
-	dst_parent->add_child(src);
-
-	BOOST_LOG(lg) << "renamed " << src->tostring();
-
-	src_parent->write(batch);
-	dst_parent->write(batch);
-	bool status = fs->write(batch, true); //TODO: check status
-
-	if (!status) {
-//		fprintf(l, "cannot rename %s->%s %s\n",
-//		        from.c_str(), to.c_str(),
-//		        status.ToString().c_str());
-        BOOST_LOG(lg) << "cannot commit " << f;
-		return -1;
-	}
-
-
-	return 0;
+	op_timer timer(OP_RENAME);
+	LOG_DEBUG(lg) << "rename " << f << " to " << t;
+	return fs->rename(f+1, t+1);
 }
 
 static int ldbfs_truncate(const char *p, off_t size)
 {
-	BOOST_LOG(lg) << "truncate " << p;
-	std::string path(p+1);
-
-	boost::shared_ptr<entry> e = fs->find(path);
-	if (!e) {
-		BOOST_LOG(lg) << "not found " << p;
-		return -ENOENT;
-	}
-
-//	boost::unique_lock<boost::mutex> scoped_lock(e->mutex);
-
-	batch_t batch;
-
-	e->truncate(batch, size);
-	// TODO: recovery?
-	bool status = fs->write(batch, false); //TODO: check status
-
-	BOOST_LOG(lg) << "truncated " << e->tostring();
-
-
-	if (!status) {
-//		fprintf(l, "cannot truncate %s %s\n",
-//		        p, status.ToString().c_str());
-        BOOST_LOG(lg) << "cannot commit " << p;
-		return -1;
-	}
-
-	return 0;
+	op_timer timer(OP_TRUNCATE);
+	LOG_DEBUG(lg) << "truncate " << p;
+	return fs->truncate(p+1, size);
 }
 
 static int ldbfs_utime(const char *path, struct utimbuf * t)
@@ -362,36 +247,18 @@ static int ldbfs_utime(const char *path, struct utimbuf * t)
 static int ldbfs_create(const char *p, mode_t mode,
                         struct fuse_file_info *fi)
 {
-	std::string path = p+1;
-	boost::shared_ptr<entry> d(fs->find(path));
-	BOOST_LOG(lg) << "create " << p;
-	if (d) {
-		// already exists
-		BOOST_LOG(lg) << "already exists " << p;
-		return -1;
-	}
-
-	boost::shared_ptr<entry> dst = fs->find_parent(path);
-	std::string name = fs->filename(path);
+	op_timer timer(OP_CREATE);
+	LOG_DEBUG(lg) << "create " << p;
 
-	if (!dst) {
-		BOOST_LOG(lg) << "cannot find dst " << p;
-		return -1; // parent not exists: TODO: check error code;
+	entry_ptr r;
+	int ret = fs->create(p+1, r);
+	if (ret != 0) {
+		return ret;
 	}
 
-	boost::shared_ptr<entry> r(new fentry(name, fs));
-	dst->add_child(r);
-
-	batch_t batch;
-
-	r->write(batch);
-	dst->write(batch);
-	fs->write(batch, true); // TODO: check status
-
-	BOOST_LOG(lg) << "created " << r->tostring();
-
 //	fi->direct_io = 1;
 
+	fi->keep_cache = 1;
 	fs->allocate_handle(r, fi);
 
 	return 0;
@@ -399,14 +266,28 @@ static int ldbfs_create(const char *p, mode_t mode,
 
 static int ldbfs_open(const char *p, struct fuse_file_info *fi)
 {
-	BOOST_LOG(lg) << "open " << p;
-	boost::shared_ptr<entry> d(fs->find(p+1));
+	op_timer timer(OP_OPEN);
+	LOG_DEBUG(lg) << "open " << p;
+	if (!strcmp(p, stats_file) || !strcmp(p, trace_file)) {
+		std::string text = (!strcmp(p, stats_file)) ? fs->stats() : trace_json();
+		if (text.empty()) {
+			return -ENOENT;
+		}
+		entry_ptr v(new virtual_entry(p, fs, text));
+		fi->direct_io = 1;
+		fs->allocate_handle(v, fi);
+		return 0;
+	}
+
+	entry_ptr d(fs->find(p+1));
 	if (!d) {
 		BOOST_LOG(lg) << "not found " << p;
 		return -1;
 	}
-	BOOST_LOG(lg) << "opened " << d->tostring();
+	LOG_DEBUG(lg) << "opened " << d->tostring();
 
+	// nobody changes files behind the kernel, cached pages stay valid
+	fi->keep_cache = 1;
 	fs->allocate_handle(d, fi);
 
 	return 0;
@@ -414,12 +295,13 @@ static int ldbfs_open(const char *p, struct fuse_file_info *fi)
 
 static int ldbfs_release(const char *, struct fuse_file_info *fi)
 {
-	boost::shared_ptr<entry> r(fs->find_handle(fi->fh));
+	op_timer timer(OP_RELEASE);
+	entry_ptr r(fs->find_handle(fi->fh));
 	if (!r) {
 		BOOST_LOG_SEV(lg, error) << "cannot release " << fi->fh;
 		return -1;
 	}
-	BOOST_LOG_SEV(lg, debug) << "release " << r->tostring();
+	LOG_DEBUG(lg) << "release " << r->tostring();
 
 //	fi->direct_io = 1;
 	fs->release_handle(fi->fh);
@@ -431,7 +313,8 @@ static int ldbfs_read(
 	const char *, char *buf, size_t size, off_t offset,
 	struct fuse_file_info *fi)
 {
-	boost::shared_ptr<entry> d(fs->find_handle(fi->fh));
+	op_timer timer(OP_READ);
+	entry_ptr d(fs->find_handle(fi->fh));
 	if (!d) {
 		BOOST_LOG(lg) << "cannot read " << fi->fh;
 		return -1;
@@ -446,7 +329,8 @@ static int ldbfs_write(
 	const char *, const char *buf, size_t size,
 	off_t offset, struct fuse_file_info *fi)
 {
-	boost::shared_ptr<entry> d(fs->find_handle(fi->fh));
+	op_timer timer(OP_WRITE);
+	entry_ptr d(fs->find_handle(fi->fh));
 	if (!d) {
 		BOOST_LOG(lg) << "cannot write " << fi->fh;
 		return -1;
@@ -457,6 +341,10 @@ static int ldbfs_write(
 	batch_t batch;
 
 	int write_size = d->write_buf(batch, buf, size, offset);
+	if (write_size < 0) {
+		BOOST_LOG(lg) << "cannot write " << fi->fh;
+		return write_size;
+	}
 
 	bool status = fs->write(batch, false); //TODO: check status
 	if (!status) {
@@ -472,9 +360,10 @@ static int ldbfs_write(
 static int ldbfs_fsync(const char *, int isdatasync,
 		     struct fuse_file_info *fi)
 {
+	op_timer timer(OP_FSYNC);
 	(void) isdatasync;
 
-	boost::shared_ptr<entry> d(fs->find_handle(fi->fh));
+	entry_ptr d(fs->find_handle(fi->fh));
 	if (!d) {
 		BOOST_LOG(lg) << "cannot fsync " << fi->fh;
 		return -1;
@@ -492,48 +381,65 @@ static int ldbfs_fsync(const char *, int isdatasync,
 
 static int ldbfs_readlink(const char * link, char * target, size_t n)
 {
+	op_timer timer(OP_READLINK);
 	std::string path = link+1;
-	boost::shared_ptr<entry> s(fs->find(path));
+	entry_ptr s(fs->find(path));
 	if (!s) {
 		// not exists
 		BOOST_LOG(lg) << "cannot readlink " << link;
 		return -1;
 	}
 
+	symlink_entry * l = dynamic_cast<symlink_entry*>(s.get());
+	if (!l) {
+		return -EINVAL;
+	}
+
 	memset(target, 0, n);
-	memcpy(target, s->target_name.c_str(), std::min(n, s->target_name.size()));
+	memcpy(target, l->target_name.c_str(), std::min(n, l->target_name.size()));
 	return 0;
 }
 
 static int ldbfs_symlink(const char * src, const char * dst)
 {
+	op_timer timer(OP_SYMLINK);
 	// TODO: here may be links to external filesystem
 	std::string src_path = src+1;
 	std::string dst_path = dst+1;
-	boost::shared_ptr<entry> s(fs->find(src_path));
+	entry_ptr s(fs->find(src_path));
 	if (!s) {
 		// not exists
 		BOOST_LOG(lg) << "unknown source " << src;
 		return -1;
 	}
-	boost::shared_ptr<entry> d(fs->find(dst_path));
+	entry_ptr d(fs->find(dst_path));
 	if (d) {
 		// already exists
 		BOOST_LOG(lg) << "already exists dest " << dst;
 		return -1;
 	}
-	boost::shared_ptr<entry> parent = fs->find_parent(dst_path);
+	entry_ptr parent = fs->find_parent(dst_path);
 	if (!parent) {
 		// not exists
 		BOOST_LOG(lg) << "unknown parent " << dst;
 		return -1;
 	}
-	d.reset(new symlink_entry(fs->filename(dst_path), fs));
-	d->target_name = fs->filename(src_path);
-	parent->add_child(d);
+	symlink_entry * l = new symlink_entry(fs->filename(dst_path), fs);
+	d.reset(l);
+	if (!fs->allocate_inode(d.get())) {
+		return -EIO;
+	}
+	l->target_name = fs->filename(src_path);
+	if (!parent->add_child(d)) {
+		BOOST_LOG(lg) << "cannot read parent of " << dst;
+		return -EIO;
+	}
+	fs->invalidate(dst_path);
 
 	batch_t batch;
-	parent->write(batch);
+	if (!parent->write(batch)) {
+		return -EIO;
+	}
 	fs->write(batch, sync);
 
 	return 0;
@@ -542,22 +448,54 @@ static int ldbfs_symlink(const char * src, const char * dst)
 static int ldbfs_chown(const char * src, uid_t uid, gid_t gid)
 {
 	std::string path = src+1;
-	boost::shared_ptr<entry> s(fs->find(path));
+	entry_ptr s(fs->find(path));
 	if (!s) {
 		// not exists
 		BOOST_LOG(lg) << "unknown source " << src;
 		return -1;
 	}
 
-	s->st.st_uid = uid;
-	s->st.st_gid = gid;
+	s->st.uid = uid;
+	s->st.gid = gid;
 
 	return 0;
 }
 
-static struct fuse_operations ldbfs_oper;
+// debugging attributes, e.g. getfattr -n user.ldbfs.extents file
+static int ldbfs_getxattr(const char * p, const char * name, char * value, size_t size)
+{
+	// security.capability and acl probes come with every write and exec,
+	// ENOTSUP stops them without a lookup
+	if (strncmp(name, "user.ldbfs.", strlen("user.ldbfs.")) != 0) {
+		return -ENOTSUP;
+	}
 
-namespace keywords = boost::log::keywords;
+	op_timer timer(OP_XATTR);
+	std::string path = p+1;
+	entry_ptr e(fs->find(path));
+	if (!e) {
+		return -ENOENT;
+	}
+
+	std::string r;
+	fentry * f = dynamic_cast<fentry*>(e.get());
+	if (f && !strcmp(name, "user.ldbfs.extents")) {
+		r = f->extent_stats();
+	} else {
+		return -ENODATA;
+	}
+
+	if (size == 0) {
+		return r.size();
+	}
+	if (size < r.size()) {
+		return -ERANGE;
+	}
+	memcpy(value, r.c_str(), r.size());
+	return r.size();
+}
+
+static struct fuse_operations ldbfs_oper;
 
 int main(int argc, char *argv[])
 {
@@ -581,6 +519,7 @@ int main(int argc, char *argv[])
 	ldbfs_oper.rename = ldbfs_rename;
 	ldbfs_oper.utime = ldbfs_utime;
 	ldbfs_oper.destroy = ldbfs_destroy;
+	ldbfs_oper.getxattr = ldbfs_getxattr;
 //	ldbfs_oper.symlink = ldbfs_symlink;
 //	ldbfs_oper.readlink = ldbfs_readlink;
 //	ldbfs_oper.chown = ldbfs_chown;
@@ -591,7 +530,7 @@ int main(int argc, char *argv[])
 
 	umask(0);
 
-	char ** new_argv = (char**)calloc(argc+1, sizeof(char*));
+	char ** new_argv = (char**)calloc(argc+3, sizeof(char*));
 	int j = 0;
 	std::map<std::string, std::string> params;
 
@@ -620,28 +559,57 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	dbpath = it->second;
+	// fuse chdirs to / when it daemonizes
+	dbpath = boost::filesystem::absolute(it->second).string();
 
+	std::string log_file;
 	it = params.find("log");
 	if (it != params.end()) {
-		boost::log::add_file_log(
-			keywords::file_name = it->second,
-			keywords::format = "[%TimeStamp%]: %Message%",
-			keywords::auto_flush = true
-		);
-	} else {
-		boost::log::add_console_log();
+		log_file = it->second;
+	}
+	it = params.find("data_dirs");
+	if (it != params.end()) {
+		data_dirs = FS::split_dirs(it->second);
+	}
+	it = params.find("max_entries");
+	if (it != params.end()) {
+		max_entries = atol(it->second.c_str());
 	}
+	it = params.find("path_cache");
+	if (it != params.end()) {
+		path_cache = atol(it->second.c_str());
+	}
+	it = params.find("writeback");
+	if (it != params.end()) {
+		writeback = atoi(it->second.c_str()) != 0;
+	}
+
+	// ldbfs owns its namespace, every change goes through this mount
+	// and the kernel updates its own dentries and attributes for them
+	// (rename, unlink, truncate, write). so the kernel may cache
+	// lookups, attributes and missing names for long, nothing needs
+	// an explicit invalidation. -p attr_timeout=0 etc. to turn off
+	std::string timeouts;
+	const char * timeout_names[] = {"attr_timeout", "entry_timeout", "negative_timeout"};
+	for (int i = 0; i < 3; ++i) {
+		it = params.find(timeout_names[i]);
+		timeouts += (timeouts.empty()) ? "" : ",";
+		timeouts += timeout_names[i];
+		timeouts += "=";
+		timeouts += (it != params.end()) ? it->second : "3600";
+	}
+	new_argv[j++] = strdup("-o");
+	new_argv[j++] = strdup(timeouts.c_str());
+
 	it = params.find("severity");
 	if (it != params.end()) {
 		severity = atoi(it->second.c_str());
 	}
-	boost::log::core::get()->add_global_attribute(
-		"TimeStamp", boost::log::attributes::local_clock());
-	boost::log::core::get()->set_filter
-    (
-        boost::log::trivial::severity >= severity
-    );
+	log_init(log_file, severity);
+
+	it = params.find("trace");
+	trace_dump = boost::filesystem::absolute(
+		(it != params.end()) ? it->second : "ldbfs-trace.json").string();
 	BOOST_LOG(lg) << "using root: " << dbpath;
 	
 	return fuse_main(j, new_argv, &ldbfs_oper, NULL);
@@ -1,83 +1,327 @@
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include <boost/filesystem.hpp>
 
 #include "leveldb/db.h"
 #include "leveldb/write_batch.h"
 #include "leveldb/filter_policy.h"
 #include "leveldb/env.h"
 
-leveldb::DB* db;
-int blocksize = 10000;
+#include "dentry.h"
+#include "timing.h"
+
+// leveldb option sweep for picking mkfs.ldbfs and FS::open defaults.
+// every combination gets a fresh db under dir, writes --mb of file
+// blocks keyed like ldbfs data parts, then reads random blocks back.
+// prints one json line per combination
+//
+// usage: test-leveldb dir [--threads n] [--mb n] [--batch n] [--reads n]
+//          [--values 4096,131072] [--keys uuid,compact] [--bloom 0,16]
+//          [--buffer 4,60] [--compression none,snappy,lz4] [--sync 0,1]
+//          [--compressible percent]
+//
+// --values are ldbfs blocksizes, --buffer is write_buffer_size in MB,
+// --keys is block_key::encode of uuid or inode64 filesystems
 
-void * writer(void * a)
+struct config
 {
-	long number = (long)a;
+	int value;
+	bool compact;
+	int bloom;
+	int buffer;
+	std::string compression;
+	bool sync;
+};
 
-	char data[blocksize];
+struct worker
+{
+	long number;
+	const config * c;
+	uint64_t files;             // inodes written
+	std::vector<uint64_t> ns;   // per Write or Get
+	std::vector<std::string> inodes;
+};
+
+leveldb::DB* db;
+int threads = 4;
+size_t total = 256;  // MB per combination
+int batchc = 10;     // puts per Write, a bucket flush is one batch
+int reads = 100000;
+int compressible = 50;
+int file_blocks = 64;
 
-	for (int j = 0; j < blocksize; ++j) {
-		data[j] = (char)(rand() % 256);
+// bytes written by this process, logs and compactions included
+static long long process_written()
+{
+	char line[256];
+	long long bytes = -1;
+	FILE * f = fopen("/proc/self/io", "r");
+	if (!f) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "wchar:", 6)) {
+			bytes = atoll(line + 6);
+		}
+	}
+	fclose(f);
+	return bytes;
+}
+
+static std::vector<std::string> split(const char * list)
+{
+	std::vector<std::string> r;
+	std::string s(list);
+	size_t pos = 0;
+	while (pos <= s.size()) {
+		size_t next = s.find(',', pos);
+		if (next == std::string::npos) {
+			next = s.size();
+		}
+		if (next > pos) {
+			r.push_back(s.substr(pos, next - pos));
+		}
+		pos = next + 1;
 	}
+	return r;
+}
 
-	size_t written = 0;
+static void make_inode(const config & c, long number, uint64_t file, unsigned char * inode)
+{
+	if (!c.compact) {
+		uuid_generate(inode);
+		return;
+	}
+	// as FS::allocate_inode, big endian numbers
+	uint64_t n = htobe64(((uint64_t)number << 32) + file + 1);
+	memset(inode, 0, sizeof(uuid_t));
+	memcpy(inode, &n, sizeof(n));
+}
 
-	int batchc = 10;
+static void * writer(void * a)
+{
+	worker * w = (worker*)a;
+	const config & c = *w->c;
 
-	char key[batchc][256];
-	long block = 0;
-	std::string value(data, blocksize);
+	std::string value(c.value, 0);
+	unsigned int seed = w->number + 1;
+	// the rest stays zero, --compressible percent of every block
+	for (int j = 0; j < c.value * (100 - compressible) / 100; ++j) {
+		value[j] = (char)rand_r(&seed);
+	}
 
 	leveldb::WriteOptions writeOptions;
-	writeOptions.sync = false;
+	writeOptions.sync = c.sync;
 
-	while (1) {
-//		snprintf(key, sizeof(key), "%04ld%04ld", number, block);
-//		db->Put(writeOptions, key, value);
-//		block++;
+	size_t blocks = total * 1024 * 1024 / c.value / threads;
+	unsigned char inode[16];
+	char buf[sizeof(block_key)];
+	for (size_t i = 0; i < blocks; ) {
 		leveldb::WriteBatch batch;
-		for (int k = 0; k < batchc; ++k) {
-			snprintf(key[k], 256, "%04ld%04ld", number, block);
-			//db->Put(writeOptions, key, value);
-			batch.Put(key[k], value);
-			block++;
+		for (int k = 0; k < batchc && i < blocks; ++k, ++i) {
+			int blockno = i % file_blocks;
+			if (blockno == 0) {
+				make_inode(c, w->number, w->files++, inode);
+				w->inodes.push_back(std::string((char*)inode, sizeof(inode)));
+			}
+			block_key key('f', inode);
+			key.setblock(blockno);
+			batch.Put(leveldb::Slice(buf, key.encode(buf, c.compact)), value);
 		}
+		uint64_t t1 = now_ns();
 		db->Write(writeOptions, &batch);
-
+		w->ns.push_back(now_ns() - t1);
 	}
 
 	return 0;
 }
 
-int main(int argc, char ** argv)
+static void * reader(void * a)
 {
-	int threads = 50;
-	leveldb::Options options;
+	worker * w = (worker*)a;
+	const config & c = *w->c;
+	unsigned int seed = w->number + 1;
+	std::string value;
+	char buf[sizeof(block_key)];
 
-	options.create_if_missing = true;
-	options.compression = leveldb::kNoCompression;
-//	options.write_buffer_size = 4*1024*1024;
-//
-	options.filter_policy=leveldb::NewBloomFilterPolicy2(16);
-    options.write_buffer_size=62914560;  // 60Mbytes
-    options.total_leveldb_mem=2684354560; // 2.5Gbytes (details below)
-	options.env=leveldb::Env::Default();
+	w->ns.clear();
+	for (int i = 0; i < reads / threads && !w->inodes.empty(); ++i) {
+		const std::string & inode = w->inodes[rand_r(&seed) % w->inodes.size()];
+		block_key key('f', (unsigned char*)inode.data());
+		key.setblock(rand_r(&seed) % file_blocks);
+		uint64_t t1 = now_ns();
+		db->Get(leveldb::ReadOptions(), leveldb::Slice(buf, key.encode(buf, c.compact)), &value);
+		w->ns.push_back(now_ns() - t1);
+	}
 
-	leveldb::Status status = leveldb::DB::Open(options, "./testdb", &db);
+	return 0;
+}
 
-//	db->CompactRange(0, 0);
-//	return 0;
+static void run(pthread_t * t, std::vector<worker> & workers, void * (*f)(void*))
+{
+	for (int i = 0; i < threads; ++i) {
+		pthread_create(&t[i], 0, f, &workers[i]);
+	}
+	for (int i = 0; i < threads; ++i) {
+		pthread_join(t[i], 0);
+	}
+}
 
-	pthread_t t[threads];
+static std::vector<uint64_t> merged(const std::vector<worker> & workers)
+{
+	std::vector<uint64_t> ns;
+	for (size_t i = 0; i < workers.size(); ++i) {
+		ns.insert(ns.end(), workers[i].ns.begin(), workers[i].ns.end());
+	}
+	std::sort(ns.begin(), ns.end());
+	return ns;
+}
+
+static void sweep(const std::string & dir, const config & c)
+{
+	boost::filesystem::remove_all(dir);
 
-	for (long i = 0; i < threads; ++i) {
-		pthread_create(&t[i], 0, writer, (void*)i);
+	// FS::open, with the swept fields replaced
+	leveldb::Options options;
+	options.create_if_missing = true;
+	options.filter_policy = (c.bloom > 0) ? leveldb::NewBloomFilterPolicy2(c.bloom) : 0;
+	options.write_buffer_size = c.buffer * 1024L * 1024L;
+	options.total_leveldb_mem = 2684354560; // 2.5Gbytes
+	options.env = leveldb::Env::Default();
+	if (c.compression == "none") {
+		options.compression = leveldb::kNoCompression;
+	} else if (c.compression == "lz4") {
+		options.compression = leveldb::kLZ4Compression;
+	} else {
+		options.compression = leveldb::kSnappyCompression;
+	}
+
+	leveldb::Status status = leveldb::DB::Open(options, dir, &db);
+	if (!status.ok()) {
+		fprintf(stderr, "cannot open %s: %s\n", dir.c_str(), status.ToString().c_str());
+		return;
 	}
 
+	std::vector<pthread_t> t(threads);
+	std::vector<worker> workers(threads);
 	for (int i = 0; i < threads; ++i) {
-		pthread_join(t[i], 0);
+		workers[i].number = i;
+		workers[i].c = &c;
+		workers[i].files = 0;
 	}
 
-	return 0;
+	long long written1 = process_written();
+	uint64_t t1 = now_ns();
+	run(&t[0], workers, writer);
+	uint64_t t2 = now_ns();
+	std::vector<uint64_t> wns = merged(workers);
+
+	run(&t[0], workers, reader);
+	uint64_t t3 = now_ns();
+	std::vector<uint64_t> rns = merged(workers);
+
+	// closing waits for the running compaction, the rest is backlog
+	delete db;
+	db = 0;
+	delete options.filter_policy;
+	long long written2 = process_written();
+
+	double user = (double)(total * 1024 * 1024 / c.value / threads) * threads * c.value;
+	printf("{\"value\": %d, \"keys\": \"%s\", \"bloom\": %d, \"buffer_mb\": %d, "
+	       "\"compression\": \"%s\", \"sync\": %d, \"batch\": %d, \"threads\": %d, "
+	       "\"write_mb_per_sec\": %.1f, \"write_p50_us\": %.1f, \"write_p99_us\": %.1f, "
+	       "\"write_p999_us\": %.1f, \"read_ops_per_sec\": %.1f, \"read_p50_us\": %.1f, "
+	       "\"read_p99_us\": %.1f, \"write_amplification\": %.2f}\n",
+	       c.value, (c.compact) ? "compact" : "uuid", c.bloom, c.buffer,
+	       c.compression.c_str(), (int)c.sync, batchc, threads,
+	       user / ((t2 - t1) / 1e9) / 1024 / 1024,
+	       percentile(wns, 0.5) / 1e3, percentile(wns, 0.99) / 1e3, percentile(wns, 0.999) / 1e3,
+	       rns.size() / ((t3 - t2) / 1e9),
+	       percentile(rns, 0.5) / 1e3, percentile(rns, 0.99) / 1e3,
+	       (written1 >= 0 && user > 0) ? (written2 - written1) / user : 0.0);
+	fflush(stdout);
 }
 
+int main(int argc, char ** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s dir [--threads n] [--mb n] [--batch n] [--reads n] "
+		        "[--values list] [--keys uuid,compact] [--bloom list] [--buffer list] "
+		        "[--compression list] [--sync 0,1] [--compressible percent]\n", argv[0]);
+		return -1;
+	}
+
+	std::string root = argv[1];
+	std::vector<std::string> values = split("4096,131072");
+	std::vector<std::string> keys = split("uuid,compact");
+	std::vector<std::string> blooms = split("0,16");
+	std::vector<std::string> buffers = split("4,60");
+	std::vector<std::string> compressions = split("none,snappy");
+	std::vector<std::string> syncs = split("0,1");
+
+	for (int i = 2; i < argc; ++i) {
+		const char * v = (i + 1 < argc) ? argv[i+1] : "";
+		if (!strcmp(argv[i], "--threads")) {
+			threads = atoi(v);
+		} else if (!strcmp(argv[i], "--mb")) {
+			total = atol(v);
+		} else if (!strcmp(argv[i], "--batch")) {
+			batchc = atoi(v);
+		} else if (!strcmp(argv[i], "--reads")) {
+			reads = atoi(v);
+		} else if (!strcmp(argv[i], "--compressible")) {
+			compressible = atoi(v);
+		} else if (!strcmp(argv[i], "--values")) {
+			values = split(v);
+		} else if (!strcmp(argv[i], "--keys")) {
+			keys = split(v);
+		} else if (!strcmp(argv[i], "--bloom")) {
+			blooms = split(v);
+		} else if (!strcmp(argv[i], "--buffer")) {
+			buffers = split(v);
+		} else if (!strcmp(argv[i], "--compression")) {
+			compressions = split(v);
+		} else if (!strcmp(argv[i], "--sync")) {
+			syncs = split(v);
+		}
+	}
+
+	if (threads <= 0 || batchc <= 0 || compressible < 0 || compressible > 100) {
+		fprintf(stderr, "invalid threads, batch or compressible\n");
+		return -1;
+	}
+
+	int n = 0;
+	for (size_t a = 0; a < values.size(); ++a)
+	for (size_t b = 0; b < keys.size(); ++b)
+	for (size_t c = 0; c < blooms.size(); ++c)
+	for (size_t d = 0; d < buffers.size(); ++d)
+	for (size_t e = 0; e < compressions.size(); ++e)
+	for (size_t f = 0; f < syncs.size(); ++f) {
+		config cfg;
+		cfg.value = atoi(values[a].c_str());
+		cfg.compact = keys[b] == "compact";
+		cfg.bloom = atoi(blooms[c].c_str());
+		cfg.buffer = atoi(buffers[d].c_str());
+		cfg.compression = compressions[e];
+		cfg.sync = atoi(syncs[f].c_str()) != 0;
+		if (cfg.value <= 0 || cfg.buffer <= 0) {
+			continue;
+		}
+
+		char buf[64];
+		snprintf(buf, sizeof(buf), "/sweep-%04d", n++);
+		sweep(root + buf, cfg);
+		boost::filesystem::remove_all(root + buf);
+	}
 
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include <iostream>
+
+#include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/attributes/clock.hpp>
+#include <boost/log/sinks/async_frontend.hpp>
+#include <boost/log/sinks/bounded_fifo_queue.hpp>
+#include <boost/log/sinks/drop_on_overflow.hpp>
+#include <boost/log/sinks/text_file_backend.hpp>
+#include <boost/log/sinks/text_ostream_backend.hpp>
+#include <boost/log/support/date_time.hpp>
+
+#include "log.h"
+
+namespace logging = boost::log;
+namespace sinks = boost::log::sinks;
+namespace expr = boost::log::expressions;
+namespace keywords = boost::log::keywords;
+
+enum { queue_size = 16*1024 };
+
+typedef sinks::bounded_fifo_queue<queue_size, sinks::drop_on_overflow> queue_t;
+typedef sinks::asynchronous_sink<sinks::text_file_backend, queue_t> file_sink;
+typedef sinks::asynchronous_sink<sinks::text_ostream_backend, queue_t> console_sink;
+
+static boost::shared_ptr<file_sink> file_log;
+static boost::shared_ptr<console_sink> console_log;
+static boost::thread sink_thread;
+
+struct no_delete
+{
+	void operator()(const void *) const {}
+};
+
+void log_init(const std::string & file, int severity)
+{
+	boost::shared_ptr<logging::core> core = logging::core::get();
+	core->add_global_attribute("TimeStamp", logging::attributes::local_clock());
+	core->set_filter(expr::attr<int>("Severity") >= severity);
+
+	if (!file.empty()) {
+		boost::shared_ptr<sinks::text_file_backend> backend(
+			new sinks::text_file_backend());
+		// opened by the sink thread, after fuse chdirs to /
+		backend->set_file_name_pattern(boost::filesystem::absolute(file));
+		// the sink thread writes, flushed by log_flush
+		backend->auto_flush(false);
+		file_log.reset(new file_sink(backend, false));
+		file_log->set_formatter(expr::stream
+			<< "[" << expr::format_date_time<boost::posix_time::ptime>(
+				"TimeStamp", "%Y-%m-%d %H:%M:%S.%f") << "]: "
+			<< expr::smessage);
+		core->add_sink(file_log);
+	} else {
+		boost::shared_ptr<sinks::text_ostream_backend> backend =
+			boost::make_shared<sinks::text_ostream_backend>();
+		backend->add_stream(boost::shared_ptr<std::ostream>(&std::clog, no_delete()));
+		console_log.reset(new console_sink(backend, false));
+		console_log->set_formatter(expr::stream << expr::smessage);
+		core->add_sink(console_log);
+	}
+}
+
+void log_start()
+{
+	if (file_log) {
+		sink_thread = boost::thread(boost::bind(&file_sink::run, file_log));
+	} else if (console_log) {
+		sink_thread = boost::thread(boost::bind(&console_sink::run, console_log));
+	}
+}
+
+void log_flush()
+{
+	if (file_log) {
+		file_log->locked_backend()->flush();
+	}
+	if (console_log) {
+		console_log->locked_backend()->flush();
+	}
+}
+
+// stop does nothing before run has begun, so it is repeated
+template <typename sink_t>
+static void stop_sink(const boost::shared_ptr<sink_t> & sink)
+{
+	logging::core::get()->remove_sink(sink);
+	sink->stop();
+	while (sink_thread.joinable() && !sink_thread.timed_join(boost::posix_time::milliseconds(10))) {
+		sink->stop();
+	}
+	sink->flush();
+}
+
+void log_stop()
+{
+	if (file_log) {
+		stop_sink(file_log);
+		file_log.reset();
+	}
+	if (console_log) {
+		stop_sink(console_log);
+		console_log.reset();
+	}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+
+#include <boost/log/common.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/log/sources/severity_logger.hpp>
+
+// records default to info, -p severity=N filters by trivial levels
+BOOST_LOG_INLINE_GLOBAL_LOGGER_CTOR_ARGS(global_lg, boost::log::sources::severity_logger< >,
+	(boost::log::keywords::severity = (int)boost::log::trivial::info));
+
+// per operation tracing. call sites compile to nothing unless built with
+// LDBFS_DEBUG_LOG (cmake -DDEBUG_LOG=ON), the stream is never evaluated
+#ifdef LDBFS_DEBUG_LOG
+#define LOG_DEBUG(lg) BOOST_LOG_SEV(lg, boost::log::trivial::debug)
+#else
+#define LOG_DEBUG(lg) if (true) {} else BOOST_LOG_SEV(lg, boost::log::trivial::debug)
+#endif
+
+// asynchronous sink to file or console: callers only queue records, a
+// dedicated thread formats and writes them. a full queue drops records,
+// logging never blocks a FUSE thread
+void log_init(const std::string & file, int severity);
+// the thread does not survive the fork of fuse_main, start it after,
+// records until then are queued
+void log_start();
+void log_flush();
+void log_stop(); // writes out queued records
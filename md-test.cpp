@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include "fs.h"
+
+// mdtest-like namespace benchmark, against a mounted ldbfs (posix) or
+// the fs library directly (fs). every phase runs once per directory
+// size, per op cost growing with the size points at an O(N) path such
+// as rewriting the whole parent record on every create
+//
+// usage: test-md dir [--backend posix|fs] [--sizes 1000,4000,16000]
+//          [--fanout n] [--depth n] [--parts n] [--meta-parts n]
+//          [--flat-dirs] [--inode64]
+//
+// phases: create, stat, readdir, rename (same directory), move (to a
+// second directory), unlink, mkdir, rmdir, and tree-create, tree-stat,
+// tree-unlink with the same number of files over fanout^depth leaves
+
+struct backend
+{
+	virtual ~backend() {}
+	virtual bool create(const std::string & path) = 0;
+	virtual bool stat(const std::string & path) = 0;
+	virtual bool unlink(const std::string & path) = 0;
+	virtual bool mkdir(const std::string & path) = 0;
+	virtual bool rmdir(const std::string & path) = 0;
+	virtual bool rename(const std::string & from, const std::string & to) = 0;
+	virtual size_t readdir(const std::string & path) = 0; // entries
+};
+
+struct posix_backend: public backend
+{
+	std::string root;
+
+	posix_backend(const std::string & root): root(root + "/") {}
+
+	bool create(const std::string & path) {
+		int fd = ::open((root + path).c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+		return fd >= 0 && ::close(fd) == 0;
+	}
+
+	bool stat(const std::string & path) {
+		struct stat st;
+		return ::stat((root + path).c_str(), &st) == 0;
+	}
+
+	bool unlink(const std::string & path) {
+		return ::unlink((root + path).c_str()) == 0;
+	}
+
+	bool mkdir(const std::string & path) {
+		return ::mkdir((root + path).c_str(), 0755) == 0;
+	}
+
+	bool rmdir(const std::string & path) {
+		return ::rmdir((root + path).c_str()) == 0;
+	}
+
+	bool rename(const std::string & from, const std::string & to) {
+		return ::rename((root + from).c_str(), (root + to).c_str()) == 0;
+	}
+
+	size_t readdir(const std::string & path) {
+		size_t n = 0;
+		DIR * d = ::opendir((root + path).c_str());
+		if (!d) {
+			return 0;
+		}
+		while (::readdir(d)) {
+			n ++;
+		}
+		::closedir(d);
+		return n;
+	}
+};
+
+// the ldbfs_* handlers without fuse
+struct fs_backend: public backend
+{
+	FS * fs;
+
+	fs_backend(FS * fs): fs(fs) {}
+
+	bool create(const std::string & path) {
+		entry_ptr e;
+		return fs->create(path, e) == 0;
+	}
+
+	bool stat(const std::string & path) {
+		struct stat st;
+		entry_ptr e = fs->find(path);
+		if (!e) {
+			return false;
+		}
+		e->fillstat(&st);
+		return true;
+	}
+
+	bool unlink(const std::string & path) {
+		return fs->unlink(path) == 0;
+	}
+
+	bool mkdir(const std::string & path) {
+		return fs->mkdir(path) == 0;
+	}
+
+	bool rmdir(const std::string & path) {
+		return fs->rmdir(path) == 0;
+	}
+
+	bool rename(const std::string & from, const std::string & to) {
+		return fs->rename(from, to) == 0;
+	}
+
+	size_t readdir(const std::string & path) {
+		entry_ptr e = fs->find(path);
+		dentry * d = dynamic_cast<dentry*>(e.get());
+		if (!d) {
+			return 0;
+		}
+		listing_t names;
+		d->list(names);
+		struct stat st;
+		size_t n = 0;
+		for (size_t i = 0; i < names.size(); ++i) {
+			entry_ptr c = d->child(names[i]);
+			if (c) {
+				c->fillstat(&st);
+				n ++;
+			}
+		}
+		return n;
+	}
+};
+
+static const char * phases[] = {
+	"create", "stat", "readdir", "rename", "move", "unlink", "mkdir", "rmdir",
+	"tree-create", "tree-stat", "tree-unlink"
+};
+static const int phase_count = sizeof(phases) / sizeof(phases[0]);
+
+static std::string name(const char * dir, const char * prefix, size_t i)
+{
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%s/%s%08lu", dir, prefix, (unsigned long)i);
+	return buf;
+}
+
+// leaf directory of file i in a fanout^depth tree
+static std::string leaf(size_t i, int fanout, int depth)
+{
+	std::string path = "tree";
+	for (int d = 0; d < depth; ++d) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "/%d", (int)(i % fanout));
+		path += buf;
+		i /= fanout;
+	}
+	return path;
+}
+
+static void make_tree(backend & b, const std::string & path, int fanout, int depth)
+{
+	b.mkdir(path);
+	for (int i = 0; depth > 0 && i < fanout; ++i) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "/%d", i);
+		make_tree(b, path + buf, fanout, depth - 1);
+	}
+}
+
+struct phase_result
+{
+	size_t ops;
+	int errors;
+	double seconds;
+};
+
+static phase_result run_phase(backend & b, int phase, size_t n, int fanout, int depth)
+{
+	phase_result r = { 0, 0, 0 };
+	uint64_t t1 = now_ns();
+	const char * p = phases[phase];
+	for (size_t i = 0; i < n; ++i) {
+		bool ok = true;
+		if (!strcmp(p, "create")) {
+			ok = b.create(name("d0", "f", i));
+		} else if (!strcmp(p, "stat")) {
+			ok = b.stat(name("d0", "f", i));
+		} else if (!strcmp(p, "readdir")) {
+			// whole listing, ops are entries
+			r.ops = b.readdir("d0");
+			ok = r.ops >= n;
+			break;
+		} else if (!strcmp(p, "rename")) {
+			ok = b.rename(name("d0", "f", i), name("d0", "g", i));
+		} else if (!strcmp(p, "move")) {
+			ok = b.rename(name("d0", "g", i), name("d1", "g", i));
+		} else if (!strcmp(p, "unlink")) {
+			ok = b.unlink(name("d1", "g", i));
+		} else if (!strcmp(p, "mkdir")) {
+			ok = b.mkdir(name("d0", "s", i));
+		} else if (!strcmp(p, "rmdir")) {
+			ok = b.rmdir(name("d0", "s", i));
+		} else if (!strcmp(p, "tree-create")) {
+			ok = b.create(name(leaf(i, fanout, depth).c_str(), "f", i));
+		} else if (!strcmp(p, "tree-stat")) {
+			ok = b.stat(name(leaf(i, fanout, depth).c_str(), "f", i));
+		} else if (!strcmp(p, "tree-unlink")) {
+			ok = b.unlink(name(leaf(i, fanout, depth).c_str(), "f", i));
+		}
+		r.errors += (ok) ? 0 : 1;
+		r.ops ++;
+	}
+	r.seconds = (now_ns() - t1) / 1e9;
+	return r;
+}
+
+static std::vector<size_t> split_sizes(const char * list)
+{
+	std::vector<size_t> r;
+	std::vector<std::string> v;
+	boost::algorithm::split(v, list, boost::algorithm::is_any_of(","));
+	for (size_t i = 0; i < v.size(); ++i) {
+		size_t n = atol(v[i].c_str());
+		if (n > 0) {
+			r.push_back(n);
+		}
+	}
+	return r;
+}
+
+int main(int argc, char ** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s dir [--backend posix|fs] [--sizes list] [--fanout n] "
+		        "[--depth n] [--parts n] [--meta-parts n] [--flat-dirs] [--inode64]\n", argv[0]);
+		return -1;
+	}
+
+	std::string root = argv[1];
+	std::string kind = "posix";
+	std::vector<size_t> sizes = split_sizes("1000,4000,16000");
+	int fanout = 10;
+	int depth = 2;
+	int parts = 2;
+	int meta_parts = 1;
+	bool flat_dirs = false;
+	bool inode64 = false;
+
+	for (int i = 2; i < argc; ++i) {
+		const char * v = (i + 1 < argc) ? argv[i+1] : "0";
+		if (!strcmp(argv[i], "--backend")) {
+			kind = v;
+		} else if (!strcmp(argv[i], "--sizes")) {
+			sizes = split_sizes(v);
+		} else if (!strcmp(argv[i], "--fanout")) {
+			fanout = atoi(v);
+		} else if (!strcmp(argv[i], "--depth")) {
+			depth = atoi(v);
+		} else if (!strcmp(argv[i], "--parts")) {
+			parts = atoi(v);
+		} else if (!strcmp(argv[i], "--meta-parts")) {
+			meta_parts = atoi(v);
+		} else if (!strcmp(argv[i], "--flat-dirs")) {
+			flat_dirs = true;
+		} else if (!strcmp(argv[i], "--inode64")) {
+			inode64 = true;
+		}
+	}
+
+	if (sizes.empty() || fanout <= 0 || depth < 0 || (kind != "posix" && kind != "fs")) {
+		fprintf(stderr, "invalid backend, sizes, fanout or depth\n");
+		return -1;
+	}
+
+	boost::log::core::get()->set_logging_enabled(false);
+
+	// per op microseconds by phase, for the scaling summary
+	std::map<int, std::vector<double> > per_op;
+
+	for (size_t s = 0; s < sizes.size(); ++s) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "/md-%lu", (unsigned long)sizes[s]);
+		std::string dir = root + buf;
+		boost::filesystem::remove_all(dir);
+		boost::filesystem::create_directories(dir);
+
+		FS * fs = 0;
+		backend * b;
+		if (kind == "fs") {
+			fs = new FS(dir);
+			fs->meta_parts = meta_parts;
+			fs->flat_dirs = flat_dirs;
+			fs->inode64 = inode64;
+			fs->mkfs(128*1024, parts);
+			b = new fs_backend(fs);
+		} else {
+			b = new posix_backend(dir);
+		}
+
+		b->mkdir("d0");
+		b->mkdir("d1");
+		make_tree(*b, "tree", fanout, depth);
+
+		for (int p = 0; p < phase_count; ++p) {
+			phase_result r = run_phase(*b, p, sizes[s], fanout, depth);
+			double us = (r.ops) ? r.seconds * 1e6 / r.ops : 0;
+			per_op[p].push_back(us);
+			printf("{\"backend\": \"%s\", \"size\": %lu, \"phase\": \"%s\", \"ops\": %lu, "
+			       "\"errors\": %d, \"seconds\": %.3f, \"ops_per_sec\": %.1f, \"us_per_op\": %.2f}\n",
+			       kind.c_str(), (unsigned long)sizes[s], phases[p], (unsigned long)r.ops,
+			       r.errors, r.seconds, (r.seconds > 0) ? r.ops / r.seconds : 0.0, us);
+			fflush(stdout);
+		}
+
+		delete b;
+		if (fs) {
+			// TODO: FS has no close, the dbs stay open until exit
+			fs->umount();
+		} else {
+			boost::filesystem::remove_all(dir);
+		}
+	}
+
+	// ~1: per op cost independent of directory size, ~size ratio: O(N)
+	if (sizes.size() > 1) {
+		double size_ratio = (double)sizes.back() / sizes.front();
+		for (int p = 0; p < phase_count; ++p) {
+			const std::vector<double> & us = per_op[p];
+			printf("{\"backend\": \"%s\", \"phase\": \"%s\", \"size_ratio\": %.1f, "
+			       "\"cost_ratio\": %.2f}\n",
+			       kind.c_str(), phases[p], size_ratio,
+			       (us.front() > 0) ? us.back() / us.front() : 0.0);
+		}
+	}
+
+	return 0;
+}
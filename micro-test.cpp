@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <boost/filesystem.hpp>
+
+#include "fs.h"
+
+// microbenchmarks of hot paths, no fuse and no device in the loop:
+// block_key compare and print, bucket add_op/read under contention,
+// directory record round trips, fentry write_buf/read_buf
+//
+// usage: test-micro [--benchmark_filter=regex] [benchmark options]
+// the filesystem is made in a temporary directory under /tmp
+
+static FS * make_fs()
+{
+	char dir[] = "/tmp/ldbfs-micro-XXXXXX";
+	if (!mkdtemp(dir)) {
+		abort();
+	}
+	boost::log::core::get()->set_logging_enabled(false);
+	FS * fs = new FS(dir);
+	fs->mkfs(4096, 2);
+	return fs;
+}
+
+static FS * micro_fs()
+{
+	// threaded benchmarks get here together
+	static FS * fs = make_fs();
+	return fs;
+}
+
+static std::vector<block_key> random_keys(size_t n, bool same_inode)
+{
+	std::vector<block_key> keys;
+	uuid_t ino;
+	uuid_generate(ino);
+	for (size_t i = 0; i < n; ++i) {
+		if (!same_inode) {
+			uuid_generate(ino);
+		}
+		block_key key('f', ino);
+		key.setblock(rand() % 100000);
+		keys.push_back(key);
+	}
+	return keys;
+}
+
+// arg: keys share the inode, compare reaches the block number
+static void BM_block_key_less(benchmark::State & state)
+{
+	std::vector<block_key> keys = random_keys(4096, state.range(0));
+	size_t i = 0, less = 0;
+	for (auto _ : state) {
+		less += keys[i & 4095] < keys[(i + 1) & 4095];
+		++i;
+	}
+	benchmark::DoNotOptimize(less);
+}
+BENCHMARK(BM_block_key_less)->Arg(0)->Arg(1);
+
+static void BM_block_key_tostring(benchmark::State & state)
+{
+	std::vector<block_key> keys = random_keys(4096, false);
+	size_t i = 0;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(keys[i++ & 4095].tostring());
+	}
+}
+BENCHMARK(BM_block_key_tostring);
+
+// every thread cycles over its own 1024 keys of one part
+static void BM_bucket_add_op(benchmark::State & state)
+{
+	bucket & b = micro_fs()->buckets[1];
+	std::vector<block_key> keys = random_keys(1024, true);
+	std::string value(4096, 'x');
+	size_t i = 0;
+	for (auto _ : state) {
+		b.add_op(operation(keys[i++ & 1023], operation::PUT, value));
+	}
+	state.SetBytesProcessed(state.iterations() * value.size());
+}
+BENCHMARK(BM_bucket_add_op)->ThreadRange(1, 16)->UseRealTime();
+
+// hits in the dirty batch, the path of a read after write
+static void BM_bucket_read(benchmark::State & state)
+{
+	bucket & b = micro_fs()->buckets[1];
+	std::vector<block_key> keys = random_keys(1024, true);
+	std::string value(4096, 'x');
+	for (size_t i = 0; i < keys.size(); ++i) {
+		b.add_op(operation(keys[i], operation::PUT, value));
+	}
+	size_t i = 0;
+	for (auto _ : state) {
+		b.read(keys[i++ & 1023], value);
+	}
+}
+BENCHMARK(BM_bucket_read)->ThreadRange(1, 16)->UseRealTime();
+
+// store: children inodes are written too, protobuf directories read them
+static entry_ptr make_dir(FS * fs, int children, bool store)
+{
+	entry_ptr d(new dentry("dir", fs));
+	fs->allocate_inode(d.get());
+	batch_t batch;
+	char name[64];
+	for (int i = 0; i < children; ++i) {
+		snprintf(name, sizeof(name), "file%08d.c", i);
+		entry_ptr f(new fentry(name, fs));
+		fs->allocate_inode(f.get());
+		d->add_child(f);
+		if (store) {
+			f->write(batch);
+		}
+	}
+	d->write(batch);
+	fs->write(batch, true);
+	return d;
+}
+
+// args: children, flat directory record
+static void BM_dentry_write(benchmark::State & state)
+{
+	FS * fs = micro_fs();
+	fs->flat_dirs = state.range(1);
+	entry_ptr d = make_dir(fs, state.range(0), false);
+	batch_t batch;
+	for (auto _ : state) {
+		batch.clear();
+		d->write(batch);
+	}
+	state.counters["record_bytes"] = batch.empty() ? 0 : batch.back().data.size();
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	fs->flat_dirs = false;
+}
+
+// stored record to a listed directory, as a cold readdir
+static void BM_dentry_read(benchmark::State & state)
+{
+	FS * fs = micro_fs();
+	fs->flat_dirs = state.range(1);
+	entry_ptr d = make_dir(fs, state.range(0), true);
+	size_t listed = 0;
+	for (auto _ : state) {
+		entry_ptr r(new dentry("dir", fs));
+		memcpy(r->inode, d->inode, sizeof(r->inode));
+		listing_t names;
+		r->read();
+		dynamic_cast<dentry*>(r.get())->list(names);
+		listed = names.size();
+	}
+	state.counters["listed"] = listed;
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	fs->flat_dirs = false;
+}
+
+static void dir_args(benchmark::internal::Benchmark * b)
+{
+	for (int flat = 0; flat <= 1; ++flat) {
+		for (int n = 10; n <= 100000; n *= 10) {
+			b->Args({n, flat});
+		}
+	}
+}
+BENCHMARK(BM_dentry_write)->Apply(dir_args);
+BENCHMARK(BM_dentry_read)->Apply(dir_args);
+
+// arg: 0 block aligned, 1 off by 512, every op touches two blocks
+static void BM_fentry_write_buf(benchmark::State & state)
+{
+	FS * fs = micro_fs();
+	entry_ptr f(new fentry("w", fs));
+	fs->allocate_inode(f.get());
+	std::string data(fs->blocksize, 'w');
+	size_t skew = (state.range(0)) ? 512 : 0;
+	size_t i = 0;
+	for (auto _ : state) {
+		batch_t batch;
+		f->write_buf(batch, data.c_str(), data.size(), (i++ & 255) * data.size() + skew);
+		fs->write(batch, false);
+	}
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_fentry_write_buf)->Arg(0)->Arg(1);
+
+static void BM_fentry_read_buf(benchmark::State & state)
+{
+	FS * fs = micro_fs();
+	entry_ptr f(new fentry("r", fs));
+	fs->allocate_inode(f.get());
+	std::string data(fs->blocksize, 'r');
+	for (size_t i = 0; i < 257; ++i) {
+		batch_t batch;
+		f->write_buf(batch, data.c_str(), data.size(), i * data.size());
+		fs->write(batch, false);
+	}
+	fs->flush_buckets();
+
+	size_t skew = (state.range(0)) ? 512 : 0;
+	size_t i = 0;
+	for (auto _ : state) {
+		f->read_buf(&data[0], data.size(), (i++ & 255) * data.size() + skew);
+	}
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_fentry_read_buf)->Arg(0)->Arg(1);
+
+BENCHMARK_MAIN();
@@ -11,12 +11,45 @@ int main(int argc, char ** argv)
 	const char * dbpath = argv[argc - 1];
 	int blocksize = 128*1024;
 	int parts = 2;
+	int dentry_compression = FS::compression_type("snappy");
+	int data_compression = FS::compression_type("snappy");
+	bool dedup = false;
+	int vlog_min_size = 0;
+	int extent_size = 0;
+	bool inode64 = false;
+	bool flat_dirs = false;
+	int meta_parts = 1;
+	int placement = 0; // modulo
+	bool journal = false;
+	std::vector<std::string> data_dirs;
 
 	for (int i = 1; i < argc - 1; ++i) {
 		if (!strcmp(argv[i], "--blocksize")) {
 			blocksize = atoi(argv[i+1]);
 		} else if (!strcmp(argv[i], "--parts")) {
 			parts = atoi(argv[i+1]);
+		} else if (!strcmp(argv[i], "--dentry-compression")) {
+			dentry_compression = FS::compression_type(argv[i+1]);
+		} else if (!strcmp(argv[i], "--data-compression")) {
+			data_compression = FS::compression_type(argv[i+1]);
+		} else if (!strcmp(argv[i], "--dedup")) {
+			dedup = true;
+		} else if (!strcmp(argv[i], "--vlog")) {
+			vlog_min_size = atoi(argv[i+1]);
+		} else if (!strcmp(argv[i], "--extent-size")) {
+			extent_size = atoi(argv[i+1]);
+		} else if (!strcmp(argv[i], "--inode64")) {
+			inode64 = true;
+		} else if (!strcmp(argv[i], "--flat-dirs")) {
+			flat_dirs = true;
+		} else if (!strcmp(argv[i], "--meta-parts")) {
+			meta_parts = atoi(argv[i+1]);
+		} else if (!strcmp(argv[i], "--placement")) {
+			placement = FS::placement_type(argv[i+1]);
+		} else if (!strcmp(argv[i], "--data-dirs")) {
+			data_dirs = FS::split_dirs(argv[i+1]);
+		} else if (!strcmp(argv[i], "--journal")) {
+			journal = true;
 		}
 	}
 
@@ -30,7 +63,62 @@ int main(int argc, char ** argv)
 		return -1;
 	}
 
-	FS * fs = new FS(argv[1]);
+	if (placement < 0) {
+		fprintf(stderr, "invalid placement, use modulo or jump\n");
+		return -1;
+	}
+
+	if (meta_parts <= 0) {
+		fprintf(stderr, "invalid meta parts %d\n", meta_parts);
+		return -1;
+	}
+
+	if (extent_size != 0 && (extent_size < 2*blocksize || extent_size % blocksize != 0)) {
+		fprintf(stderr, "extent size must be a multiple of blocksize, at least two blocks\n");
+		return -1;
+	}
+
+	// extents are not hashed, keep dedup at block granularity
+	if (extent_size != 0 && dedup) {
+		fprintf(stderr, "--extent-size and --dedup are exclusive\n");
+		return -1;
+	}
+
+	if (vlog_min_size < 0) {
+		fprintf(stderr, "invalid vlog min size %d\n", vlog_min_size);
+		return -1;
+	}
+
+	// refcounts are not idempotent on replay, vlog values would be
+	// written twice anyway
+	if (journal && (dedup || vlog_min_size > 0)) {
+		fprintf(stderr, "--journal excludes --dedup and --vlog\n");
+		return -1;
+	}
+
+	// adaptive needs per-block values, only data parts have them
+	if (dentry_compression < 0 || dentry_compression == FS::compression_type("adaptive")) {
+		fprintf(stderr, "invalid dentry compression, use none, snappy or lz4\n");
+		return -1;
+	}
+
+	if (data_compression < 0) {
+		fprintf(stderr, "invalid data compression, use none, snappy, lz4 or adaptive\n");
+		return -1;
+	}
+
+	FS * fs = new FS(dbpath);
+	fs->dentry_compression = dentry_compression;
+	fs->data_compression = data_compression;
+	fs->dedup = dedup;
+	fs->vlog_min_size = vlog_min_size;
+	fs->extent_size = extent_size;
+	fs->inode64 = inode64;
+	fs->flat_dirs = flat_dirs;
+	fs->meta_parts = meta_parts;
+	fs->placement = placement;
+	fs->data_dirs = data_dirs;
+	fs->journaled = journal;
 	fs->mkfs(blocksize, parts);
 	delete fs;
 	return 0;
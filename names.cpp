@@ -0,0 +1,174 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include <boost/unordered_set.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "names.h"
+
+typedef name_t::rep rep;
+
+struct rep_hash
+{
+	size_t operator()(const rep * r) const { return r->hash; }
+	size_t operator()(const std::string & s) const {
+		return boost::hash_range(s.begin(), s.end());
+	}
+};
+
+struct rep_eq
+{
+	bool operator()(const rep * a, const rep * b) const { return a == b; }
+	bool operator()(const std::string & s, const rep * r) const {
+		return s.size() == r->size && memcmp(s.data(), r->data, r->size) == 0;
+	}
+};
+
+typedef boost::unordered_set<rep *, rep_hash, rep_eq> names_t;
+
+// sharded by hash, refcounts drop to zero only under the shard mutex
+struct shard
+{
+	boost::mutex mutex;
+	names_t names;
+	size_t bytes;
+
+	shard(): bytes(0) {}
+};
+
+enum { shards_count = 16 };
+
+static shard * shards()
+{
+	static shard s[shards_count];
+	return s;
+}
+
+static shard & shard_of(size_t hash)
+{
+	return shards()[hash % shards_count];
+}
+
+static rep * intern(const std::string & s, bool create)
+{
+	if (s.empty()) {
+		return 0;
+	}
+
+	size_t hash = rep_hash()(s);
+	shard & sh = shard_of(hash);
+	boost::unique_lock<boost::mutex> scoped_lock(sh.mutex);
+
+	names_t::iterator it = sh.names.find(s, rep_hash(), rep_eq());
+	if (it != sh.names.end()) {
+		(*it)->refs ++;
+		return *it;
+	}
+	if (!create) {
+		return 0;
+	}
+
+	rep * r = (rep *)malloc(offsetof(rep, data) + s.size() + 1);
+	new (&r->refs) boost::atomic<uint32_t>(1);
+	r->size = s.size();
+	r->hash = hash;
+	memcpy(r->data, s.c_str(), s.size() + 1);
+	sh.names.insert(r);
+	sh.bytes += offsetof(rep, data) + s.size() + 1;
+	return r;
+}
+
+name_t::name_t(const std::string & s): p(intern(s, true))
+{
+}
+
+name_t::name_t(const name_t & other): p(other.p)
+{
+	if (p) {
+		p->refs ++; // the other holder keeps it above zero
+	}
+}
+
+name_t::~name_t()
+{
+	release();
+}
+
+void name_t::release()
+{
+	if (!p) {
+		return;
+	}
+
+	shard & sh = shard_of(p->hash);
+	boost::unique_lock<boost::mutex> scoped_lock(sh.mutex);
+	if (--p->refs == 0) {
+		sh.names.erase(p);
+		sh.bytes -= offsetof(rep, data) + p->size + 1;
+		free(p);
+	}
+	p = 0;
+}
+
+name_t & name_t::operator=(const name_t & other)
+{
+	if (p != other.p) {
+		if (other.p) {
+			other.p->refs ++;
+		}
+		release();
+		p = other.p;
+	}
+	return *this;
+}
+
+name_t & name_t::operator=(const std::string & s)
+{
+	rep * r = intern(s, true);
+	release();
+	p = r;
+	return *this;
+}
+
+const char * name_t::c_str() const
+{
+	return (p) ? p->data : "";
+}
+
+size_t name_t::size() const
+{
+	return (p) ? p->size : 0;
+}
+
+bool name_t::operator==(const std::string & s) const
+{
+	return s.size() == size() && memcmp(s.data(), c_str(), s.size()) == 0;
+}
+
+name_t name_t::find(const std::string & s)
+{
+	name_t r;
+	r.p = intern(s, false);
+	return r;
+}
+
+size_t name_t::count()
+{
+	size_t n = 0;
+	for (int i = 0; i < shards_count; ++i) {
+		boost::unique_lock<boost::mutex> scoped_lock(shards()[i].mutex);
+		n += shards()[i].names.size();
+	}
+	return n;
+}
+
+size_t name_t::bytes()
+{
+	size_t n = 0;
+	for (int i = 0; i < shards_count; ++i) {
+		boost::unique_lock<boost::mutex> scoped_lock(shards()[i].mutex);
+		n += shards()[i].bytes;
+	}
+	return n;
+}
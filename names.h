@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <ostream>
+#include <boost/atomic.hpp>
+
+// interned, refcounted entry name. equal names share one buffer,
+// a name takes 8 bytes in a node and compares by pointer
+class name_t
+{
+public:
+	name_t(): p(0) {}
+	name_t(const std::string & s);
+	name_t(const name_t & other);
+	~name_t();
+
+	name_t & operator=(const name_t & other);
+	name_t & operator=(const std::string & s);
+
+	const char * c_str() const;
+	size_t size() const;
+	bool empty() const { return p == 0; }
+	std::string str() const { return std::string(c_str(), size()); }
+	operator std::string() const { return str(); }
+
+	bool operator==(const name_t & other) const { return p == other.p; }
+	bool operator!=(const name_t & other) const { return p != other.p; }
+	bool operator==(const std::string & s) const;
+
+	// existing name, empty when nobody holds it.
+	// lookups of missing names do not grow the table
+	static name_t find(const std::string & s);
+
+	// interned names and their bytes, for memory accounting
+	static size_t count();
+	static size_t bytes();
+
+	size_t hash() const { return (size_t)p >> 4; }
+
+	struct rep
+	{
+		boost::atomic<uint32_t> refs;
+		uint32_t size;
+		size_t hash;
+		char data[1];
+	};
+
+private:
+	rep * p;
+
+	void release();
+};
+
+// byte order, for listings
+struct name_less
+{
+	bool operator()(const name_t & a, const name_t & b) const {
+		return strcmp(a.c_str(), b.c_str()) < 0;
+	}
+};
+
+inline std::size_t hash_value(const name_t & n)
+{
+	return n.hash();
+}
+
+inline std::ostream & operator<<(std::ostream & out, const name_t & n)
+{
+	return out << n.c_str();
+}
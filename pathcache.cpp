@@ -0,0 +1,148 @@
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "pathcache.h"
+
+struct cached
+{
+	entry_ptr e;
+	size_t pos;      // in shard::clock
+	bool referenced; // looked up since the hand passed it
+};
+
+typedef boost::unordered_map<std::string, cached> paths_t;
+
+// a full shard evicts one path, CLOCK as FS::shrink does for directories
+struct path_cache::shard
+{
+	boost::mutex mutex;
+	paths_t paths;
+	// elements of paths, they stay put across rehashes
+	std::vector<paths_t::value_type*> clock;
+	size_t hand;
+
+	shard(): hand(0) {}
+
+	void remove(paths_t::iterator it, entry_ptr & old)
+	{
+		// the last one fills the hole
+		size_t pos = it->second.pos;
+		clock[pos] = clock.back();
+		clock[pos]->second.pos = pos;
+		clock.pop_back();
+		old.swap(it->second.e);
+		paths.erase(it);
+	}
+
+	void reset(paths_t & old)
+	{
+		old.swap(paths);
+		clock.clear();
+		hand = 0;
+	}
+};
+
+enum { shards_count = 16 };
+
+path_cache::path_cache(): hits(0), misses(0), capacity(0), gen(0)
+{
+	shards = new shard[shards_count];
+	set_capacity(64*1024);
+}
+
+path_cache::~path_cache()
+{
+	delete [] shards;
+}
+
+path_cache::shard & path_cache::shard_of(const std::string & path)
+{
+	return shards[boost::hash<std::string>()(path) % shards_count];
+}
+
+void path_cache::set_capacity(size_t n)
+{
+	capacity = (n + shards_count - 1) / shards_count;
+	clear();
+}
+
+bool path_cache::lookup(const std::string & path, entry_ptr & e)
+{
+	if (capacity == 0) {
+		return false;
+	}
+
+	shard & sh = shard_of(path);
+	boost::unique_lock<boost::mutex> scoped_lock(sh.mutex);
+	paths_t::iterator it = sh.paths.find(path);
+	if (it == sh.paths.end()) {
+		misses ++;
+		return false;
+	}
+	hits ++;
+	it->second.referenced = true;
+	e = it->second.e;
+	return true;
+}
+
+void path_cache::insert(const std::string & path, const entry_ptr & e, uint64_t g)
+{
+	if (capacity == 0) {
+		return;
+	}
+
+	entry_ptr old; // released outside of the lock
+	shard & sh = shard_of(path);
+	boost::unique_lock<boost::mutex> scoped_lock(sh.mutex);
+	// checked under the shard lock, erase bumps gen under the same lock
+	if (g != gen) {
+		return;
+	}
+	paths_t::iterator it = sh.paths.find(path);
+	if (it != sh.paths.end()) {
+		it->second.e = e;
+		return;
+	}
+	if (sh.clock.size() >= capacity) {
+		// recently looked up paths get a second round
+		for (;;) {
+			sh.hand %= sh.clock.size();
+			cached & c = sh.clock[sh.hand]->second;
+			if (!c.referenced) {
+				break;
+			}
+			c.referenced = false;
+			sh.hand ++;
+		}
+		sh.remove(sh.paths.find(sh.clock[sh.hand]->first), old);
+	}
+	paths_t::value_type & v = *sh.paths.insert(std::make_pair(path, cached())).first;
+	v.second.e = e;
+	v.second.pos = sh.clock.size();
+	v.second.referenced = false;
+	sh.clock.push_back(&v);
+}
+
+void path_cache::erase(const std::string & path)
+{
+	entry_ptr old;
+	shard & sh = shard_of(path);
+	boost::unique_lock<boost::mutex> scoped_lock(sh.mutex);
+	gen ++;
+	paths_t::iterator it = sh.paths.find(path);
+	if (it != sh.paths.end()) {
+		sh.remove(it, old);
+	}
+}
+
+void path_cache::clear()
+{
+	for (int i = 0; i < shards_count; ++i) {
+		paths_t old;
+		boost::unique_lock<boost::mutex> scoped_lock(shards[i].mutex);
+		gen ++;
+		shards[i].reset(old);
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <boost/atomic.hpp>
+
+#include "dentry.h"
+
+// full path -> entry, null entries cache missing names. sharded by
+// path hash. callers invalidate after each namespace change; a lookup
+// that raced with a change is not cached, see generation()
+class path_cache
+{
+public:
+	path_cache();
+	~path_cache();
+
+	// false on miss, a hit may return a null entry
+	bool lookup(const std::string & path, entry_ptr & e);
+	// ignored when anything was invalidated since gen was taken
+	void insert(const std::string & path, const entry_ptr & e, uint64_t gen);
+	void erase(const std::string & path);
+	void clear();
+
+	uint64_t generation() const { return gen; }
+
+	// entries, 0 disables the cache
+	void set_capacity(size_t n);
+
+	boost::atomic<uint64_t> hits;
+	boost::atomic<uint64_t> misses;
+
+private:
+	struct shard;
+	shard * shards;
+	size_t capacity; // per shard
+	boost::atomic<uint64_t> gen;
+
+	shard & shard_of(const std::string & path);
+};
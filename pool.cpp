@@ -0,0 +1,97 @@
+#include <stdlib.h>
+
+#include <new>
+#include <boost/thread/mutex.hpp>
+
+#include "pool.h"
+
+enum {
+	align = 16,
+	max_cell = 512,
+	slab_size = 64*1024
+};
+
+struct free_cell
+{
+	free_cell * next;
+};
+
+struct size_class
+{
+	boost::mutex mutex;
+	free_cell * free;
+	size_t slabs;
+
+	size_class(): free(0), slabs(0) {}
+};
+
+static size_class * classes()
+{
+	static size_class c[max_cell / align + 1];
+	return c;
+}
+
+static size_t cell_size(size_t size)
+{
+	return (size + align - 1) / align * align;
+}
+
+void * node_alloc(size_t size)
+{
+	size_t cell = cell_size(size);
+	if (cell > max_cell) {
+		void * p = malloc(size);
+		if (!p) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+	size_class & c = classes()[cell / align];
+	boost::unique_lock<boost::mutex> scoped_lock(c.mutex);
+	if (!c.free) {
+		char * slab = (char *)malloc(slab_size);
+		if (!slab) {
+			throw std::bad_alloc();
+		}
+		for (size_t off = 0; off + cell <= slab_size; off += cell) {
+			free_cell * f = (free_cell *)(slab + off);
+			f->next = c.free;
+			c.free = f;
+		}
+		c.slabs ++;
+	}
+
+	free_cell * f = c.free;
+	c.free = f->next;
+	return f;
+}
+
+void node_free(void * p, size_t size)
+{
+	if (!p) {
+		return;
+	}
+
+	size_t cell = cell_size(size);
+	if (cell > max_cell) {
+		free(p);
+		return;
+	}
+
+	size_class & c = classes()[cell / align];
+	boost::unique_lock<boost::mutex> scoped_lock(c.mutex);
+	free_cell * f = (free_cell *)p;
+	f->next = c.free;
+	c.free = f;
+}
+
+size_t node_pool_bytes()
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i <= max_cell / align; ++i) {
+		boost::unique_lock<boost::mutex> scoped_lock(classes()[i].mutex);
+		bytes += classes()[i].slabs * slab_size;
+	}
+	return bytes;
+}
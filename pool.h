@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+// slab allocator for in-memory nodes: 64k slabs carved into equal
+// 16 byte aligned cells, one free list per size, no malloc header.
+// slabs are kept for reuse, larger sizes go to malloc
+void * node_alloc(size_t size);
+void node_free(void * p, size_t size);
+
+// bytes held in slabs
+size_t node_pool_bytes();
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+
+#include "leveldb/write_batch.h"
+#include "messages.pb.h"
+
+#include "fs.h"
+
+// offline change of the number of data parts.
+// keys are moved to the jump consistent hash layout, after the first
+// reshard growing from n to m parts moves only (m-n)/m of the keys.
+// the target is stored in fsmeta before any key moves, mount refuses
+// the filesystem until a run to that target finishes; after a crash
+// run the tool again with the same parts.
+//
+// usage: reshard.ldbfs [--threads N] parts dbpath
+
+struct reshard
+{
+	FS & fs;
+	int from;
+	int to;
+
+	std::vector<leveldb::DB *> dbs;  // data parts of the new layout
+	std::vector<vlog *> vlogs;
+
+	boost::mutex queue_mutex;
+	int next_part;
+
+	boost::atomic<uint64_t> scanned;
+	boost::atomic<uint64_t> moved;
+	boost::atomic<uint64_t> bytes;
+	boost::atomic<int> done;
+	boost::atomic<bool> failed;
+
+	reshard(FS & fs, int to):
+		fs(fs), from(fs.parts), to(to), next_part(0),
+		scanned(0), moved(0), bytes(0), done(0), failed(false)
+	{
+	}
+
+	bool open();
+	void worker();
+	bool move_part(int src);
+	bool flush(int src, std::vector<leveldb::WriteBatch> & out,
+	           leveldb::WriteBatch & remove);
+};
+
+bool reshard::open()
+{
+	int n = std::max(from, to);
+	dbs.resize(n);
+	vlogs.resize(n);
+	for (int i = 0; i < n; ++i) {
+		if (i < from) {
+			dbs[i] = fs.buckets[i+1].db;
+			vlogs[i] = (fs.vlogs) ? &fs.vlogs[i] : 0;
+			continue;
+		}
+
+		char buf[1024];
+		leveldb::Options options = fs.data_options;
+		options.create_if_missing = true;
+		snprintf(buf, sizeof(buf), "/fentry-%04d", i);
+		leveldb::Status status = leveldb::DB::Open(options, fs.part_dir(i) + buf, &dbs[i]);
+		if (!status.ok()) {
+			fprintf(stderr, "cannot open %s: %s\n", buf, status.ToString().c_str());
+			return false;
+		}
+
+		vlogs[i] = 0;
+		if (fs.vlogs) {
+			snprintf(buf, sizeof(buf), "/vlog-%04d", i);
+			vlogs[i] = new vlog;
+			if (!vlogs[i]->open(fs.part_dir(i) + buf)) {
+				fprintf(stderr, "cannot open %s\n", buf);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void reshard::worker()
+{
+	for (;;) {
+		int src;
+		{
+			boost::unique_lock<boost::mutex> scoped_lock(queue_mutex);
+			if (next_part >= from) {
+				return;
+			}
+			src = next_part++;
+		}
+		if (!move_part(src)) {
+			failed = true;
+		}
+		done ++;
+	}
+}
+
+bool reshard::flush(int src, std::vector<leveldb::WriteBatch> & out,
+                    leveldb::WriteBatch & remove)
+{
+	leveldb::WriteOptions writeOptions;
+	writeOptions.sync = true;
+
+	// copies are durable before the originals go away
+	for (int i = 0; i < (int)out.size(); ++i) {
+		if (vlogs[i] && !vlogs[i]->sync()) {
+			return false;
+		}
+		if (!dbs[i]->Write(writeOptions, &out[i]).ok()) {
+			return false;
+		}
+		out[i].Clear();
+	}
+
+	if (!dbs[src]->Write(writeOptions, &remove).ok()) {
+		return false;
+	}
+	remove.Clear();
+	return true;
+}
+
+bool reshard::move_part(int src)
+{
+	std::vector<leveldb::WriteBatch> out(dbs.size());
+	leveldb::WriteBatch remove;
+	size_t pending = 0;
+
+	leveldb::ReadOptions readOptions;
+	readOptions.fill_cache = false;
+	leveldb::Iterator * it = dbs[src]->NewIterator(readOptions);
+
+	uuid_t zero;
+	memset(zero, 0, sizeof(zero));
+
+	for (it->SeekToFirst(); it->Valid(); it->Next()) {
+		scanned ++;
+
+		block_key key(0, zero);
+		if (!key.decode(it->key().data(), it->key().size(), fs.inode64)) {
+			fprintf(stderr, "part %d: unknown key of %d bytes\n", src, (int)it->key().size());
+			continue;
+		}
+		if (key.type == 'w') {
+			continue; // intent marker belongs to the part
+		}
+
+		int dst = fs.data_part(key, to, proto::fsmeta::JUMP) - 1;
+		if (dst == src) {
+			continue;
+		}
+
+		std::string value = it->value().ToString();
+
+		// vlog pointers are local to the part, the payload moves too
+		vlog::pointer ptr;
+		if (vlogs[src] && vlog::decode(value, ptr)) {
+			std::string data;
+			if (!vlogs[src]->read(ptr, data) ||
+			    !vlogs[dst]->append(key, data, ptr))
+			{
+				fprintf(stderr, "part %d: cannot move vlog value %s\n",
+				        src, key.tostring().c_str());
+				delete it;
+				return false;
+			}
+			bytes += data.size();
+			value = vlog::encode(ptr);
+		}
+
+		out[dst].Put(it->key(), value);
+		remove.Delete(it->key());
+		moved ++;
+		bytes += it->key().size() + value.size();
+		pending += it->key().size() + value.size();
+
+		if (pending > 16*1024*1024) {
+			if (!flush(src, out, remove)) {
+				fprintf(stderr, "part %d: cannot write\n", src);
+				delete it;
+				return false;
+			}
+			pending = 0;
+		}
+	}
+
+	bool ok = it->status().ok();
+	delete it;
+	return ok && flush(src, out, remove);
+}
+
+int main(int argc, char ** argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s [--threads N] parts dbpath\n", argv[0]);
+		return -1;
+	}
+
+	const char * dbpath = argv[argc - 1];
+	int parts = atoi(argv[argc - 2]);
+	int threads = 4;
+	uuid_t metauuid;
+	memset(metauuid, 0, sizeof(metauuid));
+	block_key metakey('m', metauuid);
+	std::string value;
+	proto::fsmeta fsmeta;
+
+	for (int i = 1; i < argc - 2; ++i) {
+		if (!strcmp(argv[i], "--threads")) {
+			threads = atoi(argv[i+1]);
+		}
+	}
+
+	if (parts <= 0 || threads <= 0) {
+		fprintf(stderr, "invalid parts %d or threads %d\n", parts, threads);
+		return -1;
+	}
+
+	boost::log::core::get()->set_logging_enabled(false);
+
+	FS fs(dbpath);
+	fs.open(false);
+
+	if (fs.reshard_parts > 0 && fs.reshard_parts != parts) {
+		fprintf(stderr, "reshard to %d parts did not finish, run it again with %d\n",
+		        fs.reshard_parts, fs.reshard_parts);
+		return -1;
+	}
+
+	if (parts == fs.parts && fs.placement == proto::fsmeta::JUMP) {
+		fprintf(stderr, "already %d parts\n", parts);
+		return 0;
+	}
+
+	if (!fs.buckets[0].read(metakey, value) || !fsmeta.ParseFromString(value)) {
+		fprintf(stderr, "cannot read meta\n");
+		return -1;
+	}
+	fsmeta.set_reshard_parts(parts);
+	fsmeta.SerializeToString(&value);
+	fs.buckets[0].add_op(operation(metakey, operation::PUT, value));
+	if (!fs.buckets[0].flush(0)) {
+		fprintf(stderr, "cannot write meta\n");
+		return -1;
+	}
+
+	reshard r(fs, parts);
+	if (!r.open()) {
+		return -1;
+	}
+
+	printf("reshard %d -> %d parts, %d threads\n", r.from, r.to, threads);
+
+	boost::thread_group workers;
+	for (int i = 0; i < threads; ++i) {
+		workers.create_thread(boost::bind(&reshard::worker, &r));
+	}
+
+	while (r.done < r.from) {
+		boost::this_thread::sleep(boost::posix_time::milliseconds(1000));
+		printf("parts %d/%d, scanned %lu, moved %lu, %.1f MB\n",
+		       (int)r.done, r.from, (unsigned long)r.scanned,
+		       (unsigned long)r.moved, r.bytes / 1024.0 / 1024.0);
+		fflush(stdout);
+	}
+	workers.join_all();
+
+	if (r.failed) {
+		fprintf(stderr, "reshard failed, run again with %d parts\n", parts);
+		return -1;
+	}
+
+	// switch the layout
+	fsmeta.set_parts(parts);
+	fsmeta.set_data_placement(proto::fsmeta::JUMP);
+	fsmeta.clear_reshard_parts();
+	fsmeta.SerializeToString(&value);
+	fs.buckets[0].add_op(operation(metakey, operation::PUT, value));
+	if (!fs.buckets[0].flush(0)) {
+		fprintf(stderr, "cannot write meta\n");
+		return -1;
+	}
+
+	printf("done, moved %lu of %lu keys, %.1f MB\n",
+	       (unsigned long)r.moved, (unsigned long)r.scanned,
+	       r.bytes / 1024.0 / 1024.0);
+	for (int i = parts; i < r.from; ++i) {
+		printf("%s/fentry-%04d is empty and can be removed\n", fs.part_dir(i).c_str(), i);
+	}
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "timing.h"
+
+// stat-heavy load, what a compiler or package manager does: stats
+// existing files and probes names that do not exist, round after round.
+// run on a mount with default timeouts and with -p attr_timeout=0 to
+// compare
+//
+// usage: test-stat dir [files] [rounds]
+
+int main(int argc, char ** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s dir [files] [rounds]\n", argv[0]);
+		return 1;
+	}
+	const char * dir = argv[1];
+	int files = (argc > 2) ? atoi(argv[2]) : 1000;
+	int rounds = (argc > 3) ? atoi(argv[3]) : 10;
+
+	char fn[1024];
+	struct stat st;
+
+	mkdir(dir, 0755);
+	for (int i = 0; i < files; ++i) {
+		snprintf(fn, sizeof(fn), "%s/h%05d.h", dir, i);
+		int fd = open(fn, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0) {
+			perror(fn);
+			return 1;
+		}
+		close(fd);
+	}
+
+	for (int r = 0; r < rounds; ++r) {
+		uint64_t t1 = now_ns();
+		int found = 0;
+		for (int i = 0; i < files; ++i) {
+			snprintf(fn, sizeof(fn), "%s/h%05d.h", dir, i);
+			found += (stat(fn, &st) == 0);
+		}
+		uint64_t t2 = now_ns();
+		int missing = 0;
+		for (int i = 0; i < files; ++i) {
+			snprintf(fn, sizeof(fn), "%s/missing/h%05d.h", dir, i);
+			missing += (stat(fn, &st) != 0);
+			snprintf(fn, sizeof(fn), "%s/m%05d.h", dir, i);
+			missing += (stat(fn, &st) != 0);
+		}
+		uint64_t t3 = now_ns();
+
+		double stat_s = (t2 - t1) / 1e9, missing_s = (t3 - t2) / 1e9;
+		fprintf(stderr, "round %d: stat %d in %.3f s, %.0f/s; "
+		        "missing %d in %.3f s, %.0f/s\n",
+		        r, found, stat_s, found / stat_s,
+		        missing, missing_s, missing / missing_s);
+	}
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+#include <string.h>
+#include <stdio.h>
+
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include "stats.h"
+
+// written by the owning thread only, relaxed atomics keep readers exact
+// per word without a lock
+struct thread_ops
+{
+	boost::atomic<uint64_t> count[OP_COUNT];
+	boost::atomic<uint64_t> ns[OP_COUNT];
+	boost::atomic<uint64_t> hist[OP_COUNT][LATENCY_BUCKETS];
+
+	thread_ops() {
+		for (int i = 0; i < OP_COUNT; ++i) {
+			count[i] = 0;
+			ns[i] = 0;
+			for (int j = 0; j < LATENCY_BUCKETS; ++j) {
+				hist[i][j] = 0;
+			}
+		}
+	}
+};
+
+// slots outlive their threads, FUSE threads come and go. the slot of
+// an exited thread goes to the next new one and keeps its counts,
+// so the totals stay exact and there are no more slots than threads
+// ever ran at once
+static boost::mutex threads_mutex;
+static std::vector<thread_ops *> threads;
+static std::vector<thread_ops *> free_slots;
+static __thread thread_ops * local = 0;
+
+static void release_slot(thread_ops * o)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(threads_mutex);
+	free_slots.push_back(o);
+}
+
+// only for its exit hook, count_op reads local
+static boost::thread_specific_ptr<thread_ops> owned(release_slot);
+
+static const char * names[OP_COUNT] = {
+	"getattr", "readdir", "open", "release", "read", "write", "fsync",
+	"create", "mkdir", "unlink", "rmdir", "rename", "truncate",
+	"symlink", "readlink", "xattr"
+};
+
+static void add(boost::atomic<uint64_t> & v, uint64_t d)
+{
+	// single writer, no read-modify-write needed
+	v.store(v.load(boost::memory_order_relaxed) + d, boost::memory_order_relaxed);
+}
+
+void count_op(int op, uint64_t ns)
+{
+	if (!local) {
+		boost::unique_lock<boost::mutex> scoped_lock(threads_mutex);
+		if (free_slots.empty()) {
+			local = new thread_ops;
+			threads.push_back(local);
+		} else {
+			local = free_slots.back();
+			free_slots.pop_back();
+		}
+		scoped_lock.unlock();
+		owned.reset(local);
+	}
+
+	uint64_t us = ns / 1000;
+	int b = 0;
+	while (us > 0 && b < LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		b ++;
+	}
+
+	add(local->count[op], 1);
+	add(local->ns[op], ns);
+	add(local->hist[op][b], 1);
+}
+
+void collect_ops(op_totals & t)
+{
+	memset(&t, 0, sizeof(t));
+	boost::unique_lock<boost::mutex> scoped_lock(threads_mutex);
+	for (size_t k = 0; k < threads.size(); ++k) {
+		thread_ops * o = threads[k];
+		for (int i = 0; i < OP_COUNT; ++i) {
+			t.count[i] += o->count[i].load(boost::memory_order_relaxed);
+			t.ns[i] += o->ns[i].load(boost::memory_order_relaxed);
+			for (int j = 0; j < LATENCY_BUCKETS; ++j) {
+				t.hist[i][j] += o->hist[i][j].load(boost::memory_order_relaxed);
+			}
+		}
+	}
+}
+
+const char * op_name(int op)
+{
+	return names[op];
+}
+
+// upper bound of the bucket holding the p-th fraction, microseconds
+static uint64_t percentile(const uint64_t * hist, uint64_t count, double p)
+{
+	uint64_t rank = (uint64_t)(count * p);
+	uint64_t seen = 0;
+	for (int j = 0; j < LATENCY_BUCKETS; ++j) {
+		seen += hist[j];
+		if (seen > rank) {
+			return (j == 0) ? 1 : (1ULL << j);
+		}
+	}
+	return 1ULL << (LATENCY_BUCKETS - 1);
+}
+
+std::string ops_report()
+{
+	op_totals t;
+	collect_ops(t);
+
+	std::string r;
+	char line[512];
+	snprintf(line, sizeof(line), "%-10s %12s %10s %8s %8s %8s  %s\n",
+	         "op", "count", "mean_us", "p50_us", "p99_us", "max_us", "histogram (log2 us)");
+	r += line;
+	for (int i = 0; i < OP_COUNT; ++i) {
+		if (t.count[i] == 0) {
+			continue;
+		}
+		int last = 0;
+		for (int j = 0; j < LATENCY_BUCKETS; ++j) {
+			if (t.hist[i][j]) {
+				last = j;
+			}
+		}
+		snprintf(line, sizeof(line), "%-10s %12llu %10.1f %8llu %8llu %8llu ",
+		         names[i], (unsigned long long)t.count[i],
+		         t.ns[i] / 1000.0 / t.count[i],
+		         (unsigned long long)percentile(t.hist[i], t.count[i], 0.5),
+		         (unsigned long long)percentile(t.hist[i], t.count[i], 0.99),
+		         (unsigned long long)((last == 0) ? 1 : (1ULL << last)));
+		r += line;
+		for (int j = 0; j <= last; ++j) {
+			snprintf(line, sizeof(line), " %llu", (unsigned long long)t.hist[i][j]);
+			r += line;
+		}
+		r += "\n";
+	}
+	return r;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+#include "timing.h"
+#include "trace.h"
+
+// per FUSE operation counts and latency histograms. every thread counts
+// into its own slots, readers sum them, the hot path takes no lock and
+// shares no cache line
+enum {
+	OP_GETATTR = 0,
+	OP_READDIR,
+	OP_OPEN,
+	OP_RELEASE,
+	OP_READ,
+	OP_WRITE,
+	OP_FSYNC,
+	OP_CREATE,
+	OP_MKDIR,
+	OP_UNLINK,
+	OP_RMDIR,
+	OP_RENAME,
+	OP_TRUNCATE,
+	OP_SYMLINK,
+	OP_READLINK,
+	OP_XATTR,
+	OP_COUNT
+};
+
+enum {
+	LATENCY_BUCKETS = 24 // log2 of microseconds, the last one is open ended
+};
+
+void count_op(int op, uint64_t ns);
+
+// totals over all threads
+struct op_totals
+{
+	uint64_t count[OP_COUNT];
+	uint64_t ns[OP_COUNT];
+	uint64_t hist[OP_COUNT][LATENCY_BUCKETS];
+};
+
+void collect_ops(op_totals & t);
+const char * op_name(int op);
+
+// ops table with count, mean and percentiles from the histogram
+std::string ops_report();
+
+struct op_timer
+{
+	int op;
+	uint64_t start;
+
+	op_timer(int op): op(op), start(now_ns()) {}
+	~op_timer() {
+		uint64_t end = now_ns();
+		count_op(op, end - start);
+#ifdef LDBFS_TRACING
+		trace_record(op_name(op), start, end);
+#endif
+	}
+};
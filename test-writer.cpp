@@ -5,10 +5,155 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <vector>
+
+#include "timing.h"
+
+// load generator for a mounted ldbfs, run in the mount point.
+// every thread owns one file, ops run until --duration or --bytes
+//
+// usage: test-writer [--threads n] [--iosize n] [--duration s] [--bytes MB]
+//          [--read-ratio pct] [--random] [--append] [--file-size MB]
+//          [--sync none|data|meta] [--preallocate] [--verify] [--pid ldbfs-pid]
+//        test-writer threads blocksize metasync preallocate [pid]
+//
+// --verify stamps every block with its file, offset and version and
+// checks reads against the last version written there
 
 int blocksize;
 int metasync;
 int preallocate;
+size_t total_written;
+
+int threads = 1;
+int sync_mode = 1; // 0: none, 1: fdatasync, 2: fsync
+int read_ratio;    // percent of ops
+int random_offsets;
+int append;
+int verify;
+size_t file_size = 128*1024*1024;
+size_t byte_target; // 0: until duration
+int duration = -1; // seconds, 0: until the byte target
+volatile int stop;
+
+size_t total_read;
+size_t verify_errors;
+
+enum {
+	SUB_BUCKETS = 16,
+	HIST_BUCKETS = 64 * SUB_BUCKETS
+};
+
+// log-linear: 16 steps per power of two, within 6% of the value
+struct histogram
+{
+	uint64_t count[HIST_BUCKETS];
+	uint64_t n;
+
+	histogram() { memset(this, 0, sizeof(*this)); }
+
+	static int index(uint64_t ns)
+	{
+		if (ns < SUB_BUCKETS) {
+			return ns;
+		}
+		int msb = 63 - __builtin_clzll(ns);
+		int sub = (ns >> (msb - 4)) & (SUB_BUCKETS - 1);
+		return (msb - 3) * SUB_BUCKETS + sub;
+	}
+
+	static uint64_t value(int i)
+	{
+		if (i < SUB_BUCKETS) {
+			return i;
+		}
+		int msb = i / SUB_BUCKETS + 3;
+		uint64_t sub = i % SUB_BUCKETS;
+		return ((uint64_t)SUB_BUCKETS + sub) << (msb - 4);
+	}
+
+	void add(uint64_t ns) { count[index(ns)] ++; n ++; }
+
+	void merge(const histogram & h)
+	{
+		for (int i = 0; i < HIST_BUCKETS; ++i) {
+			count[i] += h.count[i];
+		}
+		n += h.n;
+	}
+
+	double percentile(double p) const
+	{
+		uint64_t rank = (uint64_t)(n * p), seen = 0;
+		for (int i = 0; i < HIST_BUCKETS; ++i) {
+			seen += count[i];
+			if (count[i] && seen > rank) {
+				return value(i) / 1e3;
+			}
+		}
+		return 0;
+	}
+};
+
+struct worker
+{
+	long number;
+	histogram reads;
+	histogram writes;
+};
+
+static uint64_t next_random(uint64_t & s)
+{
+	// xorshift64*
+	s ^= s >> 12;
+	s ^= s << 25;
+	s ^= s >> 27;
+	return s * 2685821657736338717ULL;
+}
+
+// block contents for verify, a function of where and which version
+static void fill(char * data, long number, size_t off, uint64_t version)
+{
+	uint64_t s = (number + 1) * 0x9e3779b97f4a7c15ULL ^ (off + 1) * 0xbf58476d1ce4e5b9ULL ^ version;
+	uint64_t header[3] = { (uint64_t)number, off, version };
+	size_t i = 0;
+	if ((size_t)blocksize >= sizeof(header)) {
+		memcpy(data, header, sizeof(header));
+		i = sizeof(header);
+	}
+	for (; i + 8 <= (size_t)blocksize; i += 8) {
+		uint64_t v = next_random(s);
+		memcpy(data + i, &v, 8);
+	}
+	for (; i < (size_t)blocksize; ++i) {
+		data[i] = (char)next_random(s);
+	}
+}
+
+// bytes the process wrote to storage, /proc/<pid>/io
+static long long storage_written(int pid)
+{
+	char fn[256];
+	char line[256];
+	long long bytes = -1;
+	snprintf(fn, sizeof(fn), "/proc/%d/io", pid);
+	FILE * f = fopen(fn, "r");
+	if (!f) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "write_bytes:", 12)) {
+			bytes = atoll(line + 12);
+		}
+	}
+	fclose(f);
+	return bytes;
+}
 
 int newfile(long number)
 {
@@ -16,68 +161,253 @@ int newfile(long number)
 	snprintf(fn, sizeof(fn), "%05ld", number);
 
 	unlink(fn);
-	
-	int fd = open(fn, O_TRUNC | O_WRONLY | O_CREAT, 0644);
+
+	int fd = open(fn, O_TRUNC | O_RDWR | O_CREAT, 0644);
 
 	return fd;
 }
 
+static int sync_fd(int fd)
+{
+	if (sync_mode == 2 || metasync) {
+		return fsync(fd);
+	} else if (sync_mode == 1) {
+		return fdatasync(fd);
+	}
+	return 0;
+}
+
 void * writer(void * a)
 {
-	long number = (long)a;
+	worker * w = (worker*)a;
+	long number = w->number;
+
+	std::vector<char> data(blocksize);
+	std::vector<char> expected(blocksize);
+	std::vector<char> buf(blocksize);
+	uint64_t seed = number * 7919 + 1;
+	size_t slots = file_size / blocksize;
+	// last version written per block, for verify
+	std::vector<uint64_t> versions(slots);
 
-	char data[blocksize];
- 
 	for (int j = 0; j < blocksize; ++j) {
-		data[j] = (char)(rand() % 256);
+		data[j] = (char)next_random(seed);
 	}
 
-	size_t written = 0;
-
 	int fd = newfile(number);
-	size_t maxsize = 128*1024*1024;
+	if (fd < 0) {
+		perror("open");
+		return 0;
+	}
 	if (preallocate) {
-		fallocate(fd, 0, 0, maxsize);
+		fallocate(fd, 0, 0, file_size);
 	}
 
-	while (1) {
-		written += write(fd, data, sizeof(data));
-		if (metasync) {
-			fsync(fd);
-		} else {
-			fdatasync(fd);
+	// reads and overwrites need something to hit
+	size_t size = 0;
+	if (read_ratio > 0 || (verify && !append)) {
+		for (size_t i = 0; i < slots; ++i) {
+			if (verify) {
+				fill(&data[0], number, i * blocksize, ++versions[i]);
+			}
+			if (pwrite(fd, &data[0], blocksize, i * blocksize) != blocksize) {
+				perror("prefill");
+				break;
+			}
 		}
+		sync_fd(fd);
+		size = slots * blocksize;
+	}
 
-		if (written > maxsize) {
-			close(fd);
-			fd = newfile(number);
-			written = 0;
+	size_t cursor = 0;
+	while (!stop) {
+		bool rd = size > 0 && (int)(next_random(seed) % 100) < read_ratio;
+		size_t slot;
+		if (append && !rd) {
+			if (size >= slots * (size_t)blocksize) {
+				close(fd);
+				fd = newfile(number);
+				size = 0;
+				std::fill(versions.begin(), versions.end(), 0);
+				fprintf(stderr, "[%ld]: new segment\n", number);
+			}
+			slot = size / blocksize;
+		} else if (random_offsets) {
+			size_t limit = (size) ? size / blocksize : slots;
+			slot = next_random(seed) % limit;
+		} else {
+			size_t limit = (rd || append) ? size / blocksize : slots;
+			slot = cursor++ % limit;
+		}
+		off_t off = (off_t)slot * blocksize;
 
-			fprintf(stderr, "[%ld]: new segment\n", number); 
+		if (rd) {
+			uint64_t t1 = now_ns();
+			ssize_t r = pread(fd, &buf[0], blocksize, off);
+			w->reads.add(now_ns() - t1);
+			if (r != blocksize) {
+				perror("pread");
+				__sync_fetch_and_add(&verify_errors, 1);
+				continue;
+			}
+			__sync_fetch_and_add(&total_read, r);
+			if (verify) {
+				fill(&expected[0], number, off, versions[slot]);
+				if (memcmp(&expected[0], &buf[0], blocksize) != 0) {
+					fprintf(stderr, "[%ld]: verify failed at %lld\n", number, (long long)off);
+					__sync_fetch_and_add(&verify_errors, 1);
+				}
+			}
+		} else {
+			if (verify) {
+				fill(&data[0], number, off, ++versions[slot]);
+			}
+			uint64_t t1 = now_ns();
+			ssize_t r = pwrite(fd, &data[0], blocksize, off);
+			if (r == blocksize) {
+				sync_fd(fd);
+			}
+			w->writes.add(now_ns() - t1);
+			if (r != blocksize) {
+				perror("pwrite");
+				break;
+			}
+			if ((size_t)off + r > size) {
+				size = off + r;
+			}
+			size_t total = __sync_add_and_fetch(&total_written, r);
+			if (byte_target && total >= byte_target) {
+				stop = 1;
+			}
 		}
 	}
 
 	close(fd);
+	return 0;
+}
+
+static void report(const char * name, const histogram & h, double seconds)
+{
+	printf("%-6s %10lu ops %10.1f ops/s  p50 %8.1f  p99 %8.1f  p999 %8.1f us\n",
+	       name, (unsigned long)h.n, h.n / seconds,
+	       h.percentile(0.5), h.percentile(0.99), h.percentile(0.999));
 }
 
 int main(int argc, char ** argv)
 {
-	int threads = atoi(argv[1]);
-	blocksize = atoi(argv[2]);
-	metasync = atoi(argv[3]);
-	preallocate = atoi(argv[4]);
-	fprintf(stderr, "thread=%d, blocksize=%d, metasync=%d, preallocate=%d\n", 
-			threads, blocksize, metasync, preallocate);
+	int pid = 0;
+	blocksize = 4096;
+
+	if (argc > 4 && isdigit(argv[1][0])) {
+		// old form: threads blocksize metasync preallocate [pid]
+		threads = atoi(argv[1]);
+		blocksize = atoi(argv[2]);
+		metasync = atoi(argv[3]);
+		preallocate = atoi(argv[4]);
+		pid = (argc > 5) ? atoi(argv[5]) : 0;
+	} else {
+		for (int i = 1; i < argc; ++i) {
+			const char * v = (i + 1 < argc) ? argv[i+1] : "0";
+			if (!strcmp(argv[i], "--threads")) {
+				threads = atoi(v);
+			} else if (!strcmp(argv[i], "--iosize")) {
+				blocksize = atoi(v);
+			} else if (!strcmp(argv[i], "--duration")) {
+				duration = atoi(v);
+			} else if (!strcmp(argv[i], "--bytes")) {
+				byte_target = atoll(v) * 1024 * 1024;
+			} else if (!strcmp(argv[i], "--read-ratio")) {
+				read_ratio = atoi(v);
+			} else if (!strcmp(argv[i], "--random")) {
+				random_offsets = 1;
+			} else if (!strcmp(argv[i], "--append")) {
+				append = 1;
+			} else if (!strcmp(argv[i], "--file-size")) {
+				file_size = atoll(v) * 1024 * 1024;
+			} else if (!strcmp(argv[i], "--sync")) {
+				sync_mode = (!strcmp(v, "none")) ? 0 : (!strcmp(v, "meta")) ? 2 : 1;
+			} else if (!strcmp(argv[i], "--preallocate")) {
+				preallocate = 1;
+			} else if (!strcmp(argv[i], "--verify")) {
+				verify = 1;
+			} else if (!strcmp(argv[i], "--pid")) {
+				pid = atoi(v);
+			}
+		}
+	}
+
+	if (threads <= 0 || blocksize <= 0 || file_size < (size_t)blocksize ||
+	    read_ratio < 0 || read_ratio > 100)
+	{
+		fprintf(stderr, "invalid threads, iosize, file size or read ratio\n");
+		return -1;
+	}
+	if (duration < 0) {
+		duration = (byte_target) ? 0 : 60;
+	}
+
+	fprintf(stderr, "thread=%d, iosize=%d, sync=%d, metasync=%d, preallocate=%d, "
+	        "read=%d%%, %s, %s, verify=%d\n",
+	        threads, blocksize, sync_mode, metasync, preallocate, read_ratio,
+	        (random_offsets) ? "random" : "sequential",
+	        (append) ? "append" : "overwrite", verify);
 
-	pthread_t t[threads];
+	std::vector<pthread_t> t(threads);
+	std::vector<worker> workers(threads);
 
+	uint64_t start = now_ns();
 	for (long i = 0; i < threads; ++i) {
-		pthread_create(&t[i], 0, writer, (void*)i);
+		workers[i].number = i;
+		pthread_create(&t[i], 0, writer, &workers[i]);
 	}
 
+	size_t prev = 0;
+	long long storage_start = (pid > 0) ? storage_written(pid) : 0;
+	long long prev_storage = storage_start;
+	int interval = 10;
+	// 100 ms ticks, a byte target ends the run early
+	for (int tick = 1; !stop && (duration == 0 || tick <= duration * 10); ++tick) {
+		usleep(100000);
+		if (tick % (interval * 10) != 0) {
+			continue;
+		}
+		size_t cur = total_written;
+		if (pid > 0) {
+			long long storage = storage_written(pid);
+			fprintf(stderr, "written %.1f MB/s, storage %.1f MB/s, "
+			        "amplification %.2f (total %.2f)\n",
+			        (cur - prev) / 1048576.0 / interval,
+			        (storage - prev_storage) / 1048576.0 / interval,
+			        (cur > prev) ? (double)(storage - prev_storage) / (cur - prev) : 0.0,
+			        (cur > 0) ? (double)(storage - storage_start) / cur : 0.0);
+			prev_storage = storage;
+		} else {
+			fprintf(stderr, "written %.1f MB/s, read %.1f MB total\n",
+			        (cur - prev) / 1048576.0 / interval, total_read / 1048576.0);
+		}
+		prev = cur;
+	}
+	stop = 1;
+
 	for (int i = 0; i < threads; ++i) {
 		pthread_join(t[i], 0);
 	}
+	double seconds = (now_ns() - start) / 1e9;
 
-	return 0;
+	histogram reads, writes;
+	for (int i = 0; i < threads; ++i) {
+		reads.merge(workers[i].reads);
+		writes.merge(workers[i].writes);
+	}
+
+	printf("%.1f s, written %.1f MB (%.1f MB/s), read %.1f MB (%.1f MB/s)\n",
+	       seconds, total_written / 1048576.0, total_written / 1048576.0 / seconds,
+	       total_read / 1048576.0, total_read / 1048576.0 / seconds);
+	report("write", writes, seconds);
+	report("read", reads, seconds);
+	if (verify) {
+		printf("verify errors %lu\n", (unsigned long)verify_errors);
+	}
+
+	return (verify_errors > 0) ? 1 : 0;
 }
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+// clock and latency percentiles shared by the stats and the test tools.
+// header only, test-writer does not link the fs library
+
+inline uint64_t now_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// the p-th fraction of sorted samples, 0 when there are none
+inline uint64_t percentile(const std::vector<uint64_t> & sorted, double p)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	return sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * p))];
+}
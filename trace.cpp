@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include "trace.h"
+
+#ifdef LDBFS_TRACING
+
+enum { ring_size = 16*1024 }; // events per thread, a power of two
+
+struct trace_event
+{
+	const char * name;
+	uint64_t start; // ns
+	uint64_t end;
+};
+
+// one writer, the owning thread. readers copy and drop what was
+// overwritten meanwhile
+struct trace_ring
+{
+	trace_event events[ring_size];
+	boost::atomic<uint64_t> head;
+	// first event and tid of each owner still in the ring, under rings_mutex
+	std::vector<std::pair<uint64_t, long> > owners;
+
+	trace_ring(): head(0) {}
+
+	void own()
+	{
+		uint64_t h = head.load(boost::memory_order_relaxed);
+		owners.push_back(std::make_pair(h, (long)syscall(SYS_gettid)));
+		// owners whose events are all overwritten go
+		while (owners.size() > 1 && h >= ring_size && owners[1].first <= h - ring_size) {
+			owners.erase(owners.begin());
+		}
+	}
+};
+
+// a ring goes to the next new thread when its own exits, FUSE threads
+// come and go and there are no more rings than threads at once
+static boost::mutex rings_mutex;
+static std::vector<trace_ring *> rings;
+static std::vector<trace_ring *> free_rings;
+static __thread trace_ring * local = 0;
+
+static void release_ring(trace_ring * ring)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(rings_mutex);
+	free_rings.push_back(ring);
+}
+
+// only for its exit hook, trace_record reads local
+static boost::thread_specific_ptr<trace_ring> owned(release_ring);
+
+void trace_record(const char * name, uint64_t start, uint64_t end)
+{
+	if (!local) {
+		boost::unique_lock<boost::mutex> scoped_lock(rings_mutex);
+		if (free_rings.empty()) {
+			local = new trace_ring;
+			rings.push_back(local);
+		} else {
+			local = free_rings.back();
+			free_rings.pop_back();
+		}
+		local->own();
+		scoped_lock.unlock();
+		owned.reset(local);
+	}
+
+	uint64_t h = local->head.load(boost::memory_order_relaxed);
+	trace_event & e = local->events[h & (ring_size - 1)];
+	e.name = name;
+	e.start = start;
+	e.end = end;
+	local->head.store(h + 1, boost::memory_order_release);
+}
+
+struct ring_view
+{
+	trace_ring * ring;
+	std::vector<std::pair<uint64_t, long> > owners;
+	uint64_t head; // events up to here are of these owners
+};
+
+std::string trace_json()
+{
+	std::vector<ring_view> snapshot;
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(rings_mutex);
+		for (size_t k = 0; k < rings.size(); ++k) {
+			ring_view v = { rings[k], rings[k]->owners,
+			                rings[k]->head.load(boost::memory_order_acquire) };
+			snapshot.push_back(v);
+		}
+	}
+
+	std::string r = "{\"traceEvents\":[\n";
+	bool first = true;
+	char line[256];
+	std::vector<trace_event> events;
+	for (size_t k = 0; k < snapshot.size(); ++k) {
+		trace_ring * ring = snapshot[k].ring;
+		uint64_t head = snapshot[k].head;
+		uint64_t tail = (head > ring_size) ? head - ring_size : 0;
+		events.clear();
+		for (uint64_t i = tail; i < head; ++i) {
+			events.push_back(ring->events[i & (ring_size - 1)]);
+		}
+		// the writer went on while copying, its newest slots replaced the oldest.
+		// slot now may be half written before head is published, skip it too
+		uint64_t now = ring->head.load(boost::memory_order_acquire);
+		size_t skip = (now + 1 > tail + ring_size) ? now + 1 - tail - ring_size : 0;
+
+		const std::vector<std::pair<uint64_t, long> > & owners = snapshot[k].owners;
+		size_t o = 0;
+		for (size_t i = skip; i < events.size(); ++i) {
+			const trace_event & e = events[i];
+			while (o + 1 < owners.size() && owners[o + 1].first <= tail + i) {
+				++o;
+			}
+			snprintf(line, sizeof(line),
+			         "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,"
+			         "\"ts\":%.3f,\"dur\":%.3f}",
+			         (first) ? "" : ",\n", e.name, (int)getpid(), owners[o].second,
+			         e.start / 1000.0, (e.end - e.start) / 1000.0);
+			r += line;
+			first = false;
+		}
+	}
+	r += "\n],\"displayTimeUnit\":\"ns\"}\n";
+	return r;
+}
+
+static int signal_pipe[2] = {-1, -1};
+
+static void on_signal(int)
+{
+	char c = 0;
+	ssize_t r = write(signal_pipe[1], &c, 1); // async-signal-safe
+	(void)r;
+}
+
+static void dump_loop(std::string file)
+{
+	char c;
+	while (read(signal_pipe[0], &c, 1) == 1) {
+		std::string json = trace_json();
+		FILE * f = fopen(file.c_str(), "w");
+		if (f) {
+			fwrite(json.data(), 1, json.size(), f);
+			fclose(f);
+		}
+	}
+}
+
+void trace_dump_on_signal(const std::string & file)
+{
+	if (pipe(signal_pipe) != 0) {
+		return;
+	}
+	boost::thread(boost::bind(dump_loop, file)).detach();
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, 0);
+}
+
+#else
+
+std::string trace_json()
+{
+	return std::string();
+}
+
+void trace_dump_on_signal(const std::string & file)
+{
+}
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+#include "timing.h"
+
+// per-thread ring buffers of timed spans, FUSE ops and their stages.
+// built with LDBFS_TRACING (cmake -DTRACING=ON), compiled out otherwise.
+// dumped as chrome trace event json (perfetto, chrome://tracing,
+// speedscope) on SIGUSR1 or by reading /.ldbfs/trace
+//
+// span names must be string literals, only the pointer is kept
+
+#ifdef LDBFS_TRACING
+
+void trace_record(const char * name, uint64_t start, uint64_t end);
+
+struct trace_span
+{
+	const char * name;
+	uint64_t start;
+
+	trace_span(const char * name): name(name), start(now_ns()) {}
+	~trace_span() { trace_record(name, start, now_ns()); }
+};
+
+// time spent waiting for a lock
+template <class Lock>
+inline void trace_lock(Lock & lock, const char * name)
+{
+	uint64_t start = now_ns();
+	lock.lock();
+	trace_record(name, start, now_ns());
+}
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(name) trace_span TRACE_CONCAT(trace_span_, __LINE__)(name)
+#define TRACE_LOCK(l, name) trace_lock(l, name)
+
+#else
+
+#define TRACE_SPAN(name)
+#define TRACE_LOCK(l, name) (l).lock()
+
+#endif
+
+// spans of all threads, oldest first per thread; empty when compiled out
+std::string trace_json();
+// writes trace_json to file on every SIGUSR1
+void trace_dump_on_signal(const std::string & file);
@@ -0,0 +1,274 @@
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <boost/filesystem.hpp>
+
+#include "vlog.h"
+#include "fs.h"
+
+static const uint32_t vlog_magic = 0x676f6c76;
+
+static std::string segment_name(const std::string & dir, uint32_t id)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "/%08u.vlog", id);
+	return dir + buf;
+}
+
+vlog::segment::segment(uint32_t id, int fd, uint64_t size):
+	id(id), fd(fd), size(size), dead(0), scanned(true)
+{
+}
+
+vlog::segment::~segment()
+{
+	::close(fd);
+}
+
+vlog::vlog(): segment_size(64*1024*1024), appended(0), collected(0)
+{
+}
+
+bool vlog::open(const std::string & dir)
+{
+	boost::log::sources::severity_logger< >& lg = global_lg::get();
+	boost::system::error_code ec;
+
+	this->dir = dir;
+	boost::filesystem::create_directories(dir, ec);
+	if (ec) {
+		BOOST_LOG(lg) << "cannot create vlog " << dir << ": " << ec.message();
+		return false;
+	}
+
+	boost::filesystem::directory_iterator it(dir), end;
+	for (; it != end; ++it) {
+		uint32_t id;
+		std::string name = it->path().filename().string();
+		if (sscanf(name.c_str(), "%08u.vlog", &id) != 1) {
+			continue;
+		}
+
+		int fd = ::open(it->path().c_str(), O_RDWR);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			BOOST_LOG(lg) << "cannot open vlog segment " << it->path();
+			return false;
+		}
+
+		// garbage of old segments is unknown until gc scans them
+		boost::shared_ptr<segment> s(new segment(id, fd, st.st_size));
+		s->scanned = false;
+		segments[id] = s;
+	}
+
+	// never append after a possibly torn tail
+	return rotate();
+}
+
+bool vlog::rotate()
+{
+	if (head && fdatasync(head->fd) != 0) {
+		return false;
+	}
+
+	uint32_t id = (segments.empty()) ? 1 : segments.rbegin()->first + 1;
+	int fd = ::open(segment_name(dir, id).c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		return false;
+	}
+
+	int dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dirfd >= 0) {
+		fsync(dirfd);
+		::close(dirfd);
+	}
+
+	head.reset(new segment(id, fd, 0));
+	segments[id] = head;
+	return true;
+}
+
+bool vlog::append(const block_key & key, const std::string & data, pointer & ptr)
+{
+	header h;
+	h.magic = vlog_magic;
+	h.length = data.size();
+	memcpy(h.key, &key, sizeof(h.key));
+
+	struct iovec iov[2];
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = (void*)data.data();
+	iov[1].iov_len = data.size();
+
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	if (head->size >= segment_size && !rotate()) {
+		return false;
+	}
+
+	ssize_t n = pwritev(head->fd, iov, 2, head->size);
+	if (n != (ssize_t)(sizeof(h) + data.size())) {
+		return false;
+	}
+
+	ptr.segment = head->id;
+	ptr.offset = head->size + sizeof(h);
+	ptr.length = data.size();
+
+	head->size += n;
+	appended += n;
+	return true;
+}
+
+bool vlog::read(const pointer & ptr, std::string & data)
+{
+	boost::shared_ptr<segment> s;
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(mutex);
+		segments_t::iterator it = segments.find(ptr.segment);
+		if (it == segments.end()) {
+			return false;
+		}
+		s = it->second;
+	}
+
+	data.resize(ptr.length);
+	ssize_t n = pread(s->fd, &data[0], ptr.length, ptr.offset);
+	return n == (ssize_t)ptr.length;
+}
+
+void vlog::discard(const pointer & ptr)
+{
+	boost::unique_lock<boost::mutex> scoped_lock(mutex);
+	segments_t::iterator it = segments.find(ptr.segment);
+	if (it != segments.end()) {
+		it->second->dead += sizeof(header) + ptr.length;
+	}
+}
+
+bool vlog::sync()
+{
+	// sealed segments are synced by rotate
+	boost::shared_ptr<segment> s;
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(mutex);
+		s = head;
+	}
+	return fdatasync(s->fd) == 0;
+}
+
+bool vlog::scan(bucket & b, const boost::shared_ptr<segment> & s,
+                bool rewrite, uint64_t & live)
+{
+	header h;
+	std::string data;
+	uint64_t off = 0;
+
+	live = 0;
+	while (off + sizeof(h) <= s->size) {
+		if (pread(s->fd, &h, sizeof(h), off) != sizeof(h) || h.magic != vlog_magic) {
+			break; // torn tail
+		}
+
+		pointer ptr;
+		ptr.segment = s->id;
+		ptr.offset = off + sizeof(h);
+		ptr.length = h.length;
+
+		block_key key(*(block_key*)h.key);
+		std::string expected = encode(ptr);
+		std::string current;
+
+		if (b.read(key, current) && current == expected) {
+			live += sizeof(h) + h.length;
+
+			if (rewrite) {
+				pointer moved;
+				if (!read(ptr, data) || !append(key, data, moved)) {
+					return false;
+				}
+				if (b.replace(key, expected, encode(moved))) {
+					collected += sizeof(h) + h.length;
+				} else {
+					// overwritten meanwhile
+					discard(moved);
+				}
+			}
+		}
+
+		off += sizeof(h) + h.length;
+	}
+
+	return true;
+}
+
+uint64_t vlog::collect(bucket & b, double dead_ratio)
+{
+	boost::shared_ptr<segment> victim;
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(mutex);
+		for (segments_t::iterator it = segments.begin(); it != segments.end(); ++it) {
+			boost::shared_ptr<segment> & s = it->second;
+			if (s == head) {
+				continue;
+			}
+			if (!s->scanned) {
+				victim = s;
+				break;
+			}
+			if (s->dead >= s->size * dead_ratio &&
+			    (!victim || s->dead * victim->size > victim->dead * s->size))
+			{
+				victim = s;
+			}
+		}
+	}
+
+	if (!victim) {
+		return 0;
+	}
+
+	uint64_t live;
+	if (!victim->scanned) {
+		if (scan(b, victim, false, live)) {
+			boost::unique_lock<boost::mutex> scoped_lock(mutex);
+			victim->dead = victim->size - std::min(live, victim->size);
+			victim->scanned = true;
+		}
+		return 0;
+	}
+
+	// new pointers must be durable before the old copies go away
+	if (!scan(b, victim, true, live) || !b.flush(0)) {
+		return 0;
+	}
+
+	{
+		boost::unique_lock<boost::mutex> scoped_lock(mutex);
+		segments.erase(victim->id);
+	}
+	unlink(segment_name(dir, victim->id).c_str());
+
+	return victim->size - live;
+}
+
+std::string vlog::encode(const pointer & ptr)
+{
+	std::string value(1, (char)BLOCK_VLOG);
+	value.append((char*)&ptr, sizeof(ptr));
+	return value;
+}
+
+bool vlog::decode(const std::string & value, pointer & ptr)
+{
+	if (value.size() != 1 + sizeof(ptr) || value[0] != BLOCK_VLOG) {
+		return false;
+	}
+	memcpy(&ptr, value.data() + 1, sizeof(ptr));
+	return true;
+}
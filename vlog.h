@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <map>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "dentry.h"
+
+struct bucket;
+
+// value log of one data part: large block payloads are appended to
+// segment files, leveldb keeps only pointers to them
+struct vlog
+{
+#pragma pack (push, 1)
+	struct pointer
+	{
+		uint32_t segment;
+		uint64_t offset;
+		uint32_t length;
+	};
+
+	struct header
+	{
+		uint32_t magic;
+		uint32_t length;
+		char key[sizeof(block_key)];
+	};
+#pragma pack ( pop)
+
+	struct segment
+	{
+		uint32_t id;
+		int fd;
+		uint64_t size;
+		uint64_t dead;  // bytes known to be overwritten
+		bool scanned;   // dead is exact, segment existed before mount otherwise
+
+		segment(uint32_t id, int fd, uint64_t size);
+		~segment();
+	};
+
+	typedef std::map<uint32_t, boost::shared_ptr<segment> > segments_t;
+
+	std::string dir;
+	boost::mutex mutex;
+	segments_t segments;
+	boost::shared_ptr<segment> head;
+	uint64_t segment_size;
+
+	size_t appended;
+	size_t collected;
+
+	vlog();
+
+	bool open(const std::string & dir);
+	bool append(const block_key & key, const std::string & data, pointer & ptr);
+	bool read(const pointer & ptr, std::string & data);
+	void discard(const pointer & ptr);
+	bool sync();
+
+	// rewrites live records of one segment with at least
+	// dead_ratio garbage, returns bytes reclaimed
+	uint64_t collect(bucket & b, double dead_ratio);
+
+	static std::string encode(const pointer & ptr);
+	static bool decode(const std::string & value, pointer & ptr);
+
+private:
+	bool rotate();
+	bool scan(bucket & b, const boost::shared_ptr<segment> & s,
+	          bool rewrite, uint64_t & live);
+};